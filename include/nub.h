@@ -30,10 +30,161 @@ extern "C" {
 typedef struct nub_loop_s nub_loop_t;
 typedef struct nub_thread_s nub_thread_t;
 typedef struct nub_work_s nub_work_t;
+typedef struct nub_pool_s nub_pool_t;
+typedef struct nub_fiber_s nub_fiber_t;
+typedef struct nub_loop_group_s nub_loop_group_t;
+typedef struct nub__trace_s nub__trace_t;  /* Private */
 
 typedef void (*nub_complete_cb)(nub_work_t* work, int status);
 typedef void (*nub_thread_disposed_cb)(nub_thread_t* thread);
 typedef void (*nub_work_cb)(nub_thread_t* thread, nub_work_t* work, void* arg);
+typedef void (*nub_fiber_cb)(nub_fiber_t* fiber);
+typedef void* (*nub_call_cb)(nub_thread_t* thread, void* arg);
+typedef void (*nub_loop_group_cb)(nub_loop_group_t* group, nub_loop_t* loop);
+typedef void (*nub_thread_water_cb)(nub_thread_t* thread, int above);
+
+
+typedef enum {
+  NUB_LOOP_QUEUE_NONE,
+  NUB_LOOP_QUEUE_LOCK,
+  NUB_LOOP_QUEUE_DISPOSE,
+  NUB_LOOP_QUEUE_WORK,
+  NUB_LOOP_QUEUE_COMPLETE,
+  NUB_LOOP_QUEUE_LOCK_SHARED,
+  NUB_LOOP_QUEUE_TIMER,
+  NUB_LOOP_QUEUE_FIBER_LOCK,
+  NUB_LOOP_QUEUE_CALL,
+  NUB_LOOP_QUEUE_MIGRATE,
+  NUB_LOOP_QUEUE_WATER
+} uv_work_types;
+
+
+/* Priority classes for queued work. Higher classes run first, though work in
+ * a lower class that keeps getting passed over is eventually let through. */
+typedef enum {
+  NUB_PRIO_HIGH,
+  NUB_PRIO_NORMAL,
+  NUB_PRIO_LOW
+} nub_prio;
+
+#define NUB__PRIOS 3  /* Private */
+
+
+/* Used bi-directionally. Either pushed to a spawned thread's processing queue,
+ * or pushed to the event loop and then returned to the originating thread
+ * along with its status once complete. */
+struct nub_work_s {
+  /* public */
+  void* data;
+
+  /* private */
+  void* arg;
+  nub_work_cb cb;
+  nub_thread_t* thread;
+  nub_complete_cb complete_cb;
+  uv_work_types work_type;
+  int status;
+  nub_prio prio;  /* Class of the last nub_loop_enqueue*() */
+  nub_work_t* volatile next;  /* Link in a nub__mpscq_t or nub__wheel_t */
+  uint64_t due;  /* Wheel tick to run at */
+  uint64_t repeat;  /* Nanoseconds between runs, or 0 to run once */
+  uint64_t deadline;  /* uv_hrtime() it's dropped after, or 0 for none */
+  nub_complete_cb expired_cb;
+};
+
+/* Bytes of caller storage that follow each nub_work_t handed out by
+ * nub_loop_work_alloc() or nub_thread_work_alloc(), 16 byte aligned. */
+#define NUB_WORK_EXTRA_SIZE 48
+#define NUB_WORK_EXTRA(work)                                                  \
+  ((void*) ((char*) (work) + ((sizeof(nub_work_t) + 15) & ~(size_t) 15)))
+
+
+/* Intrusive lock-free multi-producer single-consumer queue of nub_work_t.
+ * Private. */
+typedef struct {
+  nub_work_t* volatile head_;  /* Pushed to by producers */
+  nub_work_t* tail_;  /* Shifted by the consumer */
+  nub_work_t stub_;
+} nub__mpscq_t;
+
+
+/* Post/wait handshake that spins before sleeping. Private. */
+typedef struct {
+  volatile int count_;  /* Posts not yet waited for */
+  volatile int sleeping_;  /* Set while the waiter sleeps on wake_ */
+  volatile int posting_;  /* Posts still running */
+  uint64_t spin_ns_;  /* How long the next wait spins before sleeping */
+  uv_sem_t wake_;
+} nub__handshake_t;
+
+
+/* Hashed timer wheel of work scheduled by a spawned thread for itself. Only
+ * touched by the owning thread. Private. */
+#define NUB__WHEEL_SLOTS 256
+typedef struct {
+  nub_work_t* slots_[NUB__WHEEL_SLOTS];
+  nub_work_t* due_;  /* Taken off the wheel and about to run */
+  uint64_t tick_;  /* Last tick looked at */
+  unsigned int count_;  /* Work scheduled, including due_ */
+} nub__wheel_t;
+
+
+/* Number of object sizes the slab allocator hands out. Private. */
+#define NUB__SLAB_CLASSES 2
+
+/* Free lists for one thread's share of the loop's slab allocations. Objects
+ * are always returned to the cache they came from. Private. */
+typedef struct nub__slab_cache_s nub__slab_cache_t;
+struct nub__slab_cache_s {
+  void* local_[NUB__SLAB_CLASSES];  /* Only touched by the owning thread */
+  void* volatile remote_[NUB__SLAB_CLASSES];  /* Freed by other threads */
+  nub__slab_cache_t* next_;  /* Link in the loop's slab_orphans_ */
+};
+
+
+/* Counters kept by the event loop. Read with nub_loop_stats(). Times are in
+ * nanoseconds. */
+typedef struct {
+  uint64_t iterations;  /* Times the loop looked for work from threads */
+  uint64_t work_processed;  /* Items run from nub_loop_enqueue() or _call() */
+  uint64_t outgoing_max;  /* Most items taken from one queue at once */
+  uint64_t lock_grants;  /* Threads let in by nub_loop_lock*() */
+  uint64_t lock_chain_max;  /* Most threads let in before the loop resumed */
+  uint64_t halted_ns;  /* Time spent halted for lock holders */
+  uint64_t halted_max_ns;
+  uint64_t wakes;  /* Threads woken after work was enqueued for them */
+  uint64_t wakes_coalesced;  /* Enqueues that didn't need to wake the thread */
+  uint64_t expired;  /* Items dropped past their deadline instead of run */
+  uint64_t budget_spent;  /* Iterations that left work for the next one */
+  unsigned int threads;  /* Threads currently attached */
+} nub_loop_stats_t;
+
+
+/* Counters kept by each thread. Read with nub_thread_stats(). Times are in
+ * nanoseconds. */
+typedef struct {
+  uint64_t enqueued;  /* Items from nub_thread_enqueue*() */
+  uint64_t rejected;  /* Items refused because the queue was full */
+  uint64_t expired;  /* Items dropped past their deadline instead of run */
+  uint64_t sent;  /* Items sent to other threads with nub_thread_send() */
+  uint64_t processed;  /* Items run, including completion callbacks */
+  uint64_t incoming_max;  /* Most items run from the queues in one go */
+  uint64_t loop_enqueued;  /* Items passed to nub_loop_enqueue() */
+  uint64_t calls;  /* nub_loop_call()s made */
+  uint64_t call_wait_ns;  /* Time spent waiting for calls to return */
+  uint64_t call_wait_max_ns;
+  uint64_t migrations;  /* Times moved to another loop */
+  uint64_t parks;  /* Times the thread went to sleep waiting for work */
+  uint64_t async_sent;  /* Times the event loop had to be signaled */
+  uint64_t async_coalesced;  /* Requests that found it already signaled */
+  uint64_t locks;  /* Times the loop was granted, exclusive or shared */
+  uint64_t lock_timeouts;  /* nub_loop_trylock() and _timeout() failures */
+  uint64_t lock_wait_ns;  /* Time spent waiting for the loop */
+  uint64_t lock_wait_max_ns;
+  uint64_t lock_hold_ns;  /* Time spent holding the loop */
+  uint64_t lock_hold_max_ns;
+  uint64_t cpu_ns;  /* CPU time used by the thread */
+} nub_thread_stats_t;
 
 
 struct nub_loop_s {
@@ -44,74 +195,347 @@ struct nub_loop_s {
   void* data;  /* User storage */
 
   /* private */
-  uv_sem_t loop_lock_sem_;
+  nub__handshake_t loop_lock_hs_;
 
   uv_prepare_t queue_processor_;
-  uv_mutex_t queue_processor_lock_;
-  fuq_queue_t blocking_queue_;
 
-  uv_mutex_t thread_dispose_lock_;
-  fuq_queue_t thread_dispose_queue_;
   volatile unsigned int ref_;   /* Nuber of threads attached to this loop */
 
-  fuq_queue_t work_queue_;
-  uv_mutex_t work_lock_;
-  uv_async_t* work_ping_;
-  volatile int disposed_;
+  /* Lock-free stack of threads that have pushed onto their outgoing_ queue
+   * since the loop last looked. Pushed to by spawned threads and taken as a
+   * whole by the event loop thread, so no thread ever waits on another. */
+  nub_thread_t* volatile ready_threads_;
+
+  /* Threads that have had completed work returned to them during the current
+   * loop iteration and still need to be woken. Only touched from the event
+   * loop thread. */
+  fuq_queue_t wake_queue_;
+
+  /* Threads waiting in nub_loop_lock(). Shifted by the event loop thread, or
+   * by the current lock holder when lock_handoff_ is set. */
+  nub__mpscq_t lock_queue_;
+  int lock_handoff_;
+  /* Number of threads granted the loop by nub_loop_lock_shared() that have
+   * yet to call nub_loop_unlock_shared(). */
+  volatile int shared_holders_;
+  /* Number of threads holding the loop or waiting for it. Lets
+   * nub_loop_trylock() fail without queueing when the loop is taken. */
+  volatile int lock_contenders_;
+  /* Copied to each thread created on this loop. */
+  uint64_t thread_spin_ns_;
+  /* Longest either side of the lock handshake spins before sleeping. */
+  uint64_t lock_spin_ns_;
+  /* When set nub_thread_enqueue() leaves waking the thread to the next
+   * wake_queue_ flush. wake_flusher_ flushes after the poll phase, and the
+   * queue_processor_ flushes before it. */
+  int defer_wake_;
+  uv_check_t wake_flusher_;
+  /* Most the queue_processor_ does per loop iteration, 0 for no limit. */
+  uint64_t budget_items_;
+  uint64_t budget_ns_;
+  /* Set while the queue_processor_ runs. */
+  struct nub__budget_s* budget_;
+  /* Active while work is left over from a spent budget, so polling doesn't
+   * block before it's done. */
+  uv_idle_t budget_idle_;
+  /* Items run ahead of each class while it had work waiting. */
+  uint64_t passed_over_[NUB__PRIOS];
+  /* Where the last drain cut short by the budget left off. The next one
+   * starts with that class, and that thread goes last. */
+  int drain_prio_;
+  nub_thread_t* drain_last_;
+  nub_loop_stats_t stats_;
+  /* Events each trace ring holds. 0 when tracing is off. */
+  unsigned int trace_size_;
+  unsigned int trace_next_id_;
+  nub__trace_t* traces_;  /* Every ring created on this loop */
+  nub__trace_t* trace_;  /* The event loop thread's own ring */
+  /* Work items and internal handles. Memory is only given back to the system
+   * by nub_loop_dispose(). */
+  nub__slab_cache_t slab_cache_;  /* The event loop thread's own cache */
+  void* volatile slabs_;  /* Every block allocated for this loop */
+  /* Caches left behind by joined threads, handed to the next new thread. */
+  nub__slab_cache_t* slab_orphans_;
+  /* Threads moving over from another loop with nub_thread_migrate(). */
+  nub__mpscq_t attach_queue_;
+  uv_async_t attach_signal_;
 };
 
 
 typedef enum {
-  NUB_LOOP_QUEUE_NONE,
-  NUB_LOOP_QUEUE_LOCK,
-  NUB_LOOP_QUEUE_DISPOSE,
-  NUB_LOOP_QUEUE_WORK
-} uv_work_types;
+  NUB_LOOP_LOCK_HANDOFF,
+  NUB_LOOP_THREAD_SPIN,
+  NUB_LOOP_DEFER_WAKE,
+  NUB_LOOP_LOCK_SPIN,
+  NUB_LOOP_TRACE,
+  NUB_LOOP_BUDGET_ITEMS,
+  NUB_LOOP_BUDGET_TIME
+} nub_loop_option;
 
 
-/* Will be used bi-directionally once the event loop accepts dispatch queues. */
-struct nub_work_s {
-  /* public */
-  void* data;
+/* Which fields of a nub_thread_options_t are set. */
+typedef enum {
+  NUB_THREAD_HAS_STACK_SIZE = 0x01,
+  NUB_THREAD_HAS_AFFINITY = 0x02,
+  NUB_THREAD_HAS_NAME = 0x04,
+  NUB_THREAD_HAS_PRIORITY = 0x08,
+  /* Not a field. Give the thread a uv_loop_t of its own. */
+  NUB_THREAD_OWN_LOOP = 0x10
+} nub_thread_option_flags;
+
+
+/* Same values as the Windows thread priorities. */
+typedef enum {
+  NUB_THREAD_PRIORITY_LOWEST = -2,
+  NUB_THREAD_PRIORITY_BELOW_NORMAL = -1,
+  NUB_THREAD_PRIORITY_NORMAL = 0,
+  NUB_THREAD_PRIORITY_ABOVE_NORMAL = 1,
+  NUB_THREAD_PRIORITY_HIGHEST = 2
+} nub_thread_priority;
 
-  /* private */
-  void* arg;
-  nub_work_cb cb;
-  nub_thread_t* thread;
-  nub_complete_cb complete_cb;
-  uv_work_types work_type;
-};
+
+/* Passed to nub_thread_create_ex(). Only fields named in flags are read, and
+ * only for the duration of the call. */
+typedef struct {
+  unsigned int flags;  /* Any of nub_thread_option_flags */
+  size_t stack_size;  /* Rounded up to the page size and system minimum */
+  /* CPUs the thread may run on, one char per CPU starting from CPU 0. A
+   * non-zero char lets the thread run on that CPU. */
+  const char* cpumask;
+  size_t cpumask_size;
+  const char* name;  /* Truncated to 15 characters on Linux */
+  nub_thread_priority priority;
+} nub_thread_options_t;
 
 
 struct nub_thread_s {
   /* read-only */
   uv_thread_t uvthread;  /* must come first */
   nub_loop_t* nubloop;
+  /* The thread's own loop when created with NUB_THREAD_OWN_LOOP, otherwise
+   * NULL. Only to be used from the thread itself. */
+  uv_loop_t* uvloop;
   volatile int disposed;
 
   /* public */
   void* data;
 
   /* private */
-  fuq_queue_t incoming_;
-  uv_sem_t thread_lock_sem_;
+  fuq_queue_t incoming_[NUB__PRIOS];
+  /* Items run from a higher class while each class had work waiting. */
+  unsigned int passed_over_[NUB__PRIOS];
+  /* Work sent from other spawned threads with nub_thread_send(). */
+  nub__mpscq_t inbox_;
+  /* Fibers the loop has been halted for. Switched to ahead of anything else
+   * queued, as the loop stays halted until they are. */
+  nub__mpscq_t granted_;
+  /* Work and dispose requests for the event loop, one queue per class. Only
+   * pushed to by this thread and only shifted by the event loop thread. */
+  fuq_queue_t outgoing_[NUB__PRIOS];
+  /* Set while the thread is in the nub_loop_t's ready_threads_ stack. */
+  volatile int outgoing_signaled_;
+  nub_thread_t* next_ready_;
+  /* Link in the list of threads the event loop is draining. Kept apart from
+   * next_ready_ since the thread may push itself again in the meantime. */
+  nub_thread_t* next_drain_;
+  nub__handshake_t thread_lock_hs_;
+  /* Where the thread's lock request is at. A request that timed out stays in
+   * the lock_queue_ until it's skipped, and can be revived until then. */
+  volatile int lock_state_;
   /* Must be separately allocated so the handle can be closed after the thread
    * is gone. Used in an internal uv_async_send() call to signal the event loop
    * a thread has work to do. */
   uv_async_t* async_signal_;
-  uv_sem_t sem_wait_;
+  uv_mutex_t park_lock_;
+  uv_cond_t park_cond_;
+  /* Wakes posted to the thread and not yet taken. Guarded by park_lock_. */
+  unsigned int park_posts_;
+  /* Set by the thread before it waits for a post. Whoever swaps it back to
+   * zero is responsible for posting, so enqueuing work for a thread that's
+   * still running skips the post entirely. */
+  volatile int parked_;
+  /* How long to look for more work before parking. */
+  uint64_t spin_ns_;
+  nub__wheel_t wheel_;
   nub_thread_disposed_cb disposed_cb_;
+  /* Set while the thread is in the nub_loop_t's wake_queue_. */
+  int wake_pending_;
+  /* Set if the thread is owned by a nub_pool_t. */
+  nub_pool_t* pool_;
+  /* Limits set with nub_thread_limit(). Only work from nub_thread_enqueue*()
+   * counts against them. put_ is only written by whoever enqueues, taken_
+   * only by the thread, so their difference is what's still queued. */
+  unsigned int capacity_;
+  unsigned int high_water_;
+  unsigned int low_water_;
+  nub_thread_water_cb water_cb_;
+  volatile unsigned int put_;
+  volatile unsigned int taken_;
+  /* Whether water_cb_ was last told the queue is above high_water_. Once the
+   * thread sees it drain it hands water_work_ to the event loop, which makes
+   * the call. */
+  volatile int water_state_;
+  nub_work_t water_work_;
+  /* Each counter has a single writer at a time: the thread itself, or
+   * whoever is allowed to enqueue work for it. */
+  nub_thread_stats_t stats_;
+  uint64_t lock_since_;  /* When the thread was last let into the loop */
+  volatile int exited_;  /* Set once stats_.cpu_ns is final */
+  nub__trace_t* trace_;
+  nub__slab_cache_t* slab_cache_;
+  struct nub__fiber_host_s* fiber_host_;  /* Set once it has run a fiber */
+  struct nub__own_loop_s* own_loop_;  /* Backs uvloop */
+  /* Set until the thread has applied the options it was created with. */
+  struct nub__thread_start_s* start_;
 
   nub_work_t work;
 };
 
 
+struct nub_pool_s {
+  /* read-only */
+  nub_loop_t* nubloop;
+  unsigned int min_threads;
+  unsigned int max_threads;
+  unsigned int nthreads;  /* Number of threads currently running */
+
+  /* public */
+  void* data;  /* User storage */
+
+  /* private */
+  struct nub_pool_worker_s* workers_;  /* One slot for each of max_threads */
+  unsigned int next_worker_;
+  volatile int pending_;  /* Work queued across all workers */
+  unsigned int retiring_;  /* Threads brought down but not yet joined */
+  uv_timer_t shrink_timer_;
+};
+
+
+/* Event loops that each run on a thread of their own. */
+struct nub_loop_group_s {
+  /* read-only */
+  nub_loop_t* loops;
+  unsigned int nloops;
+
+  /* public */
+  void* data;  /* User storage */
+
+  /* private */
+  /* One per loop. Keeps the loop running until nub_loop_group_stop(). */
+  uv_async_t* stop_signals_;
+  uv_thread_t* runners_;  /* Run loops[1] and up */
+  nub_loop_group_cb stop_cb_;
+  volatile int stopped_;
+};
+
+
+/* Runs on a stack of its own, multiplexed with the other fibers of the
+ * spawned thread it was created on. Switching only happens where a fiber
+ * waits, so fibers of the same thread never run at the same time. */
+struct nub_fiber_s {
+  /* read-only */
+  nub_thread_t* thread;
+
+  /* public */
+  void* data;  /* User storage */
+
+  /* private */
+  nub_fiber_cb cb_;
+  nub_fiber_cb done_cb_;
+  void* context_;  /* Saved registers, at the start of the stack allocation */
+  int status_;  /* Of the last nub_fiber_loop_run() */
+  int done_;
+  /* Resumes the fiber when run by its thread. Also its lock request and the
+   * work shipped by nub_fiber_loop_run(). */
+  nub_work_t work;
+};
+
+
 /**
  * Initialize the event loop.
  */
 NUB_EXTERN void nub_loop_init(nub_loop_t* loop);
 
 
+/**
+ * Set additional loop options. Should be run from the event loop thread
+ * before any threads are attached to the loop.
+ *
+ * Supported options:
+ *
+ *  - NUB_LOOP_LOCK_HANDOFF: Takes an int. When non-zero, nub_loop_unlock()
+ *    passes the loop directly to the next thread waiting in nub_loop_lock().
+ *    The event loop thread only resumes once no thread is waiting. Saves a
+ *    round trip through the event loop thread for every lock holder, at the
+ *    cost of the event loop not running while threads keep queuing up.
+ *
+ *  - NUB_LOOP_THREAD_SPIN: Takes an unsigned int number of microseconds.
+ *    Threads created afterwards keep looking for work for this long after
+ *    running out, spinning for the first half and yielding for the second,
+ *    before they park. Enqueuing work for a thread that hasn't parked doesn't
+ *    need to wake it. Defaults to 0, which parks immediately.
+ *
+ *  - NUB_LOOP_DEFER_WAKE: Takes an int. When non-zero, threads are no longer
+ *    woken by each nub_thread_enqueue() call. Instead every thread that had
+ *    work enqueued is woken once per event loop iteration, before and after
+ *    polling for I/O. Work enqueued from a callback is picked up once the
+ *    current loop phase finishes.
+ *
+ *  - NUB_LOOP_LOCK_SPIN: Takes an unsigned int number of microseconds. Both
+ *    a thread waiting for the loop in nub_loop_lock() and the event loop
+ *    thread waiting for it back spin for up to this long before sleeping.
+ *    How long they actually spin adapts to how long recent waits took. Short
+ *    critical sections then never put either side to sleep. Defaults to 0,
+ *    which sleeps immediately.
+ *
+ *  - NUB_LOOP_TRACE: Takes an unsigned int number of events. The event loop
+ *    thread and every thread created afterwards record work being enqueued
+ *    and run, lock requests, grants and releases, and parking, each into
+ *    their own ring holding the last this many events. Write them out with
+ *    nub_loop_trace_dump(). Defaults to 0, which records nothing.
+ *
+ *  - NUB_LOOP_BUDGET_ITEMS: Takes an unsigned int. Most work items, lock
+ *    grants and dispose requests from threads the event loop handles per
+ *    iteration before it goes on to poll for I/O. Whatever is left is picked
+ *    up first thing next iteration, starting where it was left off with the
+ *    thread that ran the budget out going last, and polling doesn't block
+ *    until it's done. A thread waiting on the loop is let in at least once
+ *    per iteration either way. Keeps threads that never stop asking for the
+ *    loop from starving its I/O. Defaults to 0, which handles everything that
+ *    shows up.
+ *
+ *  - NUB_LOOP_BUDGET_TIME: Takes an unsigned int number of microseconds. Same
+ *    as NUB_LOOP_BUDGET_ITEMS, but stops once this much time has passed. The
+ *    clock is read after every lock holder and every few work items, so the
+ *    budget can be overrun by one holder's critical section. In handoff mode
+ *    holders stop passing the loop along once it's spent. Both budgets can be
+ *    set, and whichever runs out first ends the iteration. Defaults to 0.
+ *
+ * Returns 0 on success, or UV_ENOSYS for an unknown option.
+ */
+NUB_EXTERN int nub_loop_configure(nub_loop_t* loop,
+                                  nub_loop_option option,
+                                  ...);
+
+
+/**
+ * Copy the loop's counters into stats. Can be run from any thread, though
+ * counters still being updated may be slightly out of date.
+ */
+NUB_EXTERN void nub_loop_stats(nub_loop_t* loop, nub_loop_stats_t* stats);
+
+
+/**
+ * Write the events recorded since NUB_LOOP_TRACE was set to path, in the
+ * Chrome trace event format. The result can be loaded into chrome://tracing
+ * or Perfetto. Should be run from the event loop thread, ideally while no
+ * threads are running, otherwise the latest events may be missing.
+ *
+ * Returns 0 on success, or UV_EIO if the file couldn't be written.
+ */
+NUB_EXTERN int nub_loop_trace_dump(nub_loop_t* loop, const char* path);
+
+
 /**
  * Run the event loop.
  *
@@ -136,13 +560,32 @@ NUB_EXTERN void nub_loop_dispose(nub_loop_t* loop);
  * Useful for cases where the return values of specific calls are needed
  * synchronously (e.g. creating a handle in libuv).
  *
- * The nub_thread_t passed must be the same as the calling thread.
+ * The nub_thread_t passed must be the same as the calling thread, which must
+ * not be one that runs fibers. See nub_fiber_create().
  *
  * Return value is the same as uv_async_send().
  */
 NUB_EXTERN int nub_loop_lock(nub_thread_t* thread);
 
 
+/**
+ * Same as nub_loop_lock(), but fails with UV_EBUSY instead of waiting when
+ * another thread holds the loop or is already waiting for it. When the loop
+ * is free this still waits for the event loop thread to finish what it's
+ * currently running.
+ */
+NUB_EXTERN int nub_loop_trylock(nub_thread_t* thread);
+
+
+/**
+ * Same as nub_loop_lock(), but gives up after timeout nanoseconds and returns
+ * UV_ETIMEDOUT. The request is withdrawn, so the loop never halts for a thread
+ * that has stopped waiting. The calling thread spins and yields while it
+ * waits, so this is meant for short timeouts.
+ */
+NUB_EXTERN int nub_loop_lock_timeout(nub_thread_t* thread, uint64_t timeout);
+
+
 /**
  * Tell the event loop to resume execution as normal.
  *
@@ -151,18 +594,77 @@ NUB_EXTERN int nub_loop_lock(nub_thread_t* thread);
 NUB_EXTERN void nub_loop_unlock(nub_thread_t* thread);
 
 
+/**
+ * Same as nub_loop_lock(), except any number of threads can hold the loop at
+ * the same time in shared mode. Threads waiting in nub_loop_lock_shared() one
+ * after the other are let in together. A thread waiting in nub_loop_lock()
+ * still gets the loop to itself, and shared lockers that come after it wait
+ * their turn.
+ *
+ * While holding the loop in shared mode the thread may only read event loop
+ * state, e.g. uv_now() or uv_is_active(). Nothing may be started, stopped,
+ * created or closed.
+ *
+ * Return value is the same as uv_async_send().
+ */
+NUB_EXTERN int nub_loop_lock_shared(nub_thread_t* thread);
+
+
+/**
+ * Release a shared hold on the event loop. The event loop resumes once all
+ * threads holding it in shared mode have called this.
+ */
+NUB_EXTERN void nub_loop_unlock_shared(nub_thread_t* thread);
+
+
 /**
  * Enqueue work to be done by the event loop thread. The work callback
  * will be run asyncronously and the completion callback will be
  * ennqueued immediately after the work is done.
  *
- * Should only be run from a spawned thread.
+ * The completion callback runs on the thread that enqueued the work, with a
+ * status of 0 if the work was run. All work completed for a thread during the
+ * same event loop iteration is returned with a single wake-up. Once the
+ * completion callback is called the nub_work_t can be enqueued again. cb can
+ * be NULL, in which case nothing is returned to the thread.
+ *
+ * Should only be run from a spawned thread. The thread must not be disposed
+ * while it has work enqueued on the event loop.
  */
 NUB_EXTERN void nub_loop_enqueue(nub_thread_t* thread,
                                  nub_work_t* work,
                                  nub_complete_cb cb);
 
 
+/**
+ * Same as nub_loop_enqueue(), in the given priority class. Each time the loop
+ * looks for work, queued NUB_PRIO_HIGH work from all threads runs before any
+ * other. If a budget keeps the loop from getting to a lower class, that class
+ * goes first once it's been passed over long enough. The completion is
+ * returned to the thread in the same class. nub_loop_enqueue() uses
+ * NUB_PRIO_NORMAL.
+ */
+NUB_EXTERN void nub_loop_enqueue_prio(nub_thread_t* thread,
+                                      nub_work_t* work,
+                                      nub_complete_cb cb,
+                                      nub_prio prio);
+
+
+/**
+ * Run cb on the event loop thread and wait for it to return. The loop is only
+ * taken up while cb runs, not for as long as the caller takes to be scheduled
+ * back in as with nub_loop_lock(). What cb returns is stored in result, which
+ * can be NULL. cb runs in order with the thread's NUB_PRIO_NORMAL work.
+ *
+ * Must be run from the spawned thread, and not while holding the loop. Threads
+ * that run fibers must use nub_fiber_loop_run() instead.
+ */
+NUB_EXTERN int nub_loop_call(nub_thread_t* thread,
+                             nub_call_cb cb,
+                             void* arg,
+                             void** result);
+
+
 /**
  * Spawn a new thread and attach it to the passed event loop.
  *
@@ -174,6 +676,33 @@ NUB_EXTERN void nub_loop_enqueue(nub_thread_t* thread,
 NUB_EXTERN int nub_thread_create(nub_loop_t* loop, nub_thread_t* thread);
 
 
+/**
+ * Same as nub_thread_create(), with control over how the thread is spawned.
+ * options can be NULL.
+ *
+ * The affinity, name and priority are set from the new thread before it runs
+ * any work, and the call doesn't return until they are. If any of them can't
+ * be set the thread is brought back down and the error is returned, e.g.
+ * UV_EINVAL when the cpumask allows no CPU, UV_EPERM when raising the priority
+ * above the process's own needs privileges the process doesn't have, or
+ * UV_ENOTSUP where the platform has no way to set the affinity. Names are
+ * ignored on platforms without thread names.
+ *
+ * The priority is relative to the one the thread starts with, so
+ * NUB_THREAD_PRIORITY_NORMAL leaves it alone and lowering it always works.
+ * On Linux each step is 5 nice values, kept within the range nice allows.
+ *
+ * With NUB_THREAD_OWN_LOOP the thread gets its own uv_loop_t in
+ * thread->uvloop. It's run whenever the thread goes looking for work, and
+ * the thread sleeps in it when there's none, so handles on it are serviced
+ * from the thread without ever taking the event loop lock. Everything on it
+ * must be closed before nub_thread_dispose().
+ */
+NUB_EXTERN int nub_thread_create_ex(nub_loop_t* loop,
+                                    nub_thread_t* thread,
+                                    const nub_thread_options_t* options);
+
+
 /**
  * Dispose of a thread. Call from the thread that needs to be disposed. Should
  * be the last call from that thread. This will make an internal call to end
@@ -200,11 +729,330 @@ NUB_EXTERN void nub_thread_dispose(nub_thread_t* thread,
 NUB_EXTERN void nub_thread_join(nub_thread_t* thread);
 
 
+/**
+ * Move the thread over to another event loop. Must be run from the spawned
+ * thread, which waits until everything it already pushed to its current loop
+ * has been processed and the new loop has taken it in.
+ *
+ * The thread must not hold or be waiting for its loop, and nothing left on
+ * the old loop may enqueue work for it afterwards. Both loops must be running
+ * and must outlive the thread. Returns UV_EINVAL for a thread owned by a
+ * nub_pool_t, which stays where it is.
+ */
+NUB_EXTERN int nub_thread_migrate(nub_thread_t* thread, nub_loop_t* to);
+
+
+/**
+ * Copy the thread's counters into stats. Can be run from any thread, though
+ * counters still being updated may be slightly out of date. Still works after
+ * the thread has been joined, as long as the nub_thread_t is around.
+ */
+NUB_EXTERN void nub_thread_stats(nub_thread_t* thread,
+                                 nub_thread_stats_t* stats);
+
+
+/**
+ * Bound the thread's processing queue. Must be run from the event loop thread,
+ * and applies to work enqueued afterwards.
+ *
+ * Once capacity items are queued, nub_thread_enqueue*() refuse more with
+ * UV_EAGAIN until the thread catches up. 0 leaves the queue unbounded.
+ *
+ * If cb isn't NULL it's run on the event loop thread with above set to 1 as
+ * soon as an enqueue brings the queue up to high_water items, then with above
+ * set to 0 once the thread has worked it back down to low_water. That gives
+ * the producer a chance to slow down before anything is refused. low_water
+ * must be less than high_water.
+ *
+ * Completion callbacks returned from the loop and work sent with
+ * nub_thread_send() are never refused or counted.
+ */
+NUB_EXTERN void nub_thread_limit(nub_thread_t* thread,
+                                 unsigned int capacity,
+                                 unsigned int high_water,
+                                 unsigned int low_water,
+                                 nub_thread_water_cb cb);
+
+
 /**
  * Push data onto the processing queue. Should only be run from the nub_loop_t
  * thread. This will signal the spawned thread there is an item on the queue.
+ *
+ * Returns UV_EAGAIN if the queue is full, see nub_thread_limit().
+ */
+NUB_EXTERN int nub_thread_enqueue(nub_thread_t* thread, nub_work_t* work);
+
+
+/**
+ * Same as nub_thread_enqueue(), in the given priority class. The thread runs
+ * whatever is queued in the highest class first. Work in a lower class runs
+ * anyway once higher classes have run ahead of it a fixed number of times, so
+ * a steady stream of urgent work can't starve it. Work within a class runs in
+ * the order it was enqueued. nub_thread_enqueue() uses NUB_PRIO_NORMAL.
  */
-NUB_EXTERN void nub_thread_enqueue(nub_thread_t* thread, nub_work_t* work);
+NUB_EXTERN int nub_thread_enqueue_prio(nub_thread_t* thread,
+                                       nub_work_t* work,
+                                       nub_prio prio);
+
+
+/**
+ * Run work on the calling spawned thread once timeout nanoseconds have
+ * passed. Must be run from the thread itself. The thread keeps its own timer
+ * wheel, so neither the event loop nor its lock is involved. Timers have a
+ * resolution of 1ms and never run early. They're checked whenever the thread
+ * runs out of queued work, and the thread only sleeps until the next one is
+ * due.
+ *
+ * The work must not be queued anywhere else until it has run or been
+ * cancelled. Timers still pending when the thread is disposed never run.
+ */
+NUB_EXTERN void nub_thread_enqueue_after(nub_thread_t* thread,
+                                         nub_work_t* work,
+                                         uint64_t timeout);
+
+
+/**
+ * Same as nub_thread_enqueue_after(), then again every repeat nanoseconds
+ * until cancelled with nub_thread_cancel_after(). Can be cancelled from its
+ * own callback.
+ */
+NUB_EXTERN void nub_thread_enqueue_repeat(nub_thread_t* thread,
+                                          nub_work_t* work,
+                                          uint64_t timeout,
+                                          uint64_t repeat);
+
+
+/**
+ * Cancel work scheduled with nub_thread_enqueue_after() or
+ * nub_thread_enqueue_repeat(). Must be run from the same thread. Returns
+ * UV_ENOENT if the work isn't scheduled, e.g. because it already ran.
+ */
+NUB_EXTERN int nub_thread_cancel_after(nub_thread_t* thread, nub_work_t* work);
+
+
+/**
+ * Send work directly from one spawned thread to another, without going
+ * through the event loop thread. Can be run from any spawned thread, and any
+ * number of threads can send to the same thread at once. from must be the
+ * calling thread, and both threads must be attached to the same loop. The
+ * receiving thread must not be disposed or joined while work can still be
+ * sent to it.
+ *
+ * Work sent by a given thread runs in the order it was sent, but isn't
+ * ordered with work pushed by nub_thread_enqueue().
+ */
+NUB_EXTERN void nub_thread_send(nub_thread_t* from,
+                                nub_thread_t* to,
+                                nub_work_t* work);
+
+
+/**
+ * Push n items onto the processing queue, in order, waking the spawned thread
+ * at most once. Same restrictions as nub_thread_enqueue(). If they don't all
+ * fit none are pushed and UV_EAGAIN is returned.
+ */
+NUB_EXTERN int nub_thread_enqueue_batch(nub_thread_t* thread,
+                                        nub_work_t** works,
+                                        unsigned int n);
+
+
+/**
+ * Initialize a pool of spawned threads attached to the passed event loop.
+ * Each thread in the pool has its own queue of work, and threads that run out
+ * of work will steal from the queues of other threads in the pool.
+ *
+ * min_threads are started immediately. As work backs up additional threads
+ * are started, up to max_threads. Threads above min_threads that have sat
+ * idle for a while are brought back down. Must be run from the event loop
+ * thread and min_threads must be at least 1.
+ *
+ * Threads in the pool keep the event loop alive until nub_pool_dispose() is
+ * called.
+ *
+ * Return value is the same as uv_thread_create(). On error the pool is
+ * disposed of before returning.
+ */
+NUB_EXTERN int nub_pool_init(nub_loop_t* loop,
+                             nub_pool_t* pool,
+                             unsigned int min_threads,
+                             unsigned int max_threads);
+
+
+/**
+ * Push work onto the pool. Should only be run from the nub_loop_t thread.
+ * Which thread runs the work is unspecified. The nub_thread_t passed to the
+ * work callback is the pool thread that ran it.
+ */
+NUB_EXTERN void nub_pool_enqueue(nub_pool_t* pool, nub_work_t* work);
+
+
+/**
+ * Join all threads in the pool. All work already pushed to the pool is run
+ * before the threads are brought down. Must be run from the event loop
+ * thread.
+ */
+NUB_EXTERN void nub_pool_dispose(nub_pool_t* pool);
+
+
+/**
+ * Initialize nloops event loops to be run together by nub_loop_group_run().
+ * Each is a regular nub_loop_t that threads can be created on, from the
+ * calling thread before the group runs or from the loop's own thread after.
+ *
+ * Returns UV_EINVAL if nloops is 0, or UV_ENOMEM.
+ */
+NUB_EXTERN int nub_loop_group_init(nub_loop_group_t* group,
+                                   unsigned int nloops);
+
+
+/**
+ * Listen on addr from every loop in the group. servers must hold nloops
+ * handles, each initialized on the loop at the same index. The sockets share
+ * the address with SO_REUSEPORT, so the kernel spreads new connections
+ * across the loops. If addr has port 0 the first socket picks one and the
+ * rest share it. Must be run before nub_loop_group_run().
+ *
+ * Returns UV_ENOTSUP on platforms without SO_REUSEPORT. On failure no
+ * handle is left listening, though the ones initialized are still closing.
+ */
+NUB_EXTERN int nub_loop_group_listen(nub_loop_group_t* group,
+                                     uv_tcp_t* servers,
+                                     const struct sockaddr* addr,
+                                     int backlog,
+                                     uv_connection_cb cb);
+
+
+/**
+ * Run every loop in the group, loops[0] on the calling thread and the others
+ * on threads of their own, until nub_loop_group_stop() is called and each
+ * loop has nothing left to do. Returns the same as nub_loop_run() for
+ * loops[0], or the error from spawning a thread, in which case the group is
+ * stopped.
+ */
+NUB_EXTERN int nub_loop_group_run(nub_loop_group_t* group);
+
+
+/**
+ * Let the loops of the group return once they have nothing left to do. Can
+ * be run from any thread, and only the first call has any effect. cb, which
+ * can be NULL, runs from each loop's own thread first, e.g. to close the
+ * handles from nub_loop_group_listen().
+ */
+NUB_EXTERN void nub_loop_group_stop(nub_loop_group_t* group,
+                                    nub_loop_group_cb cb);
+
+
+/**
+ * Dispose of every loop in the group. Same rules as nub_loop_dispose().
+ */
+NUB_EXTERN void nub_loop_group_dispose(nub_loop_group_t* group);
+
+
+/**
+ * The loop with the fewest threads attached. Ties go to the lowest index. The
+ * counts are read without synchronization, so they can be slightly behind.
+ */
+NUB_EXTERN nub_loop_t* nub_loop_group_least_loaded(nub_loop_group_t* group);
+
+
+/**
+ * Move the thread to the group's least loaded loop, not counting the thread
+ * itself against the loop it's on. Same rules as nub_thread_migrate().
+ */
+NUB_EXTERN int nub_loop_group_attach(nub_loop_group_t* group,
+                                     nub_thread_t* thread);
+
+
+/**
+ * Allocate a nub_work_t from the loop's slab of work items. Must be run from
+ * the event loop thread. Initialize it with nub_work_init() before use.
+ *
+ * Each thread allocates from its own free list, and items freed by another
+ * thread are handed back to the thread that allocated them, so neither side
+ * normally takes a lock or calls malloc(). Returns NULL if out of memory.
+ *
+ * NUB_WORK_EXTRA(work) points at NUB_WORK_EXTRA_SIZE bytes that come with the
+ * item, for whatever the work callback needs alongside it.
+ */
+NUB_EXTERN nub_work_t* nub_loop_work_alloc(nub_loop_t* loop);
+
+
+/**
+ * Same as nub_loop_work_alloc(), but run from the spawned thread.
+ */
+NUB_EXTERN nub_work_t* nub_thread_work_alloc(nub_thread_t* thread);
+
+
+/**
+ * Free a nub_work_t from nub_loop_work_alloc() or nub_thread_work_alloc().
+ * Must be run from the event loop thread. The item can come from any thread
+ * on the same loop.
+ */
+NUB_EXTERN void nub_loop_work_free(nub_loop_t* loop, nub_work_t* work);
+
+
+/**
+ * Same as nub_loop_work_free(), but run from the spawned thread.
+ */
+NUB_EXTERN void nub_thread_work_free(nub_thread_t* thread, nub_work_t* work);
+
+
+/**
+ * Start a fiber on the calling spawned thread. cb runs on a stack of
+ * stack_size bytes, or a default of 64KiB when 0, the next time the thread
+ * looks for work. Must be run from the spawned thread itself.
+ *
+ * done_cb, which can be NULL, runs on the thread's own stack once cb has
+ * returned and the fiber's stack is gone, and is the first point the
+ * nub_fiber_t can be reused or freed. All fibers must be done before their
+ * thread is disposed.
+ *
+ * Once a thread runs fibers, nothing on it may wait on the loop through
+ * nub_loop_lock(), nub_loop_lock_timeout(), nub_loop_lock_shared() or
+ * nub_loop_call(), whether from a fiber or from ordinary work. The loop can
+ * be halted for one of the thread's fibers, which then never gets to run.
+ * Use nub_fiber_lock() and nub_fiber_loop_run() instead.
+ *
+ * Returns UV_ENOMEM if the stack couldn't be allocated.
+ */
+NUB_EXTERN int nub_fiber_create(nub_thread_t* thread,
+                                nub_fiber_t* fiber,
+                                size_t stack_size,
+                                nub_fiber_cb cb,
+                                nub_fiber_cb done_cb);
+
+
+/**
+ * Let the thread's other runnable fibers and queued work run before this
+ * fiber continues. Must be run from the fiber.
+ */
+NUB_EXTERN void nub_fiber_yield(nub_fiber_t* fiber);
+
+
+/**
+ * Same as nub_loop_lock(), but only the fiber waits. The thread goes on to
+ * run other fibers and work until the loop is halted for this one. Must be
+ * run from the fiber, which must not wait on anything else until it calls
+ * nub_fiber_unlock().
+ */
+NUB_EXTERN int nub_fiber_lock(nub_fiber_t* fiber);
+
+
+/**
+ * Release the lock taken with nub_fiber_lock().
+ */
+NUB_EXTERN void nub_fiber_unlock(nub_fiber_t* fiber);
+
+
+/**
+ * Run cb on the event loop thread, the same as nub_loop_enqueue(), and
+ * suspend the fiber until it has. The nub_work_t passed to cb is the fiber's
+ * own, with data pointing at the fiber. Returns the completion status. Must
+ * be run from the fiber.
+ */
+NUB_EXTERN int nub_fiber_loop_run(nub_fiber_t* fiber,
+                                  nub_work_cb cb,
+                                  void* arg);
 
 
 /**
@@ -214,6 +1062,22 @@ NUB_EXTERN void nub_thread_enqueue(nub_thread_t* thread, nub_work_t* work);
  */
 NUB_EXTERN void nub_work_init(nub_work_t* work, nub_work_cb cb, void* arg);
 
+
+/**
+ * Drop the work instead of running it if it's still queued once uv_hrtime()
+ * passes deadline. Set before enqueuing, 0 clears it. nub_work_init() clears
+ * it as well.
+ *
+ * Dropped work passed to nub_loop_enqueue() completes with UV_ETIMEDOUT.
+ * Otherwise cb, which can be NULL, is run with UV_ETIMEDOUT on the thread
+ * that would have run the work, so whatever it holds can be released. Work
+ * already running is never interrupted, and work scheduled with
+ * nub_thread_enqueue_after() ignores the deadline.
+ */
+NUB_EXTERN void nub_work_set_deadline(nub_work_t* work,
+                                      uint64_t deadline,
+                                      nub_complete_cb cb);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,150 @@
+#ifndef LIBNUB_NUB_HPP_
+#define LIBNUB_NUB_HPP_
+
+/* Optional C++11 wrapper around nub.h. Header only, and like the rest of the
+ * library it doesn't throw. Errors are returned as libuv error codes. */
+
+#include "nub.h"
+
+#include <stddef.h>  /* NULL */
+#include <new>  /* placement new */
+#include <type_traits>  /* std::decay */
+#include <utility>  /* std::forward */
+
+namespace nub {
+
+/* Owns a nub_loop_t. Must outlive every nub::thread created on it. */
+class loop {
+ public:
+  loop() { nub_loop_init(&loop_); }
+  ~loop() { nub_loop_dispose(&loop_); }
+
+  int run(uv_run_mode mode = UV_RUN_DEFAULT) {
+    return nub_loop_run(&loop_, mode);
+  }
+
+  nub_loop_t* get() { return &loop_; }
+  uv_loop_t* uv() { return &loop_.uvloop; }
+
+ private:
+  loop(const loop&) = delete;
+  loop& operator=(const loop&) = delete;
+
+  nub_loop_t loop_;
+};
+
+
+/* Owns a nub_thread_t. The thread is joined on destruction unless it already
+ * disposed of itself. In that case the loop must be run until the dispose has
+ * been processed before the nub::thread goes out of scope. */
+class thread {
+ public:
+  explicit thread(loop& l, const nub_thread_options_t* options = NULL)
+      : error_(nub_thread_create_ex(l.get(), &thread_, options)) {}
+
+  ~thread() {
+    if (0 == error_ && !thread_.disposed)
+      nub_thread_join(&thread_);
+  }
+
+  /* Status of creating the thread. Nothing else can be used unless it's 0. */
+  int error() const { return error_; }
+
+  nub_thread_t* get() { return &thread_; }
+
+  /* Run f() on the thread. Must be run from the event loop thread. The work
+   * item comes from the loop's slab, and f is moved into the bytes that come
+   * with it if it fits, so small captures never reach malloc(). Larger ones
+   * are heap allocated. Returns UV_ENOMEM if out of memory, or UV_EAGAIN if
+   * the thread's queue is full. */
+  template <class F>
+  int post(F&& f) {
+    typedef typename std::decay<F>::type fn;
+    nub_work_t* work;
+    int er;
+
+    work = nub_loop_work_alloc(thread_.nubloop);
+    if (NULL == work)
+      return UV_ENOMEM;
+
+    if (sizeof(fn) <= NUB_WORK_EXTRA_SIZE && alignof(fn) <= 16) {
+      new (NUB_WORK_EXTRA(work)) fn(std::forward<F>(f));
+      nub_work_init(work, run_inline<fn>, NULL);
+    } else {
+      nub_work_init(work, run_heap<fn>, new fn(std::forward<F>(f)));
+    }
+
+    er = nub_thread_enqueue(&thread_, work);
+    if (0 != er)
+      drop<fn>(work);
+    return er;
+  }
+
+  /* Same as nub_thread_dispose(). Must be run from the thread. */
+  void dispose(nub_thread_disposed_cb cb = NULL) {
+    nub_thread_dispose(&thread_, cb);
+  }
+
+ private:
+  thread(const thread&) = delete;
+  thread& operator=(const thread&) = delete;
+
+  template <class F>
+  static void run_inline(nub_thread_t* t, nub_work_t* work, void* arg) {
+    F* f = static_cast<F*>(NUB_WORK_EXTRA(work));
+    (*f)();
+    f->~F();
+    nub_thread_work_free(t, work);
+  }
+
+  /* Undo post() for work that was never enqueued. */
+  template <class F>
+  void drop(nub_work_t* work) {
+    if (run_inline<F> == work->cb)
+      static_cast<F*>(NUB_WORK_EXTRA(work))->~F();
+    else
+      delete static_cast<F*>(work->arg);
+    nub_loop_work_free(thread_.nubloop, work);
+  }
+
+  template <class F>
+  static void run_heap(nub_thread_t* t, nub_work_t* work, void* arg) {
+    F* f = static_cast<F*>(arg);
+    (*f)();
+    delete f;
+    nub_thread_work_free(t, work);
+  }
+
+  int error_;
+  nub_thread_t thread_;
+};
+
+
+/* Holds the event loop lock for as long as it's in scope. Must be created on
+ * the spawned thread. */
+class loop_lock {
+ public:
+  explicit loop_lock(nub_thread_t* t)
+      : thread_(t), error_(nub_loop_lock(thread_)) {}
+  explicit loop_lock(thread& t)
+      : thread_(t.get()), error_(nub_loop_lock(thread_)) {}
+
+  ~loop_lock() {
+    if (0 == error_)
+      nub_loop_unlock(thread_);
+  }
+
+  /* Status of taking the lock. The loop isn't held unless it's 0. */
+  int error() const { return error_; }
+
+ private:
+  loop_lock(const loop_lock&) = delete;
+  loop_lock& operator=(const loop_lock&) = delete;
+
+  nub_thread_t* thread_;
+  int error_;
+};
+
+}  /* namespace nub */
+
+#endif  /* LIBNUB_NUB_HPP_ */
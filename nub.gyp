@@ -22,10 +22,24 @@
       'sources': [
         'deps/fuq/fuq.h',
         'include/nub.h',
+        'include/nub.hpp',
+        'src/atomic-ops.h',
+        'src/fiber.c',
+        'src/group.c',
+        'src/handshake.h',
+        'src/internal.h',
         'src/loop.c',
+        'src/mpscq.h',
+        'src/pool.c',
         'src/queue.c',
+        'src/slab.c',
+        'src/slab.h',
         'src/thread.c',
+        'src/trace.c',
+        'src/trace.h',
         'src/util.h',
+        'src/wheel.c',
+        'src/wheel.h',
       ],
       'conditions': [
         [ 'OS!="win"', {
@@ -52,7 +66,23 @@
         'test/helper.h',
         'test/run-tests.c',
         'test/run-tests.h',
+        'test/test-fiber.c',
+        'test/test-loop-budget.c',
+        'test/test-loop-call.c',
+        'test/test-loop-enqueue.c',
+        'test/test-loop-group.c',
+        'test/test-loop-lock.c',
+        'test/test-pool.c',
+        'test/test-prio.c',
+        'test/test-stats.c',
+        'test/test-thread-limit.c',
+        'test/test-thread-loop.c',
+        'test/test-thread-options.c',
+        'test/test-thread-send.c',
+        'test/test-thread-timers.c',
+        'test/test-trace.c',
         'test/test-timers.c',
+        'test/test-work-alloc.c',
       ],
     },
 
@@ -67,7 +97,22 @@
         'test/helper.h',
         'test/run-benchmarks.c',
         'test/run-benchmarks.h',
+        'test/bench-contention.c',
+        'test/bench-fiber.c',
+        'test/bench-loop-group.c',
+        'test/bench-loop-call.c',
         'test/bench-oscillate.c',
+        'test/bench-overload.c',
+        'test/bench-pool.c',
+        'test/bench-post.cc',
+        'test/bench-tcp-lock.c',
+        'test/bench-thread-rss.c',
+        'test/bench-work-alloc.c',
+      ],
+      'conditions': [
+        [ 'OS!="win"', {
+          'cflags_cc': [ '-std=c++11' ],
+        }]
       ],
     },
   ],
@@ -0,0 +1,68 @@
+#ifndef LIBNUB_ATOMIC_OPS_H_
+#define LIBNUB_ATOMIC_OPS_H_
+
+#if !defined(__GNUC__)
+# error "Atomic operations currently require a GCC compatible compiler"
+#endif
+
+#define NUB__UNUSED(declaration) __attribute__((unused)) declaration
+
+/* All operations below imply a full memory barrier. */
+
+NUB__UNUSED(static int nub__atomic_add(volatile int* ptr, int val));
+NUB__UNUSED(static int nub__cmpxchgi(volatile int* ptr, int oldv, int newv));
+NUB__UNUSED(static int nub__xchgi(volatile int* ptr, int val));
+NUB__UNUSED(static void* nub__cmpxchgp(void* volatile* ptr,
+                                       void* oldv,
+                                       void* newv));
+NUB__UNUSED(static void* nub__xchgp(void* volatile* ptr, void* val));
+NUB__UNUSED(static void nub__barrier(void));
+NUB__UNUSED(static void nub__cpu_relax(void));
+
+
+/* Returns the new value. */
+static int nub__atomic_add(volatile int* ptr, int val) {
+  return __sync_add_and_fetch(ptr, val);
+}
+
+
+/* Returns the previous value. */
+static int nub__cmpxchgi(volatile int* ptr, int oldv, int newv) {
+  return __sync_val_compare_and_swap(ptr, oldv, newv);
+}
+
+
+/* Returns the previous value. */
+static int nub__xchgi(volatile int* ptr, int val) {
+  return __atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST);
+}
+
+
+/* Returns the previous value. */
+static void* nub__cmpxchgp(void* volatile* ptr, void* oldv, void* newv) {
+  return __sync_val_compare_and_swap(ptr, oldv, newv);
+}
+
+
+/* Returns the previous value. */
+static void* nub__xchgp(void* volatile* ptr, void* val) {
+  return __atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST);
+}
+
+
+static void nub__barrier(void) {
+  __sync_synchronize();
+}
+
+
+static void nub__cpu_relax(void) {
+#if defined(__i386__) || defined(__x86_64__)
+  __asm__ __volatile__ ("rep; nop");  /* a.k.a. PAUSE */
+#elif defined(__aarch64__)
+  __asm__ __volatile__ ("yield");
+#else
+  __sync_synchronize();
+#endif
+}
+
+#endif  /* LIBNUB_ATOMIC_OPS_H_ */
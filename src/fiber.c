@@ -0,0 +1,229 @@
+#if defined(__APPLE__) && !defined(_XOPEN_SOURCE)
+# define _XOPEN_SOURCE 600  /* ucontext */
+#endif
+
+#include "nub.h"
+#include "internal.h"
+#include "mpscq.h"
+#include "util.h"
+#include "uv.h"
+
+#include <stdint.h>  /* uintptr_t */
+#include <stdlib.h>  /* malloc, free */
+
+#ifdef _WIN32
+# include <windows.h>  /* ConvertThreadToFiber, CreateFiber, SwitchToFiber */
+#else
+# include <ucontext.h>  /* getcontext, makecontext, swapcontext */
+#endif
+
+#define NUB__FIBER_STACK (64 * 1024)
+
+/* What a spawned thread needs to switch between its own stack and its
+ * fibers'. */
+struct nub__fiber_host_s {
+#ifdef _WIN32
+  LPVOID main;
+  int converted;  /* Set if the thread wasn't a fiber to begin with */
+#else
+  ucontext_t main;
+#endif
+};
+
+
+#ifdef _WIN32
+static VOID CALLBACK nub__fiber_entry(LPVOID arg) {
+  nub_fiber_t* fiber = (nub_fiber_t*) arg;
+#else
+/* makecontext() only passes ints, so the pointer comes in two halves. */
+static void nub__fiber_entry(unsigned int hi, unsigned int lo) {
+  nub_fiber_t* fiber = (nub_fiber_t*) (uintptr_t) (((uint64_t) hi << 32) | lo);
+#endif
+
+  fiber->cb_(fiber);
+  fiber->done_ = 1;
+  nub__fiber_suspend(fiber);
+  UNREACHABLE();
+}
+
+
+/* Runs from the fiber's thread, on its own stack. Switches to the fiber until
+ * it waits or returns. */
+static void nub__fiber_run_cb(nub_thread_t* thread,
+                              nub_work_t* work,
+                              void* arg) {
+  nub_fiber_t* fiber;
+
+  fiber = (nub_fiber_t*) arg;
+
+#ifdef _WIN32
+  SwitchToFiber(fiber->context_);
+#else
+  CHECK_EQ(0, swapcontext(&thread->fiber_host_->main,
+                          (ucontext_t*) fiber->context_));
+#endif
+
+  if (0 == fiber->done_)
+    return;
+
+  /* Can't be freed from the fiber while it's still standing on it. */
+#ifdef _WIN32
+  DeleteFiber(fiber->context_);
+#else
+  free(fiber->context_);
+#endif
+  fiber->context_ = NULL;
+
+  if (NULL != fiber->done_cb_)
+    fiber->done_cb_(fiber);
+}
+
+
+static int nub__fiber_host_init(nub_thread_t* thread) {
+  struct nub__fiber_host_s* host;
+
+  host = (struct nub__fiber_host_s*) malloc(sizeof(*host));
+  if (NULL == host)
+    return UV_ENOMEM;
+
+#ifdef _WIN32
+  host->converted = 0;
+  host->main = ConvertThreadToFiber(NULL);
+  if (NULL != host->main) {
+    host->converted = 1;
+  } else if (ERROR_ALREADY_FIBER == GetLastError()) {
+    host->main = GetCurrentFiber();
+  } else {
+    free(host);
+    return UV_ENOMEM;
+  }
+#endif
+
+  thread->fiber_host_ = host;
+  return 0;
+}
+
+
+void nub__fiber_host_free(nub_thread_t* thread) {
+  if (NULL == thread->fiber_host_)
+    return;
+#ifdef _WIN32
+  if (thread->fiber_host_->converted)
+    ConvertFiberToThread();
+#endif
+  free(thread->fiber_host_);
+  thread->fiber_host_ = NULL;
+}
+
+
+void nub__fiber_suspend(nub_fiber_t* fiber) {
+#ifdef _WIN32
+  SwitchToFiber(fiber->thread->fiber_host_->main);
+#else
+  CHECK_EQ(0, swapcontext((ucontext_t*) fiber->context_,
+                          &fiber->thread->fiber_host_->main));
+#endif
+}
+
+
+void nub__fiber_resume(nub_fiber_t* fiber) {
+  nub__mpscq_push(&fiber->thread->inbox_, &fiber->work);
+  nub__thread_wake(fiber->thread);
+}
+
+
+void nub__fiber_grant(nub_fiber_t* fiber) {
+  nub__mpscq_push(&fiber->thread->granted_, &fiber->work);
+  nub__thread_wake(fiber->thread);
+}
+
+
+#ifdef _WIN32
+static int nub__fiber_context_init(nub_fiber_t* fiber, size_t stack_size) {
+  fiber->context_ = CreateFiber(stack_size, nub__fiber_entry, fiber);
+  if (NULL == fiber->context_)
+    return UV_ENOMEM;
+  return 0;
+}
+#else
+static int nub__fiber_context_init(nub_fiber_t* fiber, size_t stack_size) {
+  ucontext_t* context;
+  size_t offset;
+  uintptr_t p;
+
+  /* The stack goes right after the context, 16 byte aligned. */
+  offset = (sizeof(*context) + 15) & ~(size_t) 15;
+  context = (ucontext_t*) malloc(offset + stack_size);
+  if (NULL == context)
+    return UV_ENOMEM;
+  CHECK_EQ(0, getcontext(context));
+  context->uc_stack.ss_sp = (char*) context + offset;
+  context->uc_stack.ss_size = stack_size;
+  context->uc_link = NULL;
+  p = (uintptr_t) fiber;
+  makecontext(context,
+              (void (*)(void)) nub__fiber_entry,
+              2,
+              (unsigned int) ((uint64_t) p >> 32),
+              (unsigned int) p);
+  fiber->context_ = context;
+  return 0;
+}
+#endif
+
+
+int nub_fiber_create(nub_thread_t* thread,
+                     nub_fiber_t* fiber,
+                     size_t stack_size,
+                     nub_fiber_cb cb,
+                     nub_fiber_cb done_cb) {
+  int er;
+
+  if (NULL == thread->fiber_host_) {
+    er = nub__fiber_host_init(thread);
+    if (0 != er)
+      return er;
+  }
+
+  fiber->thread = thread;
+  fiber->cb_ = cb;
+  fiber->done_cb_ = done_cb;
+  fiber->status_ = 0;
+  fiber->done_ = 0;
+
+  er = nub__fiber_context_init(fiber,
+                               0 == stack_size ? NUB__FIBER_STACK : stack_size);
+  if (0 != er)
+    return er;
+
+  nub_work_init(&fiber->work, nub__fiber_run_cb, fiber);
+  fiber->work.data = fiber;
+  nub__fiber_resume(fiber);
+
+  return 0;
+}
+
+
+void nub_fiber_yield(nub_fiber_t* fiber) {
+  nub__fiber_resume(fiber);
+  nub__fiber_suspend(fiber);
+}
+
+
+/* Runs from the fiber's thread, on its own stack. */
+static void nub__fiber_complete_cb(nub_work_t* work, int status) {
+  nub_fiber_t* fiber;
+
+  fiber = (nub_fiber_t*) work->data;
+  fiber->status_ = status;
+  nub_work_init(&fiber->work, nub__fiber_run_cb, fiber);
+  nub__fiber_resume(fiber);
+}
+
+
+int nub_fiber_loop_run(nub_fiber_t* fiber, nub_work_cb cb, void* arg) {
+  nub_work_init(&fiber->work, cb, arg);
+  nub_loop_enqueue(fiber->thread, &fiber->work, nub__fiber_complete_cb);
+  nub__fiber_suspend(fiber);
+  return fiber->status_;
+}
@@ -0,0 +1,232 @@
+#include "nub.h"
+#include "atomic-ops.h"
+#include "util.h"
+#include "uv.h"
+
+#include <stdlib.h>  /* calloc, free */
+#include <string.h>  /* memcpy */
+
+#ifndef _WIN32
+# include <errno.h>  /* errno */
+# include <sys/socket.h>  /* setsockopt, SO_REUSEPORT */
+#endif
+
+
+/* Runs from each loop's own thread. */
+static void nub__group_stop_cb(uv_async_t* handle) {
+  nub_loop_group_t* group;
+
+  group = (nub_loop_group_t*) handle->data;
+  if (NULL != group->stop_cb_)
+    group->stop_cb_(group, (nub_loop_t*) handle->loop);
+  uv_close((uv_handle_t*) handle, NULL);
+}
+
+
+static void nub__group_runner(void* arg) {
+  nub_loop_run((nub_loop_t*) arg, UV_RUN_DEFAULT);
+}
+
+
+int nub_loop_group_init(nub_loop_group_t* group, unsigned int nloops) {
+  unsigned int i;
+
+  if (0 == nloops)
+    return UV_EINVAL;
+
+  group->loops = (nub_loop_t*) calloc(nloops, sizeof(*group->loops));
+  group->stop_signals_ =
+      (uv_async_t*) calloc(nloops, sizeof(*group->stop_signals_));
+  group->runners_ = (uv_thread_t*) calloc(nloops, sizeof(*group->runners_));
+  if (NULL == group->loops ||
+      NULL == group->stop_signals_ ||
+      NULL == group->runners_) {
+    free(group->loops);
+    free(group->stop_signals_);
+    free(group->runners_);
+    return UV_ENOMEM;
+  }
+
+  group->nloops = nloops;
+  group->stop_cb_ = NULL;
+  group->stopped_ = 0;
+
+  for (i = 0; i < nloops; i++) {
+    nub_loop_init(&group->loops[i]);
+    CHECK_EQ(0, uv_async_init(&group->loops[i].uvloop,
+                              &group->stop_signals_[i],
+                              nub__group_stop_cb));
+    group->stop_signals_[i].data = group;
+  }
+
+  return 0;
+}
+
+
+#if !defined(_WIN32) && defined(SO_REUSEPORT)
+/* Share addr with the other loops' sockets and listen on it. If first is set
+ * the port actually bound is written back to addr for the rest. */
+static int nub__group_listen_one(uv_tcp_t* server,
+                                 struct sockaddr_storage* addr,
+                                 int first,
+                                 int backlog,
+                                 uv_connection_cb cb) {
+  uv_os_fd_t fd;
+  int len;
+  int on;
+  int er;
+
+  er = uv_fileno((uv_handle_t*) server, &fd);
+  if (0 != er)
+    return er;
+
+  on = 1;
+  if (0 != setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)))
+    return NUB__ERR(errno);
+
+  er = uv_tcp_bind(server, (const struct sockaddr*) addr, 0);
+  if (0 != er)
+    return er;
+
+  /* A port of 0 is only picked once. The rest bind to the same one. */
+  if (first) {
+    len = sizeof(*addr);
+    er = uv_tcp_getsockname(server, (struct sockaddr*) addr, &len);
+    if (0 != er)
+      return er;
+  }
+
+  return uv_listen((uv_stream_t*) server, backlog, cb);
+}
+#endif
+
+
+int nub_loop_group_listen(nub_loop_group_t* group,
+                          uv_tcp_t* servers,
+                          const struct sockaddr* addr,
+                          int backlog,
+                          uv_connection_cb cb) {
+#if defined(_WIN32) || !defined(SO_REUSEPORT)
+  return UV_ENOTSUP;
+#else
+  struct sockaddr_storage bound;
+  unsigned int i;
+  int er;
+
+  if (AF_INET6 == addr->sa_family)
+    memcpy(&bound, addr, sizeof(struct sockaddr_in6));
+  else
+    memcpy(&bound, addr, sizeof(struct sockaddr_in));
+
+  er = 0;
+  for (i = 0; i < group->nloops; i++) {
+    er = uv_tcp_init_ex(&group->loops[i].uvloop, &servers[i], addr->sa_family);
+    if (0 != er)
+      break;
+    er = nub__group_listen_one(&servers[i], &bound, 0 == i, backlog, cb);
+    if (0 != er) {
+      uv_close((uv_handle_t*) &servers[i], NULL);
+      break;
+    }
+  }
+
+  if (0 == er)
+    return 0;
+
+  while (i-- > 0)
+    uv_close((uv_handle_t*) &servers[i], NULL);
+  return er;
+#endif
+}
+
+
+int nub_loop_group_run(nub_loop_group_t* group) {
+  unsigned int i;
+  int er;
+
+  for (i = 1; i < group->nloops; i++) {
+    er = uv_thread_create(&group->runners_[i],
+                          nub__group_runner,
+                          &group->loops[i]);
+    if (0 != er)
+      break;
+  }
+
+  if (i < group->nloops) {
+    nub_loop_group_stop(group, NULL);
+    nub_loop_run(&group->loops[0], UV_RUN_DEFAULT);
+  } else {
+    er = nub_loop_run(&group->loops[0], UV_RUN_DEFAULT);
+  }
+
+  while (--i > 0)
+    CHECK_EQ(0, uv_thread_join(&group->runners_[i]));
+
+  return er;
+}
+
+
+void nub_loop_group_stop(nub_loop_group_t* group, nub_loop_group_cb cb) {
+  unsigned int i;
+
+  if (0 != nub__cmpxchgi(&group->stopped_, 0, 1))
+    return;
+
+  group->stop_cb_ = cb;
+  for (i = 0; i < group->nloops; i++)
+    CHECK_EQ(0, uv_async_send(&group->stop_signals_[i]));
+}
+
+
+void nub_loop_group_dispose(nub_loop_group_t* group) {
+  unsigned int i;
+
+  for (i = 0; i < group->nloops; i++) {
+    /* Still open if the group was never stopped. */
+    if (!uv_is_closing((uv_handle_t*) &group->stop_signals_[i])) {
+      uv_close((uv_handle_t*) &group->stop_signals_[i], NULL);
+      CHECK_EQ(0, uv_run(&group->loops[i].uvloop, UV_RUN_NOWAIT));
+    }
+    nub_loop_dispose(&group->loops[i]);
+  }
+
+  free(group->loops);
+  free(group->stop_signals_);
+  free(group->runners_);
+  group->loops = NULL;
+  group->nloops = 0;
+}
+
+
+/* thread, which can be NULL, isn't counted against the loop it's on. */
+static nub_loop_t* nub__group_pick(nub_loop_group_t* group,
+                                   nub_thread_t* thread) {
+  nub_loop_t* best;
+  unsigned int best_load;
+  unsigned int load;
+  unsigned int i;
+
+  best = &group->loops[0];
+  best_load = (unsigned int) -1;
+  for (i = 0; i < group->nloops; i++) {
+    load = group->loops[i].ref_;
+    if (NULL != thread && thread->nubloop == &group->loops[i])
+      load--;
+    if (load < best_load) {
+      best = &group->loops[i];
+      best_load = load;
+    }
+  }
+
+  return best;
+}
+
+
+nub_loop_t* nub_loop_group_least_loaded(nub_loop_group_t* group) {
+  return nub__group_pick(group, NULL);
+}
+
+
+int nub_loop_group_attach(nub_loop_group_t* group, nub_thread_t* thread) {
+  return nub_thread_migrate(thread, nub__group_pick(group, thread));
+}
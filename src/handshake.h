@@ -0,0 +1,186 @@
+#ifndef LIBNUB_HANDSHAKE_H_
+#define LIBNUB_HANDSHAKE_H_
+
+#include "nub.h"
+#include "atomic-ops.h"
+#include "internal.h"
+#include "util.h"
+#include "uv.h"
+
+/* Counting post/wait handshake used to pass the loop lock back and forth. Any
+ * thread can post, but only one thread at a time may wait. The waiter first
+ * spins for up to max_spin nanoseconds, then sleeps on a semaphore. How long
+ * it actually spins follows how long recent waits took, so a post that never
+ * comes in time stops costing the full max_spin. A post only touches the
+ * semaphore when the waiter is asleep, so with a max_spin of 0 it costs the
+ * same as a plain semaphore. */
+
+/* Number of times to check for a post between reading the clock. */
+#define NUB__HANDSHAKE_CHECKS 64
+
+NUB__UNUSED(static int nub__handshake_init(nub__handshake_t* hs));
+NUB__UNUSED(static void nub__handshake_destroy(nub__handshake_t* hs));
+NUB__UNUSED(static void nub__handshake_post(nub__handshake_t* hs));
+NUB__UNUSED(static int nub__handshake_trywait(nub__handshake_t* hs));
+NUB__UNUSED(static void nub__handshake_wait(nub__handshake_t* hs,
+                                            uint64_t max_spin));
+NUB__UNUSED(static int nub__handshake_timedwait(nub__handshake_t* hs,
+                                                uint64_t max_spin,
+                                                uint64_t timeout));
+
+
+static int nub__handshake_init(nub__handshake_t* hs) {
+  hs->count_ = 0;
+  hs->sleeping_ = 0;
+  hs->posting_ = 0;
+  /* Start out spinning for as long as allowed. */
+  hs->spin_ns_ = (uint64_t) -1;
+
+  return uv_sem_init(&hs->wake_, 0);
+}
+
+
+static void nub__handshake_destroy(nub__handshake_t* hs) {
+  ASSERT(0 == hs->sleeping_);
+  while (0 != hs->posting_)
+    nub__thread_yield();
+  uv_sem_destroy(&hs->wake_);
+}
+
+
+static void nub__handshake_post(nub__handshake_t* hs) {
+  /* Keeps nub__handshake_destroy() from running until this returns, since the
+   * waiter can see the post and move on before wake_ is posted. */
+  nub__atomic_add(&hs->posting_, 1);
+
+  /* Both sides do a full barrier between their write and their read, so
+   * either the waiter sees the post or the post sees the waiter. Whoever
+   * swaps sleeping_ back to zero is responsible for wake_. */
+  nub__atomic_add(&hs->count_, 1);
+  if (0 != hs->sleeping_ && 1 == nub__xchgi(&hs->sleeping_, 0))
+    uv_sem_post(&hs->wake_);
+
+  nub__atomic_add(&hs->posting_, -1);
+}
+
+
+/* Returns 0 if a post was consumed, otherwise UV_EAGAIN. */
+static int nub__handshake_trywait(nub__handshake_t* hs) {
+  int count;
+
+  for (count = hs->count_; 0 < count; count = hs->count_) {
+    if (count == nub__cmpxchgi(&hs->count_, count, count - 1))
+      return 0;
+  }
+
+  return UV_EAGAIN;
+}
+
+
+/* Move the spin window a step towards target, never below an eighth of
+ * max_spin so a burst of short waits is still noticed. */
+static void nub__handshake_adapt(nub__handshake_t* hs,
+                                 uint64_t window,
+                                 uint64_t max_spin,
+                                 uint64_t target) {
+  if (target > window)
+    window += (target - window) / 8;
+  else
+    window -= (window - target) / 8;
+
+  if (window < max_spin / 8)
+    window = max_spin / 8;
+  if (window > max_spin)
+    window = max_spin;
+
+  hs->spin_ns_ = window;
+}
+
+
+/* Returns 0 if a post was consumed within limit nanoseconds of spinning. */
+static int nub__handshake_spin(nub__handshake_t* hs,
+                               uint64_t max_spin,
+                               uint64_t limit) {
+  uint64_t window;
+  uint64_t start;
+  uint64_t elapsed;
+  int i;
+
+  if (0 == nub__handshake_trywait(hs))
+    return 0;
+
+  window = hs->spin_ns_ < max_spin ? hs->spin_ns_ : max_spin;
+  if (window > limit)
+    window = limit;
+  if (0 == window)
+    return UV_EAGAIN;
+
+  start = uv_hrtime();
+
+  for (;;) {
+    for (i = 0; i < NUB__HANDSHAKE_CHECKS; i++) {
+      if (0 == nub__handshake_trywait(hs)) {
+        elapsed = uv_hrtime() - start;
+        nub__handshake_adapt(hs, window, max_spin, elapsed * 2);
+        return 0;
+      }
+      nub__cpu_relax();
+    }
+    elapsed = uv_hrtime() - start;
+    if (elapsed >= window)
+      break;
+    /* Let the posting thread run if it shares this CPU. */
+    if (elapsed >= window / 2)
+      nub__thread_yield();
+  }
+
+  nub__handshake_adapt(hs, window, max_spin, 0);
+  return UV_EAGAIN;
+}
+
+
+static void nub__handshake_sleep(nub__handshake_t* hs) {
+  for (;;) {
+    nub__xchgi(&hs->sleeping_, 1);
+    if (0 == nub__handshake_trywait(hs)) {
+      /* A post that swapped the flag in the meantime still posts wake_. */
+      if (0 == nub__xchgi(&hs->sleeping_, 0))
+        uv_sem_wait(&hs->wake_);
+      return;
+    }
+    uv_sem_wait(&hs->wake_);
+    if (0 == nub__handshake_trywait(hs))
+      return;
+  }
+}
+
+
+static void nub__handshake_wait(nub__handshake_t* hs, uint64_t max_spin) {
+  if (0 != nub__handshake_spin(hs, max_spin, max_spin))
+    nub__handshake_sleep(hs);
+}
+
+
+/* Returns 0 if posted within timeout nanoseconds, otherwise UV_ETIMEDOUT.
+ * Yields instead of sleeping once done spinning, since there's no portable
+ * timed semaphore wait. */
+static int nub__handshake_timedwait(nub__handshake_t* hs,
+                                    uint64_t max_spin,
+                                    uint64_t timeout) {
+  uint64_t start;
+
+  start = uv_hrtime();
+
+  if (0 == nub__handshake_spin(hs, max_spin, timeout))
+    return 0;
+
+  while (0 != nub__handshake_trywait(hs)) {
+    if (uv_hrtime() - start >= timeout)
+      return UV_ETIMEDOUT;
+    nub__thread_yield();
+  }
+
+  return 0;
+}
+
+#endif  /* LIBNUB_HANDSHAKE_H_ */
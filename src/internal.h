@@ -0,0 +1,108 @@
+#ifndef LIBNUB_INTERNAL_H_
+#define LIBNUB_INTERNAL_H_
+
+#include "nub.h"
+
+/* Values of nub_thread_t::lock_state_. */
+enum {
+  NUB__LOCK_IDLE = 0,
+  NUB__LOCK_WAITING,
+  NUB__LOCK_GRANTED,
+  NUB__LOCK_CANCELLED
+};
+
+/* Items a higher class can run ahead of a waiting lower class before the
+ * lower class gets a turn. */
+#define NUB__PRIO_AGE 32
+
+/* Same as nub_thread_create_ex(), but attaches the thread to a nub_pool_t.
+ * pool and options can be NULL. */
+int nub__thread_create(nub_loop_t* loop,
+                       nub_thread_t* thread,
+                       nub_pool_t* pool,
+                       const nub_thread_options_t* options);
+
+/* Push work onto the thread's outgoing_ queue and signal the event loop if
+ * needed. Must be run from the thread itself. Return value is the same as
+ * uv_async_send(). */
+int nub__thread_push(nub_thread_t* thread, nub_work_t* work);
+
+/* Run an item queued for the thread, or drop it if it's past its deadline.
+ * Must be run from the thread itself. */
+void nub__thread_run(nub_thread_t* thread, nub_work_t* work);
+
+/* Let water_cb_ know the thread worked its queue down to low_water_. Must be
+ * run from the event loop thread when it shifts the thread's water_work_. */
+void nub__thread_water_low(nub_thread_t* thread);
+
+/* Take the thread off the loop while it waits in nub_thread_migrate(). Must
+ * be run from the event loop thread it's leaving. */
+void nub__thread_detach(nub_loop_t* loop, nub_thread_t* thread);
+
+/* Take in a thread from nub_thread_migrate(). Must be run from the event loop
+ * thread it's moving to. */
+void nub__thread_attach(nub_loop_t* loop, nub_thread_t* thread);
+
+/* Take a joined thread out of the loop's ready_threads_ stack. Must be run
+ * from the event loop thread. */
+void nub__ready_remove(nub_loop_t* loop, nub_thread_t* thread);
+
+/* Join a thread that has disposed of itself, processing what it pushed
+ * before its dispose request in place of the loop. Must be run from the event
+ * loop thread. */
+void nub__thread_reap(nub_loop_t* loop, nub_thread_t* thread);
+
+/* Take a joined thread's withdrawn lock request out of the loop's
+ * lock_queue_. Must be run from the event loop thread while the loop isn't
+ * halted. */
+void nub__lock_remove(nub_loop_t* loop, nub_thread_t* thread);
+
+/* Switch from a running fiber back to its thread's own stack. Returns once
+ * the fiber is switched back to. */
+void nub__fiber_suspend(nub_fiber_t* fiber);
+
+/* Queue the fiber to be switched back to by its thread. Can be run from any
+ * thread. */
+void nub__fiber_resume(nub_fiber_t* fiber);
+
+/* Same as nub__fiber_resume(), but the fiber is switched back to before
+ * anything else queued for its thread. Used once the loop has been halted for
+ * the fiber. */
+void nub__fiber_grant(nub_fiber_t* fiber);
+
+/* Release what the thread needed to run fibers. Must be run from the thread
+ * itself once no fiber is left. */
+void nub__fiber_host_free(nub_thread_t* thread);
+
+/* Give up the rest of the time slice. */
+void nub__thread_yield(void);
+
+/* Wake the thread if it's parked waiting for work. Must be run after the work
+ * has been made visible to the thread. Returns 1 if the thread had to be
+ * woken. */
+int nub__thread_wake(nub_thread_t* thread);
+
+/* Queue the thread to be woken at the next nub__flush_wake_queue(). Must be
+ * run from the event loop thread, or while holding the loop exclusively. */
+void nub__defer_wake(nub_loop_t* loop, nub_thread_t* thread);
+
+/* Wake all threads queued by nub__defer_wake(). */
+void nub__flush_wake_queue(nub_loop_t* loop);
+
+/* Add a sample to a running total and high-water mark. */
+#define NUB__STATS_ADD(total, max, value)                                     \
+  do {                                                                        \
+    uint64_t nub__v = (value);                                                \
+    (total) += nub__v;                                                        \
+    if (nub__v > (max))                                                       \
+      (max) = nub__v;                                                         \
+  } while (0)
+
+/* Run work from the pool queues on a pool owned thread. Returns the number of
+ * items run. Returns 0 once there's nothing left to run or steal. */
+int nub__pool_work(nub_thread_t* thread);
+
+/* Whether a pool owned thread has anything to look at before parking. */
+int nub__pool_has_work(nub_thread_t* thread);
+
+#endif  /* LIBNUB_INTERNAL_H_ */
@@ -1,104 +1,671 @@
 #include "nub.h"
 #include "fuq.h"
+#include "atomic-ops.h"
+#include "handshake.h"
+#include "internal.h"
+#include "mpscq.h"
+#include "slab.h"
+#include "trace.h"
 #include "util.h"
 #include "uv.h"
 
-#include <stdlib.h>  /* malloc, free */
+#include <stdarg.h>  /* va_list, va_start, va_arg, va_end */
+#include <string.h>  /* memset */
 
+/* Items between reading the clock for NUB_LOOP_BUDGET_TIME. */
+#define NUB__BUDGET_CLOCK 16
 
-static void nub__free_handle_cb(uv_handle_t* handle) {
-  free(handle);
+
+/* A nub_loop_call() in flight. Lives on the calling thread's stack. */
+typedef struct {
+  nub_work_t work;  /* Must come first */
+  nub_call_cb cb;
+  void* arg;
+  void* result;
+} nub__call_t;
+
+
+/* How much more the queue_processor_ may do before the loop gets to poll.
+ * Lives on the event loop thread's stack for one nub__async_prepare_cb(). */
+struct nub__budget_s {
+  uint64_t items;  /* Processed so far */
+  uint64_t max_items;  /* 0 for no limit */
+  uint64_t deadline;  /* uv_hrtime() to stop at, 0 for no limit */
+  unsigned int clock_in;  /* Items until the clock is read again */
+  int spent;
+};
+
+
+/* Count an item against the budget. Returns 1 once it's used up. */
+static int nub__budget_take(struct nub__budget_s* budget) {
+  if (0 != budget->spent)
+    return 1;
+
+  budget->items++;
+  if (0 != budget->max_items && budget->items >= budget->max_items) {
+    budget->spent = 1;
+  } else if (0 != budget->deadline && 0 == --budget->clock_in) {
+    budget->clock_in = NUB__BUDGET_CLOCK;
+    budget->spent = uv_hrtime() >= budget->deadline;
+  }
+
+  return budget->spent;
 }
 
 
-static void nub__async_prepare_cb(uv_prepare_t* handle) {
-  nub_loop_t* loop;
+/* Return completed work to the thread it came from. The thread isn't woken
+ * here. Instead it's placed on the wake_queue_ so it's only woken once no
+ * matter how much of its work completed this loop iteration. */
+static void nub__work_complete(nub_loop_t* loop, nub_work_t* work, int status) {
   nub_thread_t* thread;
-  nub_work_t* work;
 
-  loop = (nub_loop_t*) handle->data;
+  thread = work->thread;
+
+  if (NULL == work->complete_cb) {
+    work->thread = NULL;
+    work->work_type = NUB_LOOP_QUEUE_NONE;
+    return;
+  }
+
+  work->status = status;
+  work->work_type = NUB_LOOP_QUEUE_COMPLETE;
+  fuq_enqueue(&thread->incoming_[work->prio], work);
+  nub__defer_wake(loop, thread);
+}
+
 
-  while (!fuq_empty(&loop->work_queue_)) {
-    work = (nub_work_t*) fuq_dequeue(&loop->work_queue_);
-    thread = (nub_thread_t*) work->thread;
-
-    if (NUB_LOOP_QUEUE_LOCK == work->work_type) {
-      uv_sem_post(&thread->thread_lock_sem_);
-      uv_sem_wait(&loop->loop_lock_sem_);
-    } else if (NUB_LOOP_QUEUE_WORK == work->work_type) {
-      work->cb(thread, work, work->arg);
-      /* TODO(trevnorris): Still need to implement returning status. */
-    } else {
-      UNREACHABLE();
+void nub__defer_wake(nub_loop_t* loop, nub_thread_t* thread) {
+  if (0 == thread->wake_pending_) {
+    thread->wake_pending_ = 1;
+    fuq_enqueue(&loop->wake_queue_, thread);
+  } else {
+    loop->stats_.wakes_coalesced++;
+  }
+}
+
+
+void nub__flush_wake_queue(nub_loop_t* loop) {
+  nub_thread_t* thread;
+
+  while (!fuq_empty(&loop->wake_queue_)) {
+    thread = (nub_thread_t*) fuq_dequeue(&loop->wake_queue_);
+    thread->wake_pending_ = 0;
+    if (nub__thread_wake(thread))
+      loop->stats_.wakes++;
+    else
+      loop->stats_.wakes_coalesced++;
+  }
+}
+
+
+/* Returns non-zero if the thread is leaving the loop. */
+static int nub__process_work(nub_loop_t* loop, nub_work_t* work) {
+  nub_thread_t* thread;
+  nub__call_t* call;
+
+  thread = (nub_thread_t*) work->thread;
+
+  if (NUB_LOOP_QUEUE_WORK == work->work_type) {
+    if (0 != work->deadline && uv_hrtime() >= work->deadline) {
+      loop->stats_.expired++;
+      nub__work_complete(loop, work, UV_ETIMEDOUT);
+      return 0;
     }
+    loop->stats_.work_processed++;
+    NUB__TRACE(loop->trace_, NUB__TRACE_DEQUEUE, 0);
+    work->cb(thread, work, work->arg);
+    nub__work_complete(loop, work, 0);
+  } else if (NUB_LOOP_QUEUE_WATER == work->work_type) {
+    nub__thread_water_low(thread);
+  } else if (NUB_LOOP_QUEUE_CALL == work->work_type) {
+    loop->stats_.work_processed++;
+    NUB__TRACE(loop->trace_, NUB__TRACE_DEQUEUE, 0);
+    call = (nub__call_t*) work;
+    call->result = call->cb(thread, call->arg);
+    /* The call is off the caller's stack as soon as it's woken. */
+    nub__handshake_post(&thread->thread_lock_hs_);
+  } else if (NUB_LOOP_QUEUE_DISPOSE == work->work_type ||
+             NUB_LOOP_QUEUE_MIGRATE == work->work_type) {
+    return 1;
+  } else {
+    UNREACHABLE();
   }
+
+  return 0;
 }
 
 
-static void nub__thread_dispose(uv_async_t* handle) {
+static void nub__ready_push(nub_loop_t* loop, nub_thread_t* thread) {
+  nub_thread_t* head;
+
+  do {
+    head = loop->ready_threads_;
+    thread->next_ready_ = head;
+  } while (head != nub__cmpxchgp((void* volatile*) &loop->ready_threads_,
+                                 head,
+                                 thread));
+}
+
+
+/* Put threads left over by a spent budget back on the ready_threads_ stack,
+ * unless they've already pushed themselves again. */
+static void nub__ready_requeue(nub_loop_t* loop, nub_thread_t* list) {
+  nub_thread_t* thread;
+  int prio;
+
+  for (thread = list; NULL != thread; thread = thread->next_drain_) {
+    for (prio = 0; prio < NUB__PRIOS; prio++) {
+      if (!fuq_empty(&thread->outgoing_[prio]))
+        break;
+    }
+    if (NUB__PRIOS != prio && 0 == nub__xchgi(&thread->outgoing_signaled_, 1))
+      nub__ready_push(loop, thread);
+  }
+}
+
+
+/* Everything a thread pushed before asking to be joined or detached is
+ * processed first, whichever class it's in. Nothing is pushed after, so this
+ * always ends. */
+static void nub__drain_rest(nub_loop_t* loop, nub_thread_t* thread) {
   fuq_queue_t* queue;
-  nub_loop_t* loop;
+  int prio;
+
+  for (prio = 0; prio < NUB__PRIOS; prio++) {
+    queue = &thread->outgoing_[prio];
+    while (!fuq_empty(queue))
+      CHECK_EQ(0, nub__process_work(loop, (nub_work_t*) fuq_dequeue(queue)));
+  }
+}
+
+
+/* Fill order with the classes to drain. The class a spent budget left off in
+ * goes first, unless a lower class with work has been passed over
+ * NUB__PRIO_AGE times, in which case the lowest such class does. Same as
+ * nub__thread_next() on the thread side. The rest follow highest first. */
+static void nub__drain_order(nub_loop_t* loop, int pending, int* order) {
+  int first;
+  int prio;
+  int i;
+
+  first = loop->drain_prio_;
+  for (prio = 1; prio < NUB__PRIOS; prio++) {
+    if (0 != (pending & (1 << prio)) &&
+        NUB__PRIO_AGE <= loop->passed_over_[prio]) {
+      first = prio;
+    }
+  }
+
+  order[0] = first;
+  i = 1;
+  for (prio = 0; prio < NUB__PRIOS; prio++) {
+    if (prio != first)
+      order[i++] = prio;
+  }
+}
+
+
+/* Count n items against each class in pending below prio. */
+static void nub__drain_age(nub_loop_t* loop,
+                           int pending,
+                           int prio,
+                           uint64_t n) {
+  for (prio++; prio < NUB__PRIOS; prio++) {
+    if (0 != (pending & (1 << prio)))
+      loop->passed_over_[prio] += n;
+  }
+}
+
+
+/* Move the thread that spent the last budget to the back of the list, so the
+ * others get a turn first. */
+static nub_thread_t* nub__drain_rotate(nub_loop_t* loop, nub_thread_t* list) {
+  nub_thread_t** link;
+  nub_thread_t* last;
+
+  last = loop->drain_last_;
+  loop->drain_last_ = NULL;
+  if (NULL == last)
+    return list;
+
+  link = &list;
+  while (NULL != *link && last != *link)
+    link = &(*link)->next_drain_;
+  if (NULL == *link || NULL == last->next_drain_)
+    return list;
+
+  *link = last->next_drain_;
+  while (NULL != *link)
+    link = &(*link)->next_drain_;
+  *link = last;
+  last->next_drain_ = NULL;
+
+  return list;
+}
+
+
+/* Returns 0 if no thread had anything queued. Each class is drained from all
+ * threads before moving on to the next. Stops early once the budget is spent,
+ * leaving the rest for the next call, which picks up where this one left
+ * off. */
+static int nub__drain_outgoing(nub_loop_t* loop,
+                               struct nub__budget_s* budget) {
   nub_thread_t* thread;
+  nub_thread_t* next;
+  nub_thread_t* list;
+  nub_thread_t** link;
+  fuq_queue_t* queue;
+  int order[NUB__PRIOS];
+  uint64_t taken;
+  uint64_t n;
+  int pending;
+  int prio;
+  int join;
+  int i;
 
-  loop = (nub_loop_t*) handle->data;
+  thread = (nub_thread_t*) nub__xchgp((void* volatile*) &loop->ready_threads_,
+                                      NULL);
+  if (NULL == thread)
+    return 0;
+
+  /* Threads are pushed onto the stack, so reverse it to process them in the
+   * order they asked. */
+  list = NULL;
+  for (; NULL != thread; thread = thread->next_ready_) {
+    thread->next_drain_ = list;
+    list = thread;
+  }
+
+  /* Clear before draining so anything pushed after this point will put the
+   * thread back on the stack. Done for all of them up front, so any thread
+   * left over by a spent budget is either back on the stack or can be put
+   * there by nub__ready_requeue(). */
+  pending = 0;
+  for (thread = list; NULL != thread; thread = thread->next_drain_) {
+    nub__xchgi(&thread->outgoing_signaled_, 0);
+    for (prio = 0; prio < NUB__PRIOS; prio++) {
+      if (!fuq_empty(&thread->outgoing_[prio]))
+        pending |= 1 << prio;
+    }
+  }
+
+  list = nub__drain_rotate(loop, list);
+  nub__drain_order(loop, pending, order);
+
+  for (i = 0; i < NUB__PRIOS; i++) {
+    prio = order[i];
+    pending &= ~(1 << prio);
+    loop->passed_over_[prio] = 0;
+    taken = 0;
+    link = &list;
+    for (thread = list; NULL != thread; thread = next) {
+      next = thread->next_drain_;
+      queue = &thread->outgoing_[prio];
+      join = 0;
+      for (n = 0; 0 == join && !fuq_empty(queue); n++) {
+        if (0 != budget->spent)
+          break;
+        join = nub__process_work(loop, (nub_work_t*) fuq_dequeue(queue));
+        nub__budget_take(budget);
+      }
+      taken += n;
+      if (n > loop->stats_.outgoing_max)
+        loop->stats_.outgoing_max = n;
+      if (0 != join) {
+        /* Dispose and migrate requests are always last in line. */
+        ASSERT(NUB_PRIO_LOW == prio);
+        /* A class that went first can leave the others behind. */
+        nub__drain_rest(loop, thread);
+        /* Gone from the list, so later classes don't look at it. */
+        *link = next;
+      } else {
+        link = &thread->next_drain_;
+      }
+      if (0 != join && NUB_LOOP_QUEUE_MIGRATE == thread->work.work_type) {
+        nub__thread_detach(loop, thread);
+        /* Off to the other loop once posted. */
+        nub__handshake_post(&thread->thread_lock_hs_);
+      } else if (0 != join) {
+        nub_thread_join(thread);
+        if (NULL != thread->disposed_cb_)
+          thread->disposed_cb_(thread);
+      }
+      if (0 != budget->spent) {
+        nub__drain_age(loop, pending, prio, taken);
+        nub__ready_requeue(loop, list);
+        loop->drain_prio_ = prio;
+        loop->drain_last_ = 0 != join ? NULL : thread;
+        return 1;
+      }
+    }
+    nub__drain_age(loop, pending, prio, taken);
+  }
+
+  loop->drain_prio_ = NUB_PRIO_HIGH;
+  return 1;
+}
+
+
+/* Mark a request shifted off the lock_queue_ as granted. Returns 0 if the
+ * request was withdrawn by nub_loop_lock_timeout() instead, in which case it's
+ * dropped. */
+static int nub__lock_claim(nub_work_t* work) {
+  volatile int* state;
+
+  /* Fibers never withdraw their requests. */
+  if (NUB_LOOP_QUEUE_FIBER_LOCK == work->work_type)
+    return 1;
+
+  state = &work->thread->lock_state_;
+
+  /* A withdrawn request can be revived by its thread at any point until it's
+   * dropped here, so keep going until one of the swaps sticks. */
+  for (;;) {
+    if (NUB__LOCK_WAITING ==
+        nub__cmpxchgi(state, NUB__LOCK_WAITING, NUB__LOCK_GRANTED))
+      return 1;
+    if (NUB__LOCK_CANCELLED ==
+        nub__cmpxchgi(state, NUB__LOCK_CANCELLED, NUB__LOCK_IDLE))
+      return 0;
+  }
+}
+
+
+/* Let the next thread waiting on the loop in. All shared lockers waiting in
+ * a row are let in together. Must only be run by whoever is shifting the
+ * lock_queue_, which is the event loop thread or the last thread to release
+ * the loop in handoff mode. Returns 0 if no thread was waiting. */
+static int nub__lock_grant(nub_loop_t* loop) {
+  nub_work_t* work;
+  nub_work_t* batch;
+  nub_work_t* next;
+  int n;
+
+  do {
+    work = nub__mpscq_shift(&loop->lock_queue_);
+    if (NULL == work)
+      return 0;
+  } while (0 == nub__lock_claim(work));
+
+  if (NUB_LOOP_QUEUE_LOCK_SHARED != work->work_type) {
+    loop->stats_.lock_grants++;
+    if (NUB_LOOP_QUEUE_FIBER_LOCK == work->work_type)
+      nub__fiber_grant((nub_fiber_t*) work->data);
+    else
+      nub__handshake_post(&work->thread->thread_lock_hs_);
+    return 1;
+  }
+
+  /* The count must be complete before any of them can unlock. Shared requests
+   * can't be withdrawn, so claiming them always succeeds. */
+  batch = work;
+  batch->next = NULL;
+  for (n = 1; ; n++) {
+    next = nub__mpscq_peek(&loop->lock_queue_);
+    if (NULL == next || NUB_LOOP_QUEUE_LOCK_SHARED != next->work_type)
+      break;
+    next = nub__mpscq_shift(&loop->lock_queue_);
+    CHECK_EQ(1, nub__lock_claim(next));
+    next->next = batch;
+    batch = next;
+  }
+
+  loop->shared_holders_ = n;
+  loop->stats_.lock_grants += n;
+
+  while (NULL != batch) {
+    next = batch->next;
+    nub__handshake_post(&batch->thread->thread_lock_hs_);
+    batch = next;
+  }
+
+  return 1;
+}
+
+
+void nub__lock_remove(nub_loop_t* loop, nub_thread_t* thread) {
+  nub_work_t* work;
+  nub_work_t* keep;
+  nub_work_t* next;
 
-  if (!loop->disposed_)
+  /* The loop isn't halted, so nothing else is shifting. Take everything and
+   * put back all but the thread's request, in the same order. */
+  keep = NULL;
+  while (NULL != (work = nub__mpscq_shift(&loop->lock_queue_))) {
+    if (work == &thread->work)
+      continue;
+    work->next = keep;
+    keep = work;
+  }
+
+  thread->lock_state_ = NUB__LOCK_IDLE;
+
+  work = NULL;
+  while (NULL != keep) {
+    next = keep->next;
+    keep->next = work;
+    work = keep;
+    keep = next;
+  }
+
+  /* The queue_processor_ runs before the loop polls again, so there's no need
+   * to signal. */
+  while (NULL != work) {
+    next = work->next;
+    nub__mpscq_push(&loop->lock_queue_, work);
+    work = next;
+  }
+}
+
+
+static void nub__lock_release(nub_loop_t* loop) {
+  /* The loop is still halted, so this thread is the only one shifting, and
+   * the only one touching the budget. */
+  if (0 != loop->lock_handoff_ &&
+      (NULL == loop->budget_ || 0 == nub__budget_take(loop->budget_)) &&
+      0 != nub__lock_grant(loop)) {
     return;
+  }
+
+  nub__handshake_post(&loop->loop_lock_hs_);
+}
+
+
+static void nub__budget_idle_cb(uv_idle_t* handle) {
+  /* Only there to keep the loop from blocking in poll. */
+}
+
+
+static void nub__async_prepare_cb(uv_prepare_t* handle) {
+  struct nub__budget_s budget;
+  nub_loop_t* loop;
+  uint64_t grants;
+  uint64_t start;
+  int tried;
+
+  loop = (nub_loop_t*) handle->data;
+  loop->stats_.iterations++;
+  grants = loop->stats_.lock_grants;
+
+  budget.items = 0;
+  budget.max_items = loop->budget_items_;
+  budget.deadline = 0 == loop->budget_ns_ ? 0 : uv_hrtime() + loop->budget_ns_;
+  budget.clock_in = NUB__BUDGET_CLOCK;
+  budget.spent = 0;
+  loop->budget_ = &budget;
+  tried = 0;
+
+  for (;;) {
+    nub__drain_outgoing(loop, &budget);
+    /* Threads waiting on the loop get at least one go per iteration, or a
+     * steady stream of work would keep them out for good. */
+    if (0 != budget.spent && 0 != tried)
+      break;
+
+    tried = 1;
+    if (0 == nub__lock_grant(loop)) {
+      if (0 != budget.spent || NULL == loop->ready_threads_)
+        break;
+      continue;
+    }
+
+    /* In handoff mode the loop is passed from one holder to the next, and
+     * loop_lock_hs_ is only posted once no thread is left waiting. */
+    start = uv_hrtime();
+    NUB__TRACE(loop->trace_, NUB__TRACE_HALT, 0);
+    nub__handshake_wait(&loop->loop_lock_hs_, loop->lock_spin_ns_);
+    NUB__TRACE(loop->trace_, NUB__TRACE_RESUME, 0);
+    NUB__STATS_ADD(loop->stats_.halted_ns,
+                   loop->stats_.halted_max_ns,
+                   uv_hrtime() - start);
 
-  queue = &loop->thread_dispose_queue_;
-  while (!fuq_empty(queue)) {
-    thread = (nub_thread_t*) fuq_dequeue(queue);
-    ASSERT(NULL != thread);
-    nub_thread_join(thread);
-    if (NULL != thread->disposed_cb_)
-      thread->disposed_cb_(thread);
+    /* Holders can take a while, so look at the clock after every one. */
+    budget.clock_in = 1;
+    if (0 != nub__budget_take(&budget))
+      break;
   }
+
+  loop->budget_ = NULL;
+  grants = loop->stats_.lock_grants - grants;
+  if (grants > loop->stats_.lock_chain_max)
+    loop->stats_.lock_chain_max = grants;
+
+  /* Whatever is left was already signaled, so nothing will wake the loop for
+   * it. Keep polling from blocking until it's been worked off. */
+  if (0 != budget.spent) {
+    loop->stats_.budget_spent++;
+    if (!uv_is_active((uv_handle_t*) &loop->budget_idle_))
+      CHECK_EQ(0, uv_idle_start(&loop->budget_idle_, nub__budget_idle_cb));
+  } else if (uv_is_active((uv_handle_t*) &loop->budget_idle_)) {
+    CHECK_EQ(0, uv_idle_stop(&loop->budget_idle_));
+  }
+
+  nub__flush_wake_queue(loop);
 }
 
 
-void nub_loop_init(nub_loop_t* loop) {
-  uv_async_t* async_handle;
-  int er;
+static void nub__wake_flusher_cb(uv_check_t* handle) {
+  nub__flush_wake_queue((nub_loop_t*) handle->data);
+}
 
-  er = uv_loop_init(&loop->uvloop);
-  ASSERT(0 == er);
 
-  er = uv_prepare_init(&loop->uvloop, &loop->queue_processor_);
-  ASSERT(0 == er);
+/* Take in threads moving over from other loops. */
+static void nub__attach_cb(uv_async_t* handle) {
+  nub_loop_t* loop;
+  nub_thread_t* thread;
+  nub_work_t* work;
+
+  loop = (nub_loop_t*) handle->data;
+  while (NULL != (work = nub__mpscq_shift(&loop->attach_queue_))) {
+    thread = work->thread;
+    nub__thread_attach(loop, thread);
+    nub__handshake_post(&thread->thread_lock_hs_);
+  }
+}
+
+
+void nub_loop_init(nub_loop_t* loop) {
+  CHECK_EQ(0, uv_loop_init(&loop->uvloop));
+
+  CHECK_EQ(0, uv_prepare_init(&loop->uvloop, &loop->queue_processor_));
   loop->queue_processor_.data = loop;
   uv_unref((uv_handle_t*) &loop->queue_processor_);
 
-  er = uv_mutex_init(&loop->queue_processor_lock_);
-  ASSERT(0 == er);
+  CHECK_EQ(0, nub__handshake_init(&loop->loop_lock_hs_));
 
-  fuq_init(&loop->blocking_queue_);
+  fuq_init(&loop->wake_queue_);
 
-  er = uv_sem_init(&loop->loop_lock_sem_, 0);
-  ASSERT(0 == er);
+  loop->ref_ = 0;
+  loop->ready_threads_ = NULL;
 
-  fuq_init(&loop->thread_dispose_queue_);
+  nub__mpscq_init(&loop->lock_queue_);
+  loop->lock_handoff_ = 0;
+  loop->shared_holders_ = 0;
+  loop->lock_contenders_ = 0;
+  loop->thread_spin_ns_ = 0;
+  loop->lock_spin_ns_ = 0;
+  loop->defer_wake_ = 0;
+  loop->budget_items_ = 0;
+  loop->budget_ns_ = 0;
+  loop->budget_ = NULL;
+  memset(loop->passed_over_, 0, sizeof(loop->passed_over_));
+  loop->drain_prio_ = NUB_PRIO_HIGH;
+  loop->drain_last_ = NULL;
+  memset(&loop->stats_, 0, sizeof(loop->stats_));
+  loop->trace_size_ = 0;
+  loop->trace_next_id_ = 0;
+  loop->traces_ = NULL;
+  loop->trace_ = NULL;
+  nub__slab_init(loop);
 
-  er = uv_mutex_init(&loop->thread_dispose_lock_);
-  ASSERT(0 == er);
+  CHECK_EQ(0, uv_check_init(&loop->uvloop, &loop->wake_flusher_));
+  loop->wake_flusher_.data = loop;
+  uv_unref((uv_handle_t*) &loop->wake_flusher_);
 
-  fuq_init(&loop->work_queue_);
+  CHECK_EQ(0, uv_idle_init(&loop->uvloop, &loop->budget_idle_));
+  uv_unref((uv_handle_t*) &loop->budget_idle_);
 
-  er = uv_mutex_init(&loop->work_lock_);
-  ASSERT(0 == er);
+  nub__mpscq_init(&loop->attach_queue_);
+  CHECK_EQ(0, uv_async_init(&loop->uvloop,
+                            &loop->attach_signal_,
+                            nub__attach_cb));
+  loop->attach_signal_.data = loop;
+  uv_unref((uv_handle_t*) &loop->attach_signal_);
 
-  async_handle = (uv_async_t*) malloc(sizeof(*async_handle));
-  CHECK_NE(NULL, async_handle);
-  er = uv_async_init(&loop->uvloop, async_handle, nub__thread_dispose);
-  ASSERT(0 == er);
-  async_handle->data = loop;
-  loop->work_ping_ = async_handle;
-  uv_unref((uv_handle_t*) loop->work_ping_);
+  CHECK_EQ(0, uv_prepare_start(&loop->queue_processor_,
+                               nub__async_prepare_cb));
+}
 
-  loop->ref_ = 0;
-  loop->disposed_ = 0;
 
-  er = uv_prepare_start(&loop->queue_processor_, nub__async_prepare_cb);
-  ASSERT(0 == er);
+int nub_loop_configure(nub_loop_t* loop, nub_loop_option option, ...) {
+  va_list ap;
+  int er;
+
+  er = 0;
+  va_start(ap, option);
+
+  switch (option) {
+    case NUB_LOOP_LOCK_HANDOFF:
+      loop->lock_handoff_ = 0 != va_arg(ap, int);
+      break;
+    case NUB_LOOP_THREAD_SPIN:
+      loop->thread_spin_ns_ = (uint64_t) va_arg(ap, unsigned int) * 1000;
+      break;
+    case NUB_LOOP_DEFER_WAKE:
+      loop->defer_wake_ = 0 != va_arg(ap, int);
+      if (loop->defer_wake_)
+        er = uv_check_start(&loop->wake_flusher_, nub__wake_flusher_cb);
+      else
+        er = uv_check_stop(&loop->wake_flusher_);
+      break;
+    case NUB_LOOP_LOCK_SPIN:
+      loop->lock_spin_ns_ = (uint64_t) va_arg(ap, unsigned int) * 1000;
+      break;
+    case NUB_LOOP_TRACE:
+      loop->trace_size_ = va_arg(ap, unsigned int);
+      /* Created first, so the event loop thread's ring gets id 0. */
+      if (NULL == loop->trace_)
+        loop->trace_ = nub__trace_new(loop);
+      break;
+    case NUB_LOOP_BUDGET_ITEMS:
+      loop->budget_items_ = va_arg(ap, unsigned int);
+      break;
+    case NUB_LOOP_BUDGET_TIME:
+      loop->budget_ns_ = (uint64_t) va_arg(ap, unsigned int) * 1000;
+      break;
+    default:
+      er = UV_ENOSYS;
+  }
+
+  va_end(ap);
+
+  return er;
+}
+
+
+void nub_loop_stats(nub_loop_t* loop, nub_loop_stats_t* stats) {
+  *stats = loop->stats_;
+  stats->threads = loop->ref_;
 }
 
 
@@ -109,83 +676,356 @@ int nub_loop_run(nub_loop_t* loop, uv_run_mode mode) {
 
 void nub_loop_dispose(nub_loop_t* loop) {
   ASSERT(0 == uv_loop_alive(&loop->uvloop));
-  ASSERT(1 == fuq_empty(&loop->blocking_queue_));
   ASSERT(0 == loop->ref_);
-  ASSERT(NULL != loop->work_ping_);
-  ASSERT(0 == uv_has_ref((uv_handle_t*) loop->work_ping_));
-  ASSERT(1 == fuq_empty(&loop->thread_dispose_queue_));
+  ASSERT(NULL == loop->ready_threads_);
+  ASSERT(1 == nub__mpscq_empty(&loop->lock_queue_));
+  ASSERT(1 == fuq_empty(&loop->wake_queue_));
+  ASSERT(1 == nub__mpscq_empty(&loop->attach_queue_));
 
-  uv_close((uv_handle_t*) loop->work_ping_, nub__free_handle_cb);
   uv_close((uv_handle_t*) &loop->queue_processor_, NULL);
-  ASSERT(0 == uv_is_active((uv_handle_t*) loop->work_ping_));
+  uv_close((uv_handle_t*) &loop->wake_flusher_, NULL);
+  uv_close((uv_handle_t*) &loop->budget_idle_, NULL);
+  uv_close((uv_handle_t*) &loop->attach_signal_, NULL);
 
-  fuq_dispose(&loop->thread_dispose_queue_);
-  uv_mutex_destroy(&loop->thread_dispose_lock_);
-  uv_sem_destroy(&loop->loop_lock_sem_);
-  fuq_dispose(&loop->blocking_queue_);
-  uv_mutex_destroy(&loop->queue_processor_lock_);
-  fuq_dispose(&loop->work_queue_);
-  uv_mutex_destroy(&loop->work_lock_);
+  nub__handshake_destroy(&loop->loop_lock_hs_);
+  fuq_dispose(&loop->wake_queue_);
+  nub__trace_free(loop);
 
   CHECK_EQ(0, uv_run(&loop->uvloop, UV_RUN_NOWAIT));
   CHECK_NE(UV_EBUSY, uv_loop_close(&loop->uvloop));
+
+  /* Closing the handles above may have returned memory to the slabs. */
+  nub__slab_dispose(loop);
+}
+
+
+/* Push a lock request made from the thread onto the lock_queue_. */
+static int nub__lock_push(nub_thread_t* thread, nub_work_t* work) {
+  NUB__TRACE(thread->trace_, NUB__TRACE_LOCK_REQUEST, work->work_type);
+
+  if (nub__mpscq_push(&thread->nubloop->lock_queue_, work)) {
+    /* Send signal to event loop thread that work needs to be done. */
+    thread->stats_.async_sent++;
+    return uv_async_send(thread->async_signal_);
+  }
+
+  thread->stats_.async_coalesced++;
+  return 0;
+}
+
+
+/* Queue the thread's lock request. The caller must have counted itself in
+ * lock_contenders_ and must wait on thread_lock_hs_ afterwards. */
+static int nub__lock_request(nub_thread_t* thread, uv_work_types type) {
+  ASSERT(NULL != thread);
+
+  if (NUB__LOCK_CANCELLED == thread->lock_state_) {
+    /* The previous request timed out but is still in the queue. Reviving it
+     * keeps its place in line. */
+    if (NUB_LOOP_QUEUE_LOCK == type &&
+        NUB__LOCK_CANCELLED == nub__cmpxchgi(&thread->lock_state_,
+                                             NUB__LOCK_CANCELLED,
+                                             NUB__LOCK_WAITING)) {
+      return 0;
+    }
+    /* Can't be pushed again until it's been dropped. */
+    while (NUB__LOCK_CANCELLED == thread->lock_state_)
+      nub__thread_yield();
+  }
+
+  thread->work.work_type = type;
+  thread->lock_state_ = NUB__LOCK_WAITING;
+
+  return nub__lock_push(thread, &thread->work);
+}
+
+
+/* Should be run once the thread has been let in, with the time it started
+ * asking. */
+static void nub__lock_acquired(nub_thread_t* thread, uint64_t start) {
+  thread->lock_since_ = uv_hrtime();
+  thread->stats_.locks++;
+  NUB__TRACE(thread->trace_, NUB__TRACE_LOCK_GRANT, 0);
+  NUB__STATS_ADD(thread->stats_.lock_wait_ns,
+                 thread->stats_.lock_wait_max_ns,
+                 thread->lock_since_ - start);
+}
+
+
+static void nub__lock_released(nub_thread_t* thread) {
+  NUB__TRACE(thread->trace_, NUB__TRACE_LOCK_RELEASE, 0);
+  NUB__STATS_ADD(thread->stats_.lock_hold_ns,
+                 thread->stats_.lock_hold_max_ns,
+                 uv_hrtime() - thread->lock_since_);
+}
+
+
+static int nub__lock_wait(nub_thread_t* thread, uv_work_types type) {
+  uint64_t start;
+  int er;
+
+  start = uv_hrtime();
+  nub__atomic_add(&thread->nubloop->lock_contenders_, 1);
+  er = nub__lock_request(thread, type);
+
+  /* Pause thread until the event loop has halted. */
+  nub__handshake_wait(&thread->thread_lock_hs_,
+                      thread->nubloop->lock_spin_ns_);
+  nub__lock_acquired(thread, start);
+
+  return er;
 }
 
 
 /* Should be run from spawned thread. */
 int nub_loop_lock(nub_thread_t* thread) {
-  fuq_queue_t* queue;
-  uv_mutex_t* mutex;
+  return nub__lock_wait(thread, NUB_LOOP_QUEUE_LOCK);
+}
+
+
+/* Should be run from spawned thread. */
+int nub_loop_trylock(nub_thread_t* thread) {
+  uint64_t start;
   int er;
-  int is_empty;
 
-  ASSERT(NULL != thread);
+  if (0 != nub__cmpxchgi(&thread->nubloop->lock_contenders_, 0, 1)) {
+    thread->stats_.lock_timeouts++;
+    NUB__TRACE(thread->trace_, NUB__TRACE_LOCK_TIMEOUT, 0);
+    return UV_EBUSY;
+  }
 
-  queue = &thread->nubloop->work_queue_;
-  mutex = &thread->nubloop->work_lock_;
+  start = uv_hrtime();
+  er = nub__lock_request(thread, NUB_LOOP_QUEUE_LOCK);
+  nub__handshake_wait(&thread->thread_lock_hs_,
+                      thread->nubloop->lock_spin_ns_);
+  nub__lock_acquired(thread, start);
 
-  if (NUB_LOOP_QUEUE_DISPOSE != thread->work.work_type)
-    thread->work.work_type = NUB_LOOP_QUEUE_LOCK;
+  return er;
+}
 
-  uv_mutex_lock(mutex);
-  is_empty = fuq_empty(queue);
-  fuq_enqueue(queue, &thread->work);
-  uv_mutex_unlock(mutex);
 
-  if (is_empty)
-    /* Send signal to event loop thread that work needs to be done. */
-    er = uv_async_send(thread->async_signal_);
-  else
-    er = 0;
+/* Should be run from spawned thread. */
+int nub_loop_lock_timeout(nub_thread_t* thread, uint64_t timeout) {
+  nub_loop_t* loop;
+  uint64_t start;
+  int er;
+
+  loop = thread->nubloop;
+  start = uv_hrtime();
 
-  /* Pause thread until uv_async_cb has run. */
-  uv_sem_wait(&thread->thread_lock_sem_);
+  nub__atomic_add(&loop->lock_contenders_, 1);
+  er = nub__lock_request(thread, NUB_LOOP_QUEUE_LOCK);
+
+  if (0 == nub__handshake_timedwait(&thread->thread_lock_hs_,
+                                    loop->lock_spin_ns_,
+                                    timeout)) {
+    nub__lock_acquired(thread, start);
+    return er;
+  }
+
+  /* Withdraw the request. If it was granted in the meantime the post is
+   * already on its way. */
+  if (NUB__LOCK_WAITING == nub__cmpxchgi(&thread->lock_state_,
+                                         NUB__LOCK_WAITING,
+                                         NUB__LOCK_CANCELLED)) {
+    nub__atomic_add(&loop->lock_contenders_, -1);
+    thread->stats_.lock_timeouts++;
+    NUB__TRACE(thread->trace_, NUB__TRACE_LOCK_TIMEOUT, 0);
+    return UV_ETIMEDOUT;
+  }
+
+  nub__handshake_wait(&thread->thread_lock_hs_, loop->lock_spin_ns_);
+  nub__lock_acquired(thread, start);
 
   return er;
 }
 
 
 void nub_loop_unlock(nub_thread_t* thread) {
-  uv_sem_post(&thread->nubloop->loop_lock_sem_);
+  nub__lock_released(thread);
+  nub__lock_release(thread->nubloop);
+  nub__atomic_add(&thread->nubloop->lock_contenders_, -1);
+}
+
+
+/* Should be run from the fiber. */
+int nub_fiber_lock(nub_fiber_t* fiber) {
+  nub_thread_t* thread;
+  uint64_t start;
+  int er;
+
+  thread = fiber->thread;
+  start = uv_hrtime();
+  nub__atomic_add(&thread->nubloop->lock_contenders_, 1);
+  fiber->work.work_type = NUB_LOOP_QUEUE_FIBER_LOCK;
+  er = nub__lock_push(thread, &fiber->work);
+
+  /* Resumed by nub__lock_grant() once the loop has halted. */
+  nub__fiber_suspend(fiber);
+  fiber->work.work_type = NUB_LOOP_QUEUE_NONE;
+  nub__lock_acquired(thread, start);
+
+  return er;
+}
+
+
+void nub_fiber_unlock(nub_fiber_t* fiber) {
+  nub_loop_unlock(fiber->thread);
+}
+
+
+/* Should be run from spawned thread. */
+int nub_loop_lock_shared(nub_thread_t* thread) {
+  return nub__lock_wait(thread, NUB_LOOP_QUEUE_LOCK_SHARED);
+}
+
+
+void nub_loop_unlock_shared(nub_thread_t* thread) {
+  nub_loop_t* loop;
+
+  loop = thread->nubloop;
+  nub__lock_released(thread);
+  nub__atomic_add(&loop->lock_contenders_, -1);
+  if (0 == nub__atomic_add(&loop->shared_holders_, -1))
+    nub__lock_release(loop);
 }
 
 
 void nub_loop_enqueue(nub_thread_t* thread,
                       nub_work_t* work,
                       nub_complete_cb cb) {
-  nub_loop_t* loop;
+  nub_loop_enqueue_prio(thread, work, cb, NUB_PRIO_NORMAL);
+}
+
 
+void nub_loop_enqueue_prio(nub_thread_t* thread,
+                           nub_work_t* work,
+                           nub_complete_cb cb,
+                           nub_prio prio) {
   ASSERT(NULL != thread);
   ASSERT(NULL == work->thread);
-
-  loop = thread->nubloop;
+  ASSERT((unsigned int) prio < NUB__PRIOS);
 
   work->thread = thread;
+  work->prio = prio;
   work->complete_cb = cb;
   work->work_type = NUB_LOOP_QUEUE_WORK;
+  thread->stats_.loop_enqueued++;
+  NUB__TRACE(thread->trace_, NUB__TRACE_ENQUEUE, 0);
+
+  nub__thread_push(thread, work);
+}
+
+
+/* Should be run from spawned thread. */
+int nub_loop_call(nub_thread_t* thread,
+                  nub_call_cb cb,
+                  void* arg,
+                  void** result) {
+  nub__call_t call;
+  uint64_t start;
+  int er;
+
+  ASSERT(NULL != thread);
+
+  start = uv_hrtime();
+  nub_work_init(&call.work, NULL, NULL);
+  call.work.thread = thread;
+  call.work.work_type = NUB_LOOP_QUEUE_CALL;
+  call.cb = cb;
+  call.arg = arg;
+  call.result = NULL;
+  thread->stats_.calls++;
+  NUB__TRACE(thread->trace_, NUB__TRACE_ENQUEUE, 0);
+
+  er = nub__thread_push(thread, &call.work);
+
+  /* The thread can't be waiting on a lock at the same time, so the lock
+   * handshake is free to signal the return. */
+  nub__handshake_wait(&thread->thread_lock_hs_,
+                      thread->nubloop->lock_spin_ns_);
+  NUB__STATS_ADD(thread->stats_.call_wait_ns,
+                 thread->stats_.call_wait_max_ns,
+                 uv_hrtime() - start);
+
+  if (NULL != result)
+    *result = call.result;
+
+  return er;
+}
+
+
+void nub__ready_remove(nub_loop_t* loop, nub_thread_t* thread) {
+  nub_thread_t* stack;
+  nub_thread_t* rest;
+  nub_thread_t* next;
+  nub_thread_t* head;
+
+  /* Only the event loop thread takes from the stack, so the others can be
+   * pushed back oldest first to keep their order. */
+  stack = (nub_thread_t*) nub__xchgp((void* volatile*) &loop->ready_threads_,
+                                     NULL);
+  rest = NULL;
+  for (; NULL != stack; stack = next) {
+    next = stack->next_ready_;
+    if (thread == stack)
+      continue;
+    stack->next_ready_ = rest;
+    rest = stack;
+  }
+
+  for (; NULL != rest; rest = next) {
+    next = rest->next_ready_;
+    do {
+      head = loop->ready_threads_;
+      rest->next_ready_ = head;
+    } while (head != nub__cmpxchgp((void* volatile*) &loop->ready_threads_,
+                                   head,
+                                   rest));
+  }
+
+  thread->outgoing_signaled_ = 0;
+  thread->next_ready_ = NULL;
+}
+
+
+void nub__thread_reap(nub_loop_t* loop, nub_thread_t* thread) {
+  fuq_queue_t* queue;
+  int join;
+  int prio;
+
+  /* Its dispose request is in by the time it's left. */
+  while (0 == thread->exited_)
+    nub__thread_yield();
+  nub__barrier();
+
+  join = 0;
+  for (prio = 0; prio < NUB__PRIOS; prio++) {
+    queue = &thread->outgoing_[prio];
+    while (0 == join && !fuq_empty(queue))
+      join = nub__process_work(loop, (nub_work_t*) fuq_dequeue(queue));
+  }
+  ASSERT(1 == join);
+
+  nub_thread_join(thread);
+  if (NULL != thread->disposed_cb_)
+    thread->disposed_cb_(thread);
+}
+
+
+int nub__thread_push(nub_thread_t* thread, nub_work_t* work) {
+  fuq_enqueue(&thread->outgoing_[work->prio], work);
+
+  /* Already on the stack and the event loop hasn't started draining the
+   * queue, so it will see this item without being told again. */
+  if (0 != nub__xchgi(&thread->outgoing_signaled_, 1)) {
+    thread->stats_.async_coalesced++;
+    return 0;
+  }
+
+  nub__ready_push(thread->nubloop, thread);
 
-  uv_mutex_lock(&loop->work_lock_);
-  fuq_enqueue(&loop->work_queue_, work);
-  uv_mutex_unlock(&loop->work_lock_);
-  uv_async_send(thread->nubloop->work_ping_);
+  /* Send signal to event loop thread that work needs to be done. */
+  thread->stats_.async_sent++;
+  return uv_async_send(thread->async_signal_);
 }
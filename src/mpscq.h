@@ -0,0 +1,104 @@
+#ifndef LIBNUB_MPSCQ_H_
+#define LIBNUB_MPSCQ_H_
+
+#include "nub.h"
+#include "atomic-ops.h"
+
+/* Intrusive multi-producer single-consumer queue, linked through
+ * nub_work_t::next. Pushing is a single atomic exchange and never waits.
+ * Only one thread may shift at a time, though which thread that is can change
+ * as long as the hand over is synchronized (e.g. by a semaphore).
+ *
+ * Based on the algorithm by Dmitry Vyukov:
+ * http://www.1024cores.net/home/lock-free-algorithms/queues/intrusive-mpsc-node-based-queue
+ */
+
+NUB__UNUSED(static void nub__mpscq_init(nub__mpscq_t* q));
+NUB__UNUSED(static int nub__mpscq_push(nub__mpscq_t* q, nub_work_t* work));
+NUB__UNUSED(static nub_work_t* nub__mpscq_shift(nub__mpscq_t* q));
+NUB__UNUSED(static nub_work_t* nub__mpscq_peek(nub__mpscq_t* q));
+NUB__UNUSED(static int nub__mpscq_empty(nub__mpscq_t* q));
+
+
+static void nub__mpscq_init(nub__mpscq_t* q) {
+  q->stub_.next = NULL;
+  q->head_ = &q->stub_;
+  q->tail_ = &q->stub_;
+}
+
+
+/* Returns 1 if the queue may have been empty before the push, in which case
+ * the consumer needs to be signaled. Producers that push onto a non-empty
+ * queue can rely on the consumer shifting until it's empty. */
+static int nub__mpscq_push(nub__mpscq_t* q, nub_work_t* work) {
+  nub_work_t* prev;
+
+  work->next = NULL;
+  prev = (nub_work_t*) nub__xchgp((void* volatile*) &q->head_, work);
+  /* Between the exchange and this store the queue is briefly unlinked. The
+   * consumer waits it out in nub__mpscq_shift(). */
+  prev->next = work;
+
+  return prev == &q->stub_;
+}
+
+
+/* Returns NULL if the queue is empty. A push that has started but not yet
+ * completed only counts if it wasn't onto an empty queue. */
+static nub_work_t* nub__mpscq_shift(nub__mpscq_t* q) {
+  nub_work_t* tail;
+  nub_work_t* next;
+
+  tail = q->tail_;
+  next = tail->next;
+
+  if (tail == &q->stub_) {
+    if (NULL == next)
+      return NULL;
+    q->tail_ = next;
+    tail = next;
+    next = next->next;
+  }
+
+  if (NULL != next) {
+    q->tail_ = next;
+    return tail;
+  }
+
+  if (tail != q->head_) {
+    /* A producer is between its exchange and its link. */
+    while (NULL == (next = tail->next))
+      nub__cpu_relax();
+    q->tail_ = next;
+    return tail;
+  }
+
+  nub__mpscq_push(q, &q->stub_);
+
+  next = tail->next;
+  if (NULL == next) {
+    /* Another producer pushed before the stub. */
+    while (NULL == (next = tail->next))
+      nub__cpu_relax();
+  }
+
+  q->tail_ = next;
+  return tail;
+}
+
+
+/* Returns the item the next nub__mpscq_shift() will return. Can return NULL
+ * while a push is still completing, even though the shift wouldn't. Must only
+ * be run by the consumer. */
+static nub_work_t* nub__mpscq_peek(nub__mpscq_t* q) {
+  if (q->tail_ == &q->stub_)
+    return q->stub_.next;
+  return q->tail_;
+}
+
+
+static int nub__mpscq_empty(nub__mpscq_t* q) {
+  return q->tail_ == &q->stub_ && NULL == q->stub_.next;
+}
+
+#endif  /* LIBNUB_MPSCQ_H_ */
@@ -0,0 +1,389 @@
+#include "nub.h"
+#include "atomic-ops.h"
+#include "internal.h"
+#include "trace.h"
+#include "util.h"
+#include "uv.h"
+
+#include <stdlib.h>  /* calloc, realloc, free */
+
+/* Average number of queued items per running thread before another thread is
+ * started. */
+#define NUB__POOL_GROW_DEPTH 4
+/* Milliseconds a thread above min_threads can sit idle before it's joined. */
+#define NUB__POOL_IDLE_TIMEOUT 1000
+#define NUB__POOL_DEQUE_SIZE 64
+
+
+/* thread must come first so the nub_thread_t passed to the thread's entry can
+ * be cast back to the worker. */
+struct nub_pool_worker_s {
+  nub_thread_t thread;
+  nub_pool_t* pool;
+
+  /* Ring buffer of queued work. Pushed to from the event loop thread. The
+   * owning thread pops the newest item while it's still warm, and threads
+   * stealing work shift the oldest. */
+  uv_mutex_t lock;
+  nub_work_t** items;
+  unsigned int size;
+  unsigned int head;
+  volatile unsigned int count;
+
+  /* Only written from the event loop thread. */
+  int active;
+  /* Set by the event loop thread to have the worker dispose of itself. Stays
+   * set until it's been joined, so the slot isn't reused before then. */
+  volatile int retiring;
+  /* Set by the worker when there was nothing to run or steal. Cleared by the
+   * event loop thread when waking the worker so it's only woken once. */
+  volatile int idle;
+  uint64_t idle_since;
+};
+
+typedef struct nub_pool_worker_s nub_pool_worker_t;
+
+
+static void nub__deque_push(nub_pool_worker_t* worker, nub_work_t* work) {
+  nub_work_t** items;
+  unsigned int i;
+
+  uv_mutex_lock(&worker->lock);
+
+  if (worker->count == worker->size) {
+    items = (nub_work_t**) realloc(worker->items,
+                                   sizeof(*items) * worker->size * 2);
+    CHECK_NE(NULL, items);
+    /* Unwrap the ring so the items that wrapped around follow the rest. */
+    for (i = 0; i < worker->head; i++)
+      items[worker->size + i] = items[i];
+    worker->items = items;
+    worker->size *= 2;
+  }
+
+  worker->items[(worker->head + worker->count) % worker->size] = work;
+  worker->count++;
+
+  uv_mutex_unlock(&worker->lock);
+}
+
+
+/* Take the newest item. Only run by the owning thread. */
+static nub_work_t* nub__deque_pop(nub_pool_worker_t* worker) {
+  nub_work_t* work;
+
+  if (0 == worker->count)
+    return NULL;
+
+  uv_mutex_lock(&worker->lock);
+
+  if (0 == worker->count) {
+    work = NULL;
+  } else {
+    worker->count--;
+    work = worker->items[(worker->head + worker->count) % worker->size];
+  }
+
+  uv_mutex_unlock(&worker->lock);
+
+  return work;
+}
+
+
+/* Take the oldest item. Run by threads stealing from the worker. */
+static nub_work_t* nub__deque_shift(nub_pool_worker_t* worker) {
+  nub_work_t* work;
+
+  /* Avoid taking the lock on an empty queue when scanning for work. */
+  if (0 == worker->count)
+    return NULL;
+
+  uv_mutex_lock(&worker->lock);
+
+  if (0 == worker->count) {
+    work = NULL;
+  } else {
+    work = worker->items[worker->head];
+    worker->head = (worker->head + 1) % worker->size;
+    worker->count--;
+  }
+
+  uv_mutex_unlock(&worker->lock);
+
+  return work;
+}
+
+
+/* Take the oldest item from the first other worker that has any queued. */
+static nub_work_t* nub__pool_steal(nub_pool_t* pool,
+                                   nub_pool_worker_t* thief) {
+  nub_pool_worker_t* victim;
+  nub_work_t* work;
+  unsigned int idx;
+  unsigned int i;
+
+  idx = (unsigned int) (thief - pool->workers_);
+
+  for (i = 1; i < pool->max_threads; i++) {
+    victim = &pool->workers_[(idx + i) % pool->max_threads];
+    work = nub__deque_shift(victim);
+    if (NULL != work)
+      return work;
+  }
+
+  return NULL;
+}
+
+
+/* Runs from the event loop thread once a retired worker has been joined. */
+static void nub__pool_retired_cb(nub_thread_t* thread) {
+  nub_pool_worker_t* worker;
+
+  worker = (nub_pool_worker_t*) thread;
+  worker->pool->retiring_--;
+  worker->retiring = 0;
+}
+
+
+int nub__pool_work(nub_thread_t* thread) {
+  nub_pool_worker_t* worker;
+  nub_pool_t* pool;
+  nub_work_t* work;
+  int n;
+
+  worker = (nub_pool_worker_t*) thread;
+  pool = worker->pool;
+  worker->idle = 0;
+
+  for (n = 0; ; n++) {
+    work = nub__deque_pop(worker);
+    if (NULL == work)
+      work = nub__pool_steal(pool, worker);
+    if (NULL == work)
+      break;
+    nub__atomic_add(&pool->pending_, -1);
+    NUB__TRACE(thread->trace_, NUB__TRACE_DEQUEUE, work->work_type);
+    nub__thread_run(thread, work);
+  }
+
+  thread->stats_.processed += n;
+
+  if (0 == n) {
+    worker->idle_since = uv_hrtime();
+    worker->idle = 1;
+  }
+
+  /* Nothing gets pushed to a retiring worker, so once it's out of work it
+   * goes through the same dispose path as any other thread. */
+  if (0 == n && 0 != worker->retiring && 0 == thread->disposed)
+    nub_thread_dispose(thread, nub__pool_retired_cb);
+
+  return n;
+}
+
+
+int nub__pool_has_work(nub_thread_t* thread) {
+  nub_pool_worker_t* worker;
+
+  worker = (nub_pool_worker_t*) thread;
+  /* idle is cleared when the event loop wants this worker to go steal. */
+  return 0 < worker->count || 0 == worker->idle || 0 != worker->retiring;
+}
+
+
+static int nub__pool_spawn(nub_pool_t* pool) {
+  nub_pool_worker_t* worker;
+  unsigned int i;
+  int er;
+
+  for (i = 0; i < pool->max_threads; i++) {
+    worker = &pool->workers_[i];
+    if (0 == worker->active && 0 == worker->retiring)
+      break;
+  }
+  CHECK_LT(i, pool->max_threads);
+
+  worker->idle = 0;
+  er = nub__thread_create(pool->nubloop, &worker->thread, pool, NULL);
+  if (0 != er)
+    return er;
+
+  worker->active = 1;
+  pool->nthreads++;
+
+  return 0;
+}
+
+
+/* Have an idle worker dispose of itself. It's joined by the event loop once
+ * its dispose request comes through, same as any other thread. */
+static void nub__pool_retire(nub_pool_t* pool, nub_pool_worker_t* worker) {
+  ASSERT(1 == worker->active);
+  worker->active = 0;
+  worker->retiring = 1;
+  pool->nthreads--;
+  pool->retiring_++;
+  nub__thread_wake(&worker->thread);
+}
+
+
+static void nub__pool_join(nub_pool_t* pool, nub_pool_worker_t* worker) {
+  if (0 != worker->retiring) {
+    /* Already on its way out, but its dispose request may not have been
+     * seen by the event loop yet. */
+    nub__thread_reap(pool->nubloop, &worker->thread);
+    ASSERT(0 == worker->retiring);
+    return;
+  }
+  ASSERT(1 == worker->active);
+  worker->active = 0;
+  pool->nthreads--;
+  nub_thread_join(&worker->thread);
+}
+
+
+static void nub__pool_shrink_cb(uv_timer_t* handle) {
+  nub_pool_worker_t* worker;
+  nub_pool_t* pool;
+  uint64_t now;
+  uint64_t timeout;
+  unsigned int i;
+
+  pool = (nub_pool_t*) handle->data;
+  now = uv_hrtime();
+  timeout = (uint64_t) NUB__POOL_IDLE_TIMEOUT * 1000000;
+
+  for (i = 0; i < pool->max_threads; i++) {
+    if (pool->nthreads <= pool->min_threads)
+      break;
+    worker = &pool->workers_[i];
+    if (0 == worker->active || 0 == worker->idle || 0 < worker->count)
+      continue;
+    if (now - worker->idle_since >= timeout)
+      nub__pool_retire(pool, worker);
+  }
+}
+
+
+int nub_pool_init(nub_loop_t* loop,
+                  nub_pool_t* pool,
+                  unsigned int min_threads,
+                  unsigned int max_threads) {
+  nub_pool_worker_t* worker;
+  unsigned int i;
+  int er;
+
+  CHECK_GT(min_threads, 0);
+  CHECK_LE(min_threads, max_threads);
+
+  pool->nubloop = loop;
+  pool->min_threads = min_threads;
+  pool->max_threads = max_threads;
+  pool->nthreads = 0;
+  pool->next_worker_ = 0;
+  pool->pending_ = 0;
+  pool->retiring_ = 0;
+
+  pool->workers_ = (nub_pool_worker_t*) calloc(max_threads, sizeof(*worker));
+  CHECK_NE(NULL, pool->workers_);
+
+  for (i = 0; i < max_threads; i++) {
+    worker = &pool->workers_[i];
+    worker->pool = pool;
+    worker->size = NUB__POOL_DEQUE_SIZE;
+    worker->items = (nub_work_t**) malloc(sizeof(*worker->items) *
+                                          worker->size);
+    CHECK_NE(NULL, worker->items);
+    er = uv_mutex_init(&worker->lock);
+    ASSERT(0 == er);
+  }
+
+  er = uv_timer_init(&loop->uvloop, &pool->shrink_timer_);
+  ASSERT(0 == er);
+  pool->shrink_timer_.data = pool;
+  uv_unref((uv_handle_t*) &pool->shrink_timer_);
+
+  if (min_threads < max_threads) {
+    er = uv_timer_start(&pool->shrink_timer_,
+                        nub__pool_shrink_cb,
+                        NUB__POOL_IDLE_TIMEOUT,
+                        NUB__POOL_IDLE_TIMEOUT);
+    ASSERT(0 == er);
+  }
+
+  for (i = 0; i < min_threads; i++) {
+    er = nub__pool_spawn(pool);
+    if (0 != er) {
+      nub_pool_dispose(pool);
+      return er;
+    }
+  }
+
+  return 0;
+}
+
+
+void nub_pool_enqueue(nub_pool_t* pool, nub_work_t* work) {
+  nub_pool_worker_t* worker;
+  nub_pool_worker_t* idle;
+  unsigned int i;
+  int busy;
+
+  ASSERT(0 < pool->nthreads);
+
+  if (pool->nthreads + pool->retiring_ < pool->max_threads &&
+      pool->pending_ >= (int) pool->nthreads * NUB__POOL_GROW_DEPTH) {
+    /* Failing to start another thread isn't fatal. The work will still be
+     * picked up by the threads already running. */
+    nub__pool_spawn(pool);
+  }
+
+  do {
+    worker = &pool->workers_[pool->next_worker_];
+    pool->next_worker_ = (pool->next_worker_ + 1) % pool->max_threads;
+  } while (0 == worker->active);
+
+  busy = 0 == worker->idle;
+  nub__atomic_add(&pool->pending_, 1);
+  nub__deque_push(worker, work);
+  worker->idle = 0;
+  nub__thread_wake(&worker->thread);
+
+  /* The target is busy. Wake an idle worker so it can steal the work. */
+  if (busy) {
+    for (i = 0; i < pool->max_threads; i++) {
+      idle = &pool->workers_[i];
+      if (1 == idle->active && 1 == idle->idle) {
+        idle->idle = 0;
+        nub__thread_wake(&idle->thread);
+        break;
+      }
+    }
+  }
+}
+
+
+void nub_pool_dispose(nub_pool_t* pool) {
+  nub_pool_worker_t* worker;
+  unsigned int i;
+
+  for (i = 0; i < pool->max_threads; i++) {
+    worker = &pool->workers_[i];
+    if (1 == worker->active || 0 != worker->retiring)
+      nub__pool_join(pool, worker);
+  }
+
+  ASSERT(0 == pool->nthreads);
+  ASSERT(0 == pool->retiring_);
+  ASSERT(0 == pool->pending_);
+
+  for (i = 0; i < pool->max_threads; i++) {
+    worker = &pool->workers_[i];
+    uv_mutex_destroy(&worker->lock);
+    free(worker->items);
+  }
+
+  uv_close((uv_handle_t*) &pool->shrink_timer_, NULL);
+  free(pool->workers_);
+  pool->workers_ = NULL;
+}
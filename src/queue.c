@@ -7,4 +7,17 @@ void nub_work_init(nub_work_t* work, nub_work_cb cb, void* arg) {
   /* Only used for enqueued work for the event loop thread. */
   work->thread = NULL;
   work->complete_cb = NULL;
+  work->work_type = NUB_LOOP_QUEUE_NONE;
+  work->status = 0;
+  work->prio = NUB_PRIO_NORMAL;
+  work->deadline = 0;
+  work->expired_cb = NULL;
+}
+
+
+void nub_work_set_deadline(nub_work_t* work,
+                           uint64_t deadline,
+                           nub_complete_cb cb) {
+  work->deadline = deadline;
+  work->expired_cb = cb;
 }
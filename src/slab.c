@@ -0,0 +1,181 @@
+#include "nub.h"
+#include "atomic-ops.h"
+#include "slab.h"
+#include "util.h"
+#include "uv.h"
+
+#include <stdlib.h>  /* malloc, free */
+#include <string.h>  /* memset */
+
+/* Objects carved out of each block. */
+#define NUB__SLAB_OBJECTS 64
+
+/* Room in front of each object and at the start of each block. Keeps objects
+ * 16 byte aligned. */
+#define NUB__SLAB_HEADER 16
+
+#define NUB__SLAB_ROUND(size) (((size) + 15) & ~(size_t) 15)
+
+typedef struct {
+  nub__slab_cache_t* cache;  /* Where the object goes back to */
+  nub__slab_class cls;
+} nub__slab_header_t;
+
+static const size_t nub__slab_sizes[NUB__SLAB_CLASSES] = {
+  NUB__SLAB_ROUND(sizeof(nub_work_t)) + NUB_WORK_EXTRA_SIZE,
+  sizeof(uv_async_t)
+};
+
+
+static nub__slab_header_t* nub__slab_header(void* ptr) {
+  return (nub__slab_header_t*) ((char*) ptr - NUB__SLAB_HEADER);
+}
+
+
+/* Allocate a block and put all but the first object on the local list. */
+static void* nub__slab_refill(nub_loop_t* loop,
+                              nub__slab_cache_t* cache,
+                              nub__slab_class cls) {
+  nub__slab_header_t* header;
+  size_t stride;
+  char* block;
+  void* head;
+  void* ptr;
+  int i;
+
+  stride = NUB__SLAB_HEADER + NUB__SLAB_ROUND(nub__slab_sizes[cls]);
+  block = (char*) malloc(NUB__SLAB_HEADER + stride * NUB__SLAB_OBJECTS);
+  if (NULL == block)
+    return NULL;
+
+  /* Any thread can add blocks, and only nub__slab_dispose() takes them. */
+  do {
+    head = loop->slabs_;
+    *(void**) block = head;
+  } while (head != nub__cmpxchgp(&loop->slabs_, head, block));
+
+  for (i = NUB__SLAB_OBJECTS - 1; i >= 0; i--) {
+    ptr = block + NUB__SLAB_HEADER + stride * i + NUB__SLAB_HEADER;
+    header = nub__slab_header(ptr);
+    header->cache = cache;
+    header->cls = cls;
+    if (0 == i)
+      break;
+    *(void**) ptr = cache->local_[cls];
+    cache->local_[cls] = ptr;
+  }
+
+  return ptr;
+}
+
+
+void nub__slab_init(nub_loop_t* loop) {
+  memset(&loop->slab_cache_, 0, sizeof(loop->slab_cache_));
+  loop->slabs_ = NULL;
+  loop->slab_orphans_ = NULL;
+}
+
+
+void nub__slab_dispose(nub_loop_t* loop) {
+  void* block;
+  void* next;
+
+  for (block = loop->slabs_; NULL != block; block = next) {
+    next = *(void**) block;
+    free(block);
+  }
+
+  nub__slab_init(loop);
+}
+
+
+void* nub__slab_alloc(nub_loop_t* loop,
+                      nub__slab_cache_t* cache,
+                      nub__slab_class cls) {
+  void* ptr;
+
+  ptr = cache->local_[cls];
+  if (NULL == ptr) {
+    if (NULL != cache->remote_[cls])
+      ptr = nub__xchgp(&cache->remote_[cls], NULL);
+    if (NULL == ptr)
+      return nub__slab_refill(loop, cache, cls);
+  }
+
+  cache->local_[cls] = *(void**) ptr;
+  return ptr;
+}
+
+
+void nub__slab_free(nub__slab_cache_t* cache, void* ptr) {
+  nub__slab_header_t* header;
+  nub__slab_cache_t* owner;
+  void* head;
+
+  header = nub__slab_header(ptr);
+  owner = header->cache;
+
+  if (owner == cache) {
+    *(void**) ptr = cache->local_[header->cls];
+    cache->local_[header->cls] = ptr;
+    return;
+  }
+
+  /* The owner takes the whole list at once, so pushing can't be confused by
+   * a node being popped and pushed again. */
+  do {
+    head = owner->remote_[header->cls];
+    *(void**) ptr = head;
+  } while (head != nub__cmpxchgp(&owner->remote_[header->cls], head, ptr));
+}
+
+
+nub__slab_cache_t* nub__slab_cache_new(nub_loop_t* loop) {
+  nub__slab_cache_t* cache;
+
+  cache = loop->slab_orphans_;
+  if (NULL != cache) {
+    loop->slab_orphans_ = cache->next_;
+    cache->next_ = NULL;
+    return cache;
+  }
+
+  CHECK_LE(sizeof(*cache), sizeof(nub_work_t));
+  cache = (nub__slab_cache_t*) nub__slab_alloc(loop,
+                                               &loop->slab_cache_,
+                                               NUB__SLAB_WORK);
+  CHECK_NE(NULL, cache);
+  memset(cache, 0, sizeof(*cache));
+
+  return cache;
+}
+
+
+void nub__slab_cache_orphan(nub_loop_t* loop, nub__slab_cache_t* cache) {
+  cache->next_ = loop->slab_orphans_;
+  loop->slab_orphans_ = cache;
+}
+
+
+nub_work_t* nub_loop_work_alloc(nub_loop_t* loop) {
+  return (nub_work_t*) nub__slab_alloc(loop,
+                                       &loop->slab_cache_,
+                                       NUB__SLAB_WORK);
+}
+
+
+nub_work_t* nub_thread_work_alloc(nub_thread_t* thread) {
+  return (nub_work_t*) nub__slab_alloc(thread->nubloop,
+                                       thread->slab_cache_,
+                                       NUB__SLAB_WORK);
+}
+
+
+void nub_loop_work_free(nub_loop_t* loop, nub_work_t* work) {
+  nub__slab_free(&loop->slab_cache_, work);
+}
+
+
+void nub_thread_work_free(nub_thread_t* thread, nub_work_t* work) {
+  nub__slab_free(thread->slab_cache_, work);
+}
@@ -0,0 +1,42 @@
+#ifndef LIBNUB_SLAB_H_
+#define LIBNUB_SLAB_H_
+
+#include "nub.h"
+
+/* Fixed size objects carved out of blocks that live as long as the loop. Each
+ * thread allocates from its own nub__slab_cache_t without locking. Objects
+ * freed by the owning thread go straight back on its local list, and objects
+ * freed by any other thread are pushed onto the owner's remote list, which the
+ * owner takes as a whole once its local list runs dry. */
+
+typedef enum {
+  NUB__SLAB_WORK,  /* nub_work_t plus its extra bytes, and the caches */
+  NUB__SLAB_ASYNC  /* uv_async_t */
+} nub__slab_class;
+
+void nub__slab_init(nub_loop_t* loop);
+
+/* Free every block. Must be run once nothing allocated from the loop is in
+ * use anymore. */
+void nub__slab_dispose(nub_loop_t* loop);
+
+/* Must be run from the thread that owns cache. Returns NULL if out of
+ * memory. */
+void* nub__slab_alloc(nub_loop_t* loop,
+                      nub__slab_cache_t* cache,
+                      nub__slab_class cls);
+
+/* cache is the calling thread's own cache. ptr can come from any cache on the
+ * same loop. */
+void nub__slab_free(nub__slab_cache_t* cache, void* ptr);
+
+/* Get a cache for a new thread. Must be run from the event loop thread. */
+nub__slab_cache_t* nub__slab_cache_new(nub_loop_t* loop);
+
+/* Set aside the cache of a thread that's gone, along with whatever is still on
+ * its free lists, for nub__slab_cache_new() to hand out again. Objects from it
+ * that are still in use keep going back to it. Must be run from the event
+ * loop thread. */
+void nub__slab_cache_orphan(nub_loop_t* loop, nub__slab_cache_t* cache);
+
+#endif  /* LIBNUB_SLAB_H_ */
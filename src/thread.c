@@ -1,57 +1,738 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE  /* CPU_SET, sched_setaffinity */
+#endif
+
 #include "nub.h"
 #include "fuq.h"
+#include "atomic-ops.h"
+#include "handshake.h"
+#include "internal.h"
+#include "mpscq.h"
+#include "slab.h"
+#include "trace.h"
 #include "util.h"
+#include "wheel.h"
 #include "uv.h"
 
 #include <stdlib.h>  /* malloc, free */
+#include <string.h>  /* memset */
+
+#ifdef _WIN32
+# include <windows.h>  /* SwitchToThread, GetThreadTimes, SetThreadPriority,
+                          SetThreadAffinityMask */
+#else
+# include <errno.h>  /* errno */
+# include <pthread.h>  /* pthread_setschedparam */
+# include <sched.h>  /* sched_yield, sched_setaffinity */
+# include <time.h>  /* clock_gettime */
+# if defined(__APPLE__)
+#  include <mach/mach.h>  /* thread_info */
+# elif defined(__linux__)
+#  include <sys/prctl.h>  /* prctl */
+#  include <sys/resource.h>  /* setpriority */
+#  include <sys/syscall.h>  /* SYS_gettid */
+#  include <unistd.h>  /* syscall */
+# elif defined(__FreeBSD__) || defined(__OpenBSD__)
+#  include <pthread_np.h>  /* pthread_set_name_np */
+# endif
+#endif
+
+/* Number of times to check for work between reading the clock. */
+#define NUB__SPIN_CHECKS 64
+
+/* Nice value per step of nub_thread_priority on Linux. */
+#define NUB__NICE_STEP 5
 
+/* Values of nub_thread_t::water_state_. */
+enum {
+  NUB__WATER_BELOW = 0,
+  NUB__WATER_ABOVE,
+  /* The thread saw the queue drain and water_work_ is on its way to the
+   * event loop. */
+  NUB__WATER_DRAINED
+};
 
+
+/* Lives on the creating thread's stack until the new thread has applied its
+ * options. */
+struct nub__thread_start_s {
+  const nub_thread_options_t* options;
+  uv_sem_t started;
+  int status;
+};
+
+
+/* Runs from the event loop thread. */
 static void nub__free_handle_cb(uv_handle_t* handle) {
-  free(handle);
+  nub__slab_free(&((nub_loop_t*) handle->loop)->slab_cache_, handle);
 }
 
 
+/* Only there to wake the loop. The queue_processor_ picks up the work before
+ * the loop polls again. */
 static void nub__work_signal_cb(uv_async_t* handle) {
-  nub_loop_t* loop;
-  nub_thread_t* thread;
+}
+
+
+void nub__thread_yield(void) {
+#ifdef _WIN32
+  SwitchToThread();
+#else
+  sched_yield();
+#endif
+}
+
+
+static int nub__thread_has_incoming(nub_thread_t* thread) {
+  int prio;
+
+  for (prio = 0; prio < NUB__PRIOS; prio++) {
+    if (!fuq_empty(&thread->incoming_[prio]))
+      return 1;
+  }
+  return 0;
+}
+
+
+/* Items from nub_thread_enqueue*() the thread hasn't taken yet. */
+static unsigned int nub__thread_queued(nub_thread_t* thread) {
+  return thread->put_ - thread->taken_;
+}
+
+
+/* Runs from whoever enqueues for the thread, right after it enqueued. */
+static void nub__water_rise(nub_thread_t* thread) {
+  if (NUB__WATER_BELOW != thread->water_state_ ||
+      nub__thread_queued(thread) < thread->high_water_) {
+    return;
+  }
+
+  nub__xchgi(&thread->water_state_, NUB__WATER_ABOVE);
+  thread->water_cb_(thread, 1);
+
+  /* The thread may have drained the queue before it could see the state
+   * change. Either side that swaps it back reports the drain. */
+  if (nub__thread_queued(thread) <= thread->low_water_ &&
+      NUB__WATER_ABOVE == nub__cmpxchgi(&thread->water_state_,
+                                        NUB__WATER_ABOVE,
+                                        NUB__WATER_BELOW)) {
+    thread->water_cb_(thread, 0);
+  }
+}
+
+
+/* Runs from the thread after taking work off incoming_. */
+static void nub__water_fall(nub_thread_t* thread) {
+  nub_work_t* work;
+
+  if (nub__thread_queued(thread) > thread->low_water_)
+    return;
+  if (NUB__WATER_ABOVE != nub__cmpxchgi(&thread->water_state_,
+                                        NUB__WATER_ABOVE,
+                                        NUB__WATER_DRAINED)) {
+    return;
+  }
+
+  work = &thread->water_work_;
+  work->thread = thread;
+  work->prio = NUB_PRIO_HIGH;
+  work->work_type = NUB_LOOP_QUEUE_WATER;
+  nub__thread_push(thread, work);
+}
+
+
+void nub__thread_water_low(nub_thread_t* thread) {
+  thread->water_work_.thread = NULL;
+  thread->water_work_.work_type = NUB_LOOP_QUEUE_NONE;
+  thread->water_state_ = NUB__WATER_BELOW;
+  thread->water_cb_(thread, 0);
+  /* Enqueues made while the call was on its way didn't report. */
+  nub__water_rise(thread);
+}
+
+
+void nub__thread_run(nub_thread_t* thread, nub_work_t* work) {
+  if (0 == work->deadline || uv_hrtime() < work->deadline) {
+    (work->cb)(thread, work, work->arg);
+    return;
+  }
+
+  thread->stats_.expired++;
+  if (NULL != work->expired_cb)
+    (work->expired_cb)(work, UV_ETIMEDOUT);
+}
+
+
+/* Pick the next item from the incoming_ queues. The highest class with work
+ * wins unless a lower class has been passed over NUB__PRIO_AGE times, in
+ * which case the lowest such class goes first. Returns NULL if all are
+ * empty. */
+static nub_work_t* nub__thread_next(nub_thread_t* thread) {
+  int prio;
+  int pick;
+
+  pick = -1;
+  for (prio = 0; prio < NUB__PRIOS; prio++) {
+    if (fuq_empty(&thread->incoming_[prio]))
+      continue;
+    if (-1 == pick || NUB__PRIO_AGE <= thread->passed_over_[prio])
+      pick = prio;
+  }
+
+  if (-1 == pick)
+    return NULL;
+
+  thread->passed_over_[pick] = 0;
+  for (prio = pick + 1; prio < NUB__PRIOS; prio++) {
+    if (!fuq_empty(&thread->incoming_[prio]))
+      thread->passed_over_[prio]++;
+  }
+
+  return (nub_work_t*) fuq_dequeue(&thread->incoming_[pick]);
+}
+
+
+static int nub__thread_has_work(nub_thread_t* thread) {
+  if (nub__thread_has_incoming(thread) || 0 < thread->disposed)
+    return 1;
+  if (!nub__mpscq_empty(&thread->inbox_) ||
+      !nub__mpscq_empty(&thread->granted_)) {
+    return 1;
+  }
+  return NULL != thread->pool_ && nub__pool_has_work(thread);
+}
+
+
+/* Keep looking for work for spin_ns_ before parking. Returns 1 if work showed
+ * up in the meantime. */
+static int nub__thread_spin(nub_thread_t* thread) {
+  uint64_t start;
+  uint64_t elapsed;
+  int i;
+
+  if (0 == thread->spin_ns_)
+    return 0;
+
+  start = uv_hrtime();
+
+  for (;;) {
+    for (i = 0; i < NUB__SPIN_CHECKS; i++) {
+      if (nub__thread_has_work(thread))
+        return 1;
+      nub__cpu_relax();
+    }
+    elapsed = uv_hrtime() - start;
+    if (elapsed >= thread->spin_ns_)
+      return 0;
+    if (elapsed >= thread->spin_ns_ / 2)
+      nub__thread_yield();
+  }
+}
+
+
+/* Hand the parked thread one wake. */
+static void nub__park_post(nub_thread_t* thread) {
+  uv_mutex_lock(&thread->park_lock_);
+  thread->park_posts_++;
+  uv_cond_signal(&thread->park_cond_);
+  uv_mutex_unlock(&thread->park_lock_);
+}
+
+
+/* Take one wake, waiting up to timeout nanoseconds for it, or for good if
+ * timeout is 0. Returns 0 if a wake was taken, or UV_ETIMEDOUT. */
+static int nub__park_wait(nub_thread_t* thread, uint64_t timeout) {
+  uint64_t deadline;
+  uint64_t now;
+  int r;
+
+  r = 0;
+  deadline = uv_hrtime() + timeout;
+  uv_mutex_lock(&thread->park_lock_);
+  while (0 == thread->park_posts_) {
+    if (0 == timeout) {
+      uv_cond_wait(&thread->park_cond_, &thread->park_lock_);
+      continue;
+    }
+    now = uv_hrtime();
+    if (now >= deadline) {
+      r = UV_ETIMEDOUT;
+      break;
+    }
+    uv_cond_timedwait(&thread->park_cond_,
+                      &thread->park_lock_,
+                      deadline - now);
+  }
+  if (0 == r)
+    thread->park_posts_--;
+  uv_mutex_unlock(&thread->park_lock_);
+  return r;
+}
+
+
+/* A spawned thread's own uv_loop_t, from NUB_THREAD_OWN_LOOP. */
+struct nub__own_loop_s {
+  uv_loop_t uvloop;
+  uv_async_t wake;  /* Sent in place of nub__park_post() */
+  uv_timer_t wheel;  /* Ends a park in time for the wheel's next due tick */
+};
+
+
+static void nub__own_loop_wake_cb(uv_async_t* handle) {
+}
+
+
+static void nub__own_loop_wheel_cb(uv_timer_t* handle) {
+}
+
+
+static int nub__own_loop_init(nub_thread_t* thread) {
+  struct nub__own_loop_s* own;
+  int er;
+
+  own = (struct nub__own_loop_s*) malloc(sizeof(*own));
+  if (NULL == own)
+    return UV_ENOMEM;
+
+  er = uv_loop_init(&own->uvloop);
+  if (0 != er) {
+    free(own);
+    return er;
+  }
+  CHECK_EQ(0, uv_async_init(&own->uvloop, &own->wake, nub__own_loop_wake_cb));
+  CHECK_EQ(0, uv_timer_init(&own->uvloop, &own->wheel));
+  own->uvloop.data = thread;
+
+  thread->own_loop_ = own;
+  thread->uvloop = &own->uvloop;
+  return 0;
+}
+
+
+/* Must be run from the thread, or from whoever created it if it never ran.
+ * The memory stays around for nub_thread_join(). */
+static void nub__own_loop_close(nub_thread_t* thread) {
+  struct nub__own_loop_s* own;
+
+  own = thread->own_loop_;
+  uv_close((uv_handle_t*) &own->wake, NULL);
+  uv_close((uv_handle_t*) &own->wheel, NULL);
+  CHECK_EQ(0, uv_run(&own->uvloop, UV_RUN_NOWAIT));
+  CHECK_NE(UV_EBUSY, uv_loop_close(&own->uvloop));
+}
+
+
+static void nub__own_loop_free(nub_thread_t* thread) {
+  free(thread->own_loop_);
+  thread->own_loop_ = NULL;
+  thread->uvloop = NULL;
+}
+
+
+/* Sleep in the own loop, which runs the callbacks of its handles until either
+ * one of them or a wake ends the iteration. Unlike park_posts_ there's no count
+ * to keep right, as an extra wake only costs one more trip around the loop. */
+static void nub__own_loop_park(nub_thread_t* thread, uint64_t timeout) {
+  struct nub__own_loop_s* own;
+
+  own = thread->own_loop_;
+  if (0 != timeout) {
+    uv_update_time(&own->uvloop);
+    CHECK_EQ(0, uv_timer_start(&own->wheel,
+                               nub__own_loop_wheel_cb,
+                               (timeout + 999999) / 1000000,
+                               0));
+  }
+  uv_run(&own->uvloop, UV_RUN_ONCE);
+  if (0 != timeout)
+    CHECK_EQ(0, uv_timer_stop(&own->wheel));
+  nub__xchgi(&thread->parked_, 0);
+}
+
+
+/* Sleep until woken, or until the next timer is due if there is one. */
+static void nub__thread_park(nub_thread_t* thread) {
+  uint64_t timeout;
+
+  timeout = 0;
+  if (0 != thread->wheel_.count_) {
+    timeout = nub__wheel_timeout(&thread->wheel_);
+    if (0 == timeout)
+      return;
+  }
+
+  nub__xchgi(&thread->parked_, 1);
+
+  /* Work may have been enqueued after the last check, but before the flag was
+   * visible, in which case the producer didn't post. The same goes for
+   * nub_thread_join() when there's an own loop to wake. */
+  if (nub__thread_has_work(thread) || 0 < thread->disposed) {
+    /* If a producer already swapped the flag its post will cause one extra
+     * trip around the loop. */
+    nub__xchgi(&thread->parked_, 0);
+    return;
+  }
+
+  thread->stats_.parks++;
+  NUB__TRACE(thread->trace_, NUB__TRACE_PARK, 0);
+  if (NULL != thread->own_loop_) {
+    nub__own_loop_park(thread, timeout);
+  } else if (0 != nub__park_wait(thread, timeout)) {
+    /* Whoever swapped the flag back has posted or is about to, and that post
+     * has to be taken to keep the count right. */
+    if (0 == nub__xchgi(&thread->parked_, 0))
+      nub__park_wait(thread, 0);
+  }
+  NUB__TRACE(thread->trace_, NUB__TRACE_WAKE, 0);
+  thread->parked_ = 0;
+}
+
+
+int nub__thread_wake(nub_thread_t* thread) {
+  /* Order the read below after the caller's push. */
+  nub__barrier();
+  if (0 == thread->parked_ || 0 == nub__xchgi(&thread->parked_, 0))
+    return 0;
+  if (NULL != thread->own_loop_)
+    CHECK_EQ(0, uv_async_send(&thread->own_loop_->wake));
+  else
+    nub__park_post(thread);
+  return 1;
+}
+
+
+/* CPU time used by a thread that hasn't been joined yet. */
+static uint64_t nub__thread_cpu(uv_thread_t tid) {
+#if defined(_WIN32)
+  FILETIME created;
+  FILETIME exited;
+  FILETIME kernel;
+  FILETIME user;
+  ULARGE_INTEGER k;
+  ULARGE_INTEGER u;
+
+  if (!GetThreadTimes(tid, &created, &exited, &kernel, &user))
+    return 0;
+  k.LowPart = kernel.dwLowDateTime;
+  k.HighPart = kernel.dwHighDateTime;
+  u.LowPart = user.dwLowDateTime;
+  u.HighPart = user.dwHighDateTime;
+  /* In 100ns units. */
+  return (k.QuadPart + u.QuadPart) * 100;
+#elif defined(__APPLE__)
+  thread_basic_info_data_t info;
+  mach_msg_type_number_t count;
+
+  count = THREAD_BASIC_INFO_COUNT;
+  if (KERN_SUCCESS != thread_info(pthread_mach_thread_np(tid),
+                                  THREAD_BASIC_INFO,
+                                  (thread_info_t) &info,
+                                  &count)) {
+    return 0;
+  }
+  return ((uint64_t) info.user_time.seconds + info.system_time.seconds) *
+         1000000000 +
+         ((uint64_t) info.user_time.microseconds +
+          info.system_time.microseconds) * 1000;
+#else
+  struct timespec ts;
+  clockid_t clock;
+
+  if (0 != pthread_getcpuclockid(tid, &clock))
+    return 0;
+  if (0 != clock_gettime(clock, &ts))
+    return 0;
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+
+static int nub__thread_set_affinity(const char* mask, size_t size) {
+#if defined(_WIN32)
+  DWORD_PTR bits;
+  size_t i;
+
+  bits = 0;
+  for (i = 0; i < size && i < sizeof(bits) * 8; i++) {
+    if (0 != mask[i])
+      bits |= (DWORD_PTR) 1 << i;
+  }
+  if (0 == bits || 0 == SetThreadAffinityMask(GetCurrentThread(), bits))
+    return UV_EINVAL;
+  return 0;
+#elif defined(__linux__)
+  cpu_set_t set;
+  size_t i;
+
+  CPU_ZERO(&set);
+  for (i = 0; i < size && i < CPU_SETSIZE; i++) {
+    if (0 != mask[i])
+      CPU_SET(i, &set);
+  }
+  if (0 == CPU_COUNT(&set))
+    return UV_EINVAL;
+  /* 0 is the calling thread. */
+  if (0 != sched_setaffinity(0, sizeof(set), &set))
+    return NUB__ERR(errno);
+  return 0;
+#else
+  return UV_ENOTSUP;
+#endif
+}
+
+
+static int nub__thread_set_name(const char* name) {
+#if defined(__linux__)
+  char buf[16];
+
+  /* The kernel rejects anything longer than its limit, so cut it down. */
+  strncpy(buf, name, sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = '\0';
+  if (0 != prctl(PR_SET_NAME, (unsigned long) buf, 0, 0, 0))
+    return NUB__ERR(errno);
+  return 0;
+#elif defined(__APPLE__)
+  return NUB__ERR(pthread_setname_np(name));
+#elif defined(__FreeBSD__) || defined(__OpenBSD__)
+  pthread_set_name_np(pthread_self(), name);
+  return 0;
+#else
+  return 0;
+#endif
+}
+
+
+static int nub__thread_set_priority(nub_thread_priority priority) {
+#if defined(__linux__)
+  id_t tid;
+  int nice;
+#endif
+
+  /* Leave the thread where it started. */
+  if (NUB_THREAD_PRIORITY_NORMAL == priority)
+    return 0;
+
+#if defined(_WIN32)
+  if (!SetThreadPriority(GetCurrentThread(), priority))
+    return UV_EINVAL;
+  return 0;
+#elif defined(__linux__)
+  /* Regular threads all share static priority 0, and are scheduled by their
+   * nice value instead, which Linux keeps per thread. It's moved relative to
+   * what the thread started with, so a process that's already niced can still
+   * go lower. Lowering the nice value without privileges fails with EACCES
+   * rather than EPERM. */
+  tid = (id_t) syscall(SYS_gettid);
+  errno = 0;
+  nice = getpriority(PRIO_PROCESS, tid);
+  if (-1 == nice && 0 != errno)
+    return NUB__ERR(errno);
+  nice -= NUB__NICE_STEP * priority;
+  if (nice < -20)
+    nice = -20;
+  if (nice > 19)
+    nice = 19;
+  if (0 != setpriority(PRIO_PROCESS, tid, nice))
+    return EACCES == errno ? UV_EPERM : NUB__ERR(errno);
+  return 0;
+#else
+  struct sched_param param;
+  int policy;
+  int min;
+  int max;
+  int er;
+
+  er = pthread_getschedparam(pthread_self(), &policy, &param);
+  if (0 != er)
+    return NUB__ERR(er);
+  min = sched_get_priority_min(policy);
+  max = sched_get_priority_max(policy);
+  if (-1 == min || -1 == max)
+    return UV_ENOTSUP;
+  param.sched_priority = min + (max - min) * (priority + 2) / 4;
+  return NUB__ERR(pthread_setschedparam(pthread_self(), policy, &param));
+#endif
+}
+
 
-  loop = ((nub_thread_t*) handle->data)->nubloop;
-  while (!fuq_empty(&loop->blocking_queue_)) {
-    thread = (nub_thread_t*) fuq_dequeue(&loop->blocking_queue_);
-    uv_sem_post(&thread->thread_lock_sem_);
-    uv_sem_wait(&loop->loop_lock_sem_);
+/* Run from the new thread before it takes any work. */
+static int nub__thread_apply(const nub_thread_options_t* options) {
+  int er;
+
+  if (0 != (options->flags & NUB_THREAD_HAS_AFFINITY)) {
+    er = nub__thread_set_affinity(options->cpumask, options->cpumask_size);
+    if (0 != er)
+      return er;
+  }
+
+  if (0 != (options->flags & NUB_THREAD_HAS_NAME)) {
+    er = nub__thread_set_name(options->name);
+    if (0 != er)
+      return er;
+  }
+
+  if (0 != (options->flags & NUB_THREAD_HAS_PRIORITY))
+    return nub__thread_set_priority(options->priority);
+
+  return 0;
+}
+
+
+/* Switch to the fibers the loop has been halted for. Returns how many ran. */
+static uint64_t nub__thread_run_granted(nub_thread_t* thread) {
+  nub_work_t* item;
+  uint64_t n;
+
+  for (n = 0; NULL != (item = nub__mpscq_shift(&thread->granted_)); n++) {
+    NUB__TRACE(thread->trace_, NUB__TRACE_DEQUEUE, item->work_type);
+    nub__thread_run(thread, item);
   }
+
+  return n;
 }
 
 
 static void nub__thread_entry_cb(void* arg) {
   nub_thread_t* thread;
-  fuq_queue_t* queue;
   nub_work_t* item;
+  uint64_t granted;
+  uint64_t n;
+  int prio;
+  int er;
 
   thread = (nub_thread_t*) arg;
-  queue = &thread->incoming_;
+
+  if (NULL != thread->start_) {
+    er = nub__thread_apply(thread->start_->options);
+    thread->start_->status = er;
+    /* start_ is gone once posted. */
+    uv_sem_post(&thread->start_->started);
+    if (0 != er)
+      return;
+  }
 
   for (;;) {
-    while (!fuq_empty(queue)) {
-      item = (nub_work_t*) fuq_dequeue(queue);
-      (item->cb)(thread, item, item->arg);
+    granted = 0;
+    for (n = 0; ; n++) {
+      /* Anything else run first would keep the loop halted for longer, and
+       * could be waiting on the loop itself. */
+      granted += nub__thread_run_granted(thread);
+      item = nub__thread_next(thread);
+      if (NULL == item)
+        break;
+      NUB__TRACE(thread->trace_, NUB__TRACE_DEQUEUE, item->work_type);
+      if (NUB_LOOP_QUEUE_COMPLETE == item->work_type) {
+        /* Returned from the event loop. Reset so it can be enqueued again
+         * from within the completion callback. */
+        item->work_type = NUB_LOOP_QUEUE_NONE;
+        item->thread = NULL;
+        (item->complete_cb)(item, item->status);
+      } else {
+        thread->taken_++;
+        if (NUB__WATER_ABOVE == thread->water_state_)
+          nub__water_fall(thread);
+        nub__thread_run(thread, item);
+      }
     }
+    if (n > thread->stats_.incoming_max)
+      thread->stats_.incoming_max = n;
+    /* Pairs with the barrier in nub__water_rise(), so a drain the loop
+     * didn't see is seen here. */
+    if (NULL != thread->water_cb_) {
+      nub__barrier();
+      if (NUB__WATER_ABOVE == thread->water_state_)
+        nub__water_fall(thread);
+    }
+    for (;; n++) {
+      granted += nub__thread_run_granted(thread);
+      item = nub__mpscq_shift(&thread->inbox_);
+      if (NULL == item)
+        break;
+      NUB__TRACE(thread->trace_, NUB__TRACE_DEQUEUE, item->work_type);
+      nub__thread_run(thread, item);
+    }
+    n += granted;
+    if (0 != thread->wheel_.count_)
+      n += nub__wheel_run(thread);
+    thread->stats_.processed += n;
+    /* Otherwise it's run by parking. */
+    if (NULL != thread->own_loop_ && 0 < n)
+      uv_run(&thread->own_loop_->uvloop, UV_RUN_NOWAIT);
+    if (nub__thread_has_incoming(thread))
+      continue;
+    if (NULL != thread->pool_ && 0 < nub__pool_work(thread))
+      continue;
     if (0 < thread->disposed)
       break;
-    uv_sem_wait(&thread->sem_wait_);
+    if (nub__thread_spin(thread))
+      continue;
+    nub__thread_park(thread);
   }
 
-  ASSERT(1 == fuq_empty(queue));
-  fuq_dispose(&thread->incoming_);
+  ASSERT(0 == nub__thread_has_incoming(thread));
+  ASSERT(1 == nub__mpscq_empty(&thread->inbox_));
+  ASSERT(1 == nub__mpscq_empty(&thread->granted_));
+  for (prio = 0; prio < NUB__PRIOS; prio++)
+    fuq_dispose(&thread->incoming_[prio]);
+
+  nub__fiber_host_free(thread);
+  if (NULL != thread->own_loop_)
+    nub__own_loop_close(thread);
+
+  thread->stats_.cpu_ns = nub__thread_cpu(uv_thread_self());
+  nub__barrier();
+  thread->exited_ = 1;
 }
 
 
 int nub_thread_create(nub_loop_t* loop, nub_thread_t* thread) {
+  return nub__thread_create(loop, thread, NULL, NULL);
+}
+
+
+int nub_thread_create_ex(nub_loop_t* loop,
+                         nub_thread_t* thread,
+                         const nub_thread_options_t* options) {
+  return nub__thread_create(loop, thread, NULL, options);
+}
+
+
+/* Undo nub__thread_create() for a thread that never ran any work. */
+static void nub__thread_abort(nub_thread_t* thread) {
+  int prio;
+
+  for (prio = 0; prio < NUB__PRIOS; prio++) {
+    fuq_dispose(&thread->incoming_[prio]);
+    fuq_dispose(&thread->outgoing_[prio]);
+  }
+  uv_close((uv_handle_t*) thread->async_signal_, nub__free_handle_cb);
+  nub__handshake_destroy(&thread->thread_lock_hs_);
+  uv_cond_destroy(&thread->park_cond_);
+  uv_mutex_destroy(&thread->park_lock_);
+  if (NULL != thread->own_loop_) {
+    nub__own_loop_close(thread);
+    nub__own_loop_free(thread);
+  }
+  nub__slab_cache_orphan(thread->nubloop, thread->slab_cache_);
+  thread->slab_cache_ = NULL;
+  --thread->nubloop->ref_;
+  thread->nubloop = NULL;
+}
+
+
+int nub__thread_create(nub_loop_t* loop,
+                       nub_thread_t* thread,
+                       nub_pool_t* pool,
+                       const nub_thread_options_t* options) {
+  struct nub__thread_start_s start;
+  uv_thread_options_t uvoptions;
   uv_async_t* async_handle;
+  int prio;
   int er;
 
-  async_handle = (uv_async_t*) malloc(sizeof(*async_handle));
+  async_handle = (uv_async_t*) nub__slab_alloc(loop,
+                                               &loop->slab_cache_,
+                                               NUB__SLAB_ASYNC);
   CHECK_NE(NULL, async_handle);
   er = uv_async_init(&loop->uvloop, async_handle, nub__work_signal_cb);
   ASSERT(0 == er);
@@ -60,49 +741,330 @@ int nub_thread_create(nub_loop_t* loop, nub_thread_t* thread) {
 
   ASSERT(uv_loop_alive(&loop->uvloop));
 
-  er = uv_sem_init(&thread->thread_lock_sem_, 0);
+  er = nub__handshake_init(&thread->thread_lock_hs_);
   ASSERT(0 == er);
 
-  er = uv_sem_init(&thread->sem_wait_, 1);
+  er = uv_mutex_init(&thread->park_lock_);
+  ASSERT(0 == er);
+  er = uv_cond_init(&thread->park_cond_);
   ASSERT(0 == er);
+  thread->park_posts_ = 1;
 
-  fuq_init(&thread->incoming_);
+  for (prio = 0; prio < NUB__PRIOS; prio++) {
+    fuq_init(&thread->incoming_[prio]);
+    fuq_init(&thread->outgoing_[prio]);
+    thread->passed_over_[prio] = 0;
+  }
+  nub__mpscq_init(&thread->inbox_);
+  nub__mpscq_init(&thread->granted_);
+  thread->outgoing_signaled_ = 0;
+  thread->next_ready_ = NULL;
+  thread->next_drain_ = NULL;
   thread->disposed = 0;
   thread->nubloop = loop;
   thread->disposed_cb_ = NULL;
+  thread->parked_ = 0;
+  thread->lock_state_ = NUB__LOCK_IDLE;
+  thread->spin_ns_ = loop->thread_spin_ns_;
+  nub__wheel_init(&thread->wheel_);
+  thread->wake_pending_ = 0;
+  thread->pool_ = pool;
+  thread->capacity_ = 0;
+  thread->high_water_ = 0;
+  thread->low_water_ = 0;
+  thread->water_cb_ = NULL;
+  thread->put_ = 0;
+  thread->taken_ = 0;
+  thread->water_state_ = NUB__WATER_BELOW;
+  nub_work_init(&thread->water_work_, NULL, NULL);
+  memset(&thread->stats_, 0, sizeof(thread->stats_));
+  thread->lock_since_ = 0;
+  thread->exited_ = 0;
+  thread->trace_ = nub__trace_new(loop);
+  thread->slab_cache_ = nub__slab_cache_new(loop);
+  thread->fiber_host_ = NULL;
+  thread->own_loop_ = NULL;
+  thread->uvloop = NULL;
+  thread->start_ = NULL;
   thread->work.thread = thread;
   thread->work.work_type = NUB_LOOP_QUEUE_NONE;
   ++loop->ref_;
 
-  return uv_thread_create(&thread->uvthread, nub__thread_entry_cb, thread);
+  uvoptions.flags = UV_THREAD_NO_FLAGS;
+  if (NULL != options && 0 != (options->flags & NUB_THREAD_HAS_STACK_SIZE)) {
+    uvoptions.flags |= UV_THREAD_HAS_STACK_SIZE;
+    uvoptions.stack_size = options->stack_size;
+  }
+
+  if (NULL != options && 0 != (options->flags & NUB_THREAD_OWN_LOOP)) {
+    er = nub__own_loop_init(thread);
+    if (0 != er) {
+      nub__thread_abort(thread);
+      return er;
+    }
+  }
+
+  /* Only wait for the thread if it has something to report back. */
+  if (NULL != options &&
+      0 != (options->flags &
+            ~(NUB_THREAD_HAS_STACK_SIZE | NUB_THREAD_OWN_LOOP))) {
+    start.options = options;
+    start.status = 0;
+    er = uv_sem_init(&start.started, 0);
+    ASSERT(0 == er);
+    thread->start_ = &start;
+  }
+
+  er = uv_thread_create_ex(&thread->uvthread,
+                           &uvoptions,
+                           nub__thread_entry_cb,
+                           thread);
+
+  if (NULL != thread->start_) {
+    if (0 == er) {
+      uv_sem_wait(&start.started);
+      er = start.status;
+      if (0 != er)
+        uv_thread_join(&thread->uvthread);
+    }
+    uv_sem_destroy(&start.started);
+    thread->start_ = NULL;
+  }
+
+  if (0 != er)
+    nub__thread_abort(thread);
+
+  return er;
 }
 
 
 void nub_thread_dispose(nub_thread_t* thread, nub_thread_disposed_cb cb) {
   thread->disposed = 1;
   thread->disposed_cb_ = cb;
-  thread->nubloop->disposed_ = 1;
-  uv_mutex_lock(&thread->nubloop->thread_dispose_lock_);
-  fuq_enqueue(&thread->nubloop->thread_dispose_queue_, thread);
-  uv_mutex_unlock(&thread->nubloop->thread_dispose_lock_);
-  uv_async_send(thread->nubloop->work_ping_);
+  /* thread->work is also the lock request, which may still be in the
+   * lock_queue_ after a nub_loop_lock_timeout() gave up. */
+  while (NUB__LOCK_CANCELLED == thread->lock_state_)
+    nub__thread_yield();
+  /* Goes through the same queue as all other requests so the thread is only
+   * joined after everything it pushed before has been processed. */
+  thread->work.work_type = NUB_LOOP_QUEUE_DISPOSE;
+  thread->work.prio = NUB_PRIO_LOW;
+  nub__thread_push(thread, &thread->work);
 }
 
 
 void nub_thread_join(nub_thread_t* thread) {
+  int prio;
+
   ASSERT(NULL != thread);
+  /* Can't be left in the wake_queue_ once joined. */
+  if (0 != thread->wake_pending_)
+    nub__flush_wake_queue(thread->nubloop);
   thread->disposed = 1;
-  uv_sem_post(&thread->sem_wait_);
+  /* The own loop is closed once the thread leaves, so it's only woken while
+   * it's parked. */
+  if (NULL != thread->own_loop_)
+    nub__thread_wake(thread);
+  else
+    nub__park_post(thread);
   uv_thread_join(&thread->uvthread);
+  if (NULL != thread->own_loop_)
+    nub__own_loop_free(thread);
+  if (NUB__LOCK_CANCELLED == thread->lock_state_)
+    nub__lock_remove(thread->nubloop, thread);
+  /* Pushing the dispose request can put the thread back on the stack after
+   * the event loop has already taken it. */
+  if (0 != thread->outgoing_signaled_)
+    nub__ready_remove(thread->nubloop, thread);
+  for (prio = 0; prio < NUB__PRIOS; prio++) {
+    ASSERT(1 == fuq_empty(&thread->outgoing_[prio]));
+    fuq_dispose(&thread->outgoing_[prio]);
+  }
   uv_close((uv_handle_t*) thread->async_signal_, nub__free_handle_cb);
-  uv_sem_destroy(&thread->thread_lock_sem_);
-  uv_sem_destroy(&thread->sem_wait_);
+  nub__handshake_destroy(&thread->thread_lock_hs_);
+  uv_cond_destroy(&thread->park_cond_);
+  uv_mutex_destroy(&thread->park_lock_);
+  nub__slab_cache_orphan(thread->nubloop, thread->slab_cache_);
+  thread->slab_cache_ = NULL;
   --thread->nubloop->ref_;
   thread->nubloop = NULL;
 }
 
 
-void nub_thread_enqueue(nub_thread_t* thread, nub_work_t* work) {
-  fuq_enqueue(&thread->incoming_, (void*) work);
-  uv_sem_post(&thread->sem_wait_);
+void nub__thread_detach(nub_loop_t* loop, nub_thread_t* thread) {
+  /* Same as for a join, the thread can't be left in either queue. */
+  if (0 != thread->wake_pending_)
+    nub__flush_wake_queue(loop);
+  if (0 != thread->outgoing_signaled_) {
+    nub__ready_remove(loop, thread);
+    thread->outgoing_signaled_ = 0;
+  }
+  uv_close((uv_handle_t*) thread->async_signal_, nub__free_handle_cb);
+  thread->async_signal_ = NULL;
+  nub__slab_cache_orphan(loop, thread->slab_cache_);
+  thread->slab_cache_ = NULL;
+  --loop->ref_;
+}
+
+
+void nub__thread_attach(nub_loop_t* loop, nub_thread_t* thread) {
+  uv_async_t* async_handle;
+
+  async_handle = (uv_async_t*) nub__slab_alloc(loop,
+                                               &loop->slab_cache_,
+                                               NUB__SLAB_ASYNC);
+  CHECK_NE(NULL, async_handle);
+  CHECK_EQ(0, uv_async_init(&loop->uvloop, async_handle, nub__work_signal_cb));
+  async_handle->data = thread;
+  thread->async_signal_ = async_handle;
+  thread->slab_cache_ = nub__slab_cache_new(loop);
+  thread->nubloop = loop;
+  ++loop->ref_;
+}
+
+
+int nub_thread_migrate(nub_thread_t* thread, nub_loop_t* to) {
+  nub_loop_t* from;
+  int er;
+
+  /* The pool's queues and bookkeeping all live on the loop it was created
+   * on. */
+  if (NULL != thread->pool_)
+    return UV_EINVAL;
+
+  from = thread->nubloop;
+  if (to == from)
+    return 0;
+
+  /* thread->work is also the lock request, same as in nub_thread_dispose(). */
+  while (NUB__LOCK_CANCELLED == thread->lock_state_)
+    nub__thread_yield();
+
+  /* Goes through the same queue as all other requests so the old loop has
+   * processed everything pushed before it lets go of the thread. */
+  thread->work.work_type = NUB_LOOP_QUEUE_MIGRATE;
+  thread->work.prio = NUB_PRIO_LOW;
+  er = nub__thread_push(thread, &thread->work);
+  nub__handshake_wait(&thread->thread_lock_hs_, from->lock_spin_ns_);
+
+  /* Detached. Nothing can be pushed until the new loop has set up the
+   * signal. */
+  thread->nubloop = to;
+  if (nub__mpscq_push(&to->attach_queue_, &thread->work))
+    CHECK_EQ(0, uv_async_send(&to->attach_signal_));
+  nub__handshake_wait(&thread->thread_lock_hs_, to->lock_spin_ns_);
+
+  thread->work.work_type = NUB_LOOP_QUEUE_NONE;
+  thread->stats_.migrations++;
+  return er;
+}
+
+
+static void nub__thread_signal(nub_thread_t* thread) {
+  nub_loop_t* loop;
+
+  loop = thread->nubloop;
+  if (0 != loop->defer_wake_)
+    nub__defer_wake(loop, thread);
+  else if (nub__thread_wake(thread))
+    loop->stats_.wakes++;
+  else
+    loop->stats_.wakes_coalesced++;
+}
+
+
+void nub_thread_limit(nub_thread_t* thread,
+                      unsigned int capacity,
+                      unsigned int high_water,
+                      unsigned int low_water,
+                      nub_thread_water_cb cb) {
+  ASSERT(NULL == cb || low_water < high_water);
+  thread->capacity_ = capacity;
+  thread->high_water_ = high_water;
+  thread->low_water_ = low_water;
+  thread->water_cb_ = cb;
+}
+
+
+int nub_thread_enqueue(nub_thread_t* thread, nub_work_t* work) {
+  return nub_thread_enqueue_prio(thread, work, NUB_PRIO_NORMAL);
+}
+
+
+int nub_thread_enqueue_prio(nub_thread_t* thread,
+                            nub_work_t* work,
+                            nub_prio prio) {
+  ASSERT((unsigned int) prio < NUB__PRIOS);
+
+  if (0 != thread->capacity_ &&
+      nub__thread_queued(thread) >= thread->capacity_) {
+    thread->stats_.rejected++;
+    return UV_EAGAIN;
+  }
+
+  fuq_enqueue(&thread->incoming_[prio], (void*) work);
+  thread->put_++;
+  thread->stats_.enqueued++;
+  NUB__TRACE(thread->nubloop->trace_,
+             NUB__TRACE_ENQUEUE,
+             nub__trace_id(thread->trace_));
+  nub__thread_signal(thread);
+
+  if (NULL != thread->water_cb_)
+    nub__water_rise(thread);
+
+  return 0;
+}
+
+
+void nub_thread_send(nub_thread_t* from,
+                     nub_thread_t* to,
+                     nub_work_t* work) {
+  ASSERT(NULL != from);
+  ASSERT(from->nubloop == to->nubloop);
+
+  nub__mpscq_push(&to->inbox_, work);
+  nub__thread_wake(to);
+  from->stats_.sent++;
+  NUB__TRACE(from->trace_, NUB__TRACE_ENQUEUE, nub__trace_id(to->trace_));
+}
+
+
+int nub_thread_enqueue_batch(nub_thread_t* thread,
+                             nub_work_t** works,
+                             unsigned int n) {
+  unsigned int queued;
+  unsigned int i;
+
+  if (0 == n)
+    return 0;
+
+  if (0 != thread->capacity_) {
+    queued = nub__thread_queued(thread);
+    if (queued >= thread->capacity_ || n > thread->capacity_ - queued) {
+      thread->stats_.rejected += n;
+      return UV_EAGAIN;
+    }
+  }
+
+  for (i = 0; i < n; i++)
+    fuq_enqueue(&thread->incoming_[NUB_PRIO_NORMAL], (void*) works[i]);
+  thread->put_ += n;
+  thread->stats_.enqueued += n;
+  NUB__TRACE(thread->nubloop->trace_,
+             NUB__TRACE_ENQUEUE,
+             nub__trace_id(thread->trace_));
+  nub__thread_signal(thread);
+
+  if (NULL != thread->water_cb_)
+    nub__water_rise(thread);
+
+  return 0;
+}
+
+
+void nub_thread_stats(nub_thread_t* thread, nub_thread_stats_t* stats) {
+  *stats = thread->stats_;
+  if (0 == thread->exited_)
+    stats->cpu_ns = nub__thread_cpu(thread->uvthread);
 }
@@ -0,0 +1,170 @@
+#include "nub.h"
+#include "trace.h"
+#include "util.h"
+#include "uv.h"
+
+#include <stdio.h>  /* FILE, fopen, fprintf, fclose */
+#include <stdlib.h>  /* malloc, free */
+
+typedef struct {
+  uint64_t ts;
+  uintptr_t arg;
+  nub__trace_type type;
+} nub__trace_event_t;
+
+struct nub__trace_s {
+  nub__trace_t* next;  /* All rings attached to the same loop */
+  unsigned int id;
+  unsigned int mask;  /* Number of events minus one */
+  volatile uint64_t head;  /* Number of events ever recorded */
+  nub__trace_event_t events[1];
+};
+
+
+nub__trace_t* nub__trace_new(nub_loop_t* loop) {
+  nub__trace_t* ring;
+  unsigned int size;
+
+  if (0 == loop->trace_size_)
+    return NULL;
+
+  /* Round up so the index is a mask. */
+  for (size = 1; size < loop->trace_size_; size <<= 1);
+
+  ring = (nub__trace_t*) malloc(sizeof(*ring) +
+                                sizeof(ring->events[0]) * (size - 1));
+  CHECK_NE(NULL, ring);
+
+  ring->id = loop->trace_next_id_++;
+  ring->mask = size - 1;
+  ring->head = 0;
+  ring->next = loop->traces_;
+  loop->traces_ = ring;
+
+  return ring;
+}
+
+
+void nub__trace_record(nub__trace_t* ring,
+                       nub__trace_type type,
+                       uintptr_t arg) {
+  nub__trace_event_t* event;
+
+  event = &ring->events[ring->head & ring->mask];
+  event->ts = uv_hrtime();
+  event->arg = arg;
+  event->type = type;
+  ring->head++;
+}
+
+
+unsigned int nub__trace_id(nub__trace_t* ring) {
+  return NULL == ring ? 0 : ring->id;
+}
+
+
+void nub__trace_free(nub_loop_t* loop) {
+  nub__trace_t* ring;
+  nub__trace_t* next;
+
+  for (ring = loop->traces_; NULL != ring; ring = next) {
+    next = ring->next;
+    free(ring);
+  }
+
+  loop->traces_ = NULL;
+}
+
+
+static void nub__trace_write(FILE* fp,
+                             nub__trace_t* ring,
+                             nub__trace_event_t* event,
+                             uint64_t start,
+                             int* first) {
+  const char* name;
+  const char* ph;
+
+  switch (event->type) {
+    case NUB__TRACE_ENQUEUE: name = "enqueue"; ph = "i"; break;
+    case NUB__TRACE_DEQUEUE: name = "dequeue"; ph = "i"; break;
+    case NUB__TRACE_LOCK_REQUEST: name = "lock request"; ph = "i"; break;
+    case NUB__TRACE_LOCK_GRANT: name = "locked"; ph = "B"; break;
+    case NUB__TRACE_LOCK_RELEASE: name = "locked"; ph = "E"; break;
+    case NUB__TRACE_LOCK_TIMEOUT: name = "lock timeout"; ph = "i"; break;
+    case NUB__TRACE_HALT: name = "halted"; ph = "B"; break;
+    case NUB__TRACE_RESUME: name = "halted"; ph = "E"; break;
+    case NUB__TRACE_PARK: name = "parked"; ph = "B"; break;
+    case NUB__TRACE_WAKE: name = "parked"; ph = "E"; break;
+    default: UNREACHABLE();
+  }
+
+  fprintf(fp,
+          "%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,"
+          "\"tid\":%u",
+          *first ? "" : ",",
+          name,
+          ph,
+          (event->ts - start) / 1e3,
+          ring->id);
+  if ('i' == ph[0]) {
+    fprintf(fp,
+            ",\"s\":\"t\",\"args\":{\"arg\":%lu}",
+            (unsigned long) event->arg);
+  }
+  fputc('}', fp);
+  *first = 0;
+}
+
+
+/* Index of the oldest event not yet overwritten. */
+static uint64_t nub__trace_tail(nub__trace_t* ring, uint64_t head) {
+  return head > ring->mask + 1 ? head - ring->mask - 1 : 0;
+}
+
+
+int nub_loop_trace_dump(nub_loop_t* loop, const char* path) {
+  nub__trace_t* ring;
+  uint64_t start;
+  uint64_t head;
+  uint64_t i;
+  FILE* fp;
+  int first;
+
+  fp = fopen(path, "w");
+  if (NULL == fp)
+    return UV_EIO;
+
+  /* Make timestamps relative to the oldest event still around. */
+  start = (uint64_t) -1;
+  for (ring = loop->traces_; NULL != ring; ring = ring->next) {
+    head = ring->head;
+    i = nub__trace_tail(ring, head);
+    if (i < head && ring->events[i & ring->mask].ts < start)
+      start = ring->events[i & ring->mask].ts;
+  }
+
+  fputs("{\"traceEvents\":[", fp);
+  first = 1;
+
+  for (ring = loop->traces_; NULL != ring; ring = ring->next) {
+    fprintf(fp,
+            "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+            first ? "" : ",",
+            ring->id,
+            0 == ring->id ? "loop" : "thread",
+            ring->id);
+    first = 0;
+
+    head = ring->head;
+    for (i = nub__trace_tail(ring, head); i < head; i++)
+      nub__trace_write(fp, ring, &ring->events[i & ring->mask], start, &first);
+  }
+
+  fputs("\n]}\n", fp);
+
+  if (0 != fclose(fp))
+    return UV_EIO;
+
+  return 0;
+}
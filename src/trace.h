@@ -0,0 +1,47 @@
+#ifndef LIBNUB_TRACE_H_
+#define LIBNUB_TRACE_H_
+
+#include "nub.h"
+
+#include <stdint.h>  /* uintptr_t */
+
+/* Per-thread rings of timestamped events, enabled with NUB_LOOP_TRACE. Each
+ * ring has a single writer: spawned threads write their own, and the loop's
+ * ring is written by the event loop thread or whoever holds the loop
+ * exclusively. Old events are overwritten once a ring is full. */
+
+typedef enum {
+  NUB__TRACE_ENQUEUE,  /* arg is the receiving thread's trace id */
+  NUB__TRACE_DEQUEUE,
+  NUB__TRACE_LOCK_REQUEST,
+  NUB__TRACE_LOCK_GRANT,
+  NUB__TRACE_LOCK_RELEASE,
+  NUB__TRACE_LOCK_TIMEOUT,
+  NUB__TRACE_HALT,
+  NUB__TRACE_RESUME,
+  NUB__TRACE_PARK,
+  NUB__TRACE_WAKE
+} nub__trace_type;
+
+/* Costs a single branch when tracing is off. */
+#define NUB__TRACE(ring, type, arg)                                           \
+  do {                                                                        \
+    if (NULL != (ring))                                                       \
+      nub__trace_record((ring), (type), (uintptr_t) (arg));                   \
+  } while (0)
+
+/* Allocate a ring and attach it to the loop so it outlives its thread. Must be
+ * run from the event loop thread. Returns NULL if tracing is off. */
+nub__trace_t* nub__trace_new(nub_loop_t* loop);
+
+void nub__trace_record(nub__trace_t* ring,
+                       nub__trace_type type,
+                       uintptr_t arg);
+
+/* Trace id of a ring, or 0 for NULL. */
+unsigned int nub__trace_id(nub__trace_t* ring);
+
+/* Free all rings attached to the loop. */
+void nub__trace_free(nub_loop_t* loop);
+
+#endif  /* LIBNUB_TRACE_H_ */
@@ -32,4 +32,9 @@
 
 #define UNREACHABLE() CHECK("Unreachable" && 0)
 
+#ifndef _WIN32
+/* libuv error codes are negated errno values on unix. */
+# define NUB__ERR(er) (-(er))
+#endif
+
 #endif  /* LIBNUB_UTIL_H_ */
@@ -0,0 +1,176 @@
+#include "nub.h"
+#include "util.h"
+#include "wheel.h"
+#include "uv.h"
+
+#define NUB__WHEEL_MASK (NUB__WHEEL_SLOTS - 1)
+
+
+static uint64_t nub__wheel_now(void) {
+  return uv_hrtime() / NUB__WHEEL_TICK;
+}
+
+
+static void nub__wheel_insert(nub__wheel_t* wheel,
+                              nub_work_t* work,
+                              uint64_t timeout) {
+  nub_work_t** slot;
+  uint64_t due;
+
+  /* Round up so work never runs early. */
+  due = (uv_hrtime() + timeout + NUB__WHEEL_TICK - 1) / NUB__WHEEL_TICK;
+  /* Slots up to tick_ have already been looked at. */
+  if (due <= wheel->tick_)
+    due = wheel->tick_ + 1;
+
+  work->due = due;
+  slot = &wheel->slots_[due & NUB__WHEEL_MASK];
+  work->next = *slot;
+  *slot = work;
+}
+
+
+void nub__wheel_init(nub__wheel_t* wheel) {
+  int i;
+
+  for (i = 0; i < NUB__WHEEL_SLOTS; i++)
+    wheel->slots_[i] = NULL;
+  wheel->due_ = NULL;
+  wheel->tick_ = nub__wheel_now();
+  wheel->count_ = 0;
+}
+
+
+unsigned int nub__wheel_run(nub_thread_t* thread) {
+  nub__wheel_t* wheel;
+  nub_work_t* volatile* link;
+  nub_work_t* volatile* tail;
+  nub_work_t* work;
+  uint64_t ticks;
+  uint64_t now;
+  uint64_t i;
+  unsigned int n;
+
+  wheel = &thread->wheel_;
+  now = nub__wheel_now();
+  if (now <= wheel->tick_)
+    return 0;
+
+  /* After more than a full turn every slot only needs to be looked at once. */
+  ticks = now - wheel->tick_;
+  if (ticks > NUB__WHEEL_SLOTS)
+    ticks = NUB__WHEEL_SLOTS;
+
+  /* Move everything due onto due_ first, so callbacks are free to schedule
+   * and cancel work. */
+  tail = &wheel->due_;
+  for (i = 1; i <= ticks; i++) {
+    link = &wheel->slots_[(wheel->tick_ + i) & NUB__WHEEL_MASK];
+    while (NULL != (work = *link)) {
+      if (work->due > now) {
+        link = &work->next;
+        continue;
+      }
+      *link = work->next;
+      work->next = NULL;
+      *tail = work;
+      tail = &work->next;
+    }
+  }
+  wheel->tick_ = now;
+
+  for (n = 0; NULL != (work = wheel->due_); n++) {
+    wheel->due_ = work->next;
+    /* Rescheduled before running so the callback can cancel it. */
+    if (0 != work->repeat) {
+      nub__wheel_insert(wheel, work, work->repeat);
+    } else {
+      work->work_type = NUB_LOOP_QUEUE_NONE;
+      wheel->count_--;
+    }
+    (work->cb)(thread, work, work->arg);
+  }
+
+  return n;
+}
+
+
+uint64_t nub__wheel_timeout(nub__wheel_t* wheel) {
+  nub_work_t* work;
+  uint64_t first;
+  uint64_t tick;
+  uint64_t now;
+  int i;
+
+  ASSERT(0 < wheel->count_);
+  if (NULL != wheel->due_)
+    return 0;
+
+  /* Everything left is due after tick_, so the first work found that's due
+   * on the turn being looked at is the earliest. Otherwise it's whatever is
+   * due soonest on a later turn. */
+  first = (uint64_t) -1;
+  for (i = 1; i <= NUB__WHEEL_SLOTS; i++) {
+    tick = wheel->tick_ + i;
+    work = wheel->slots_[tick & NUB__WHEEL_MASK];
+    for (; NULL != work; work = work->next) {
+      if (work->due < first)
+        first = work->due;
+    }
+    if (first == tick)
+      break;
+  }
+
+  now = uv_hrtime();
+  if (first * NUB__WHEEL_TICK <= now)
+    return 0;
+  return first * NUB__WHEEL_TICK - now;
+}
+
+
+void nub_thread_enqueue_after(nub_thread_t* thread,
+                              nub_work_t* work,
+                              uint64_t timeout) {
+  nub_thread_enqueue_repeat(thread, work, timeout, 0);
+}
+
+
+void nub_thread_enqueue_repeat(nub_thread_t* thread,
+                               nub_work_t* work,
+                               uint64_t timeout,
+                               uint64_t repeat) {
+  ASSERT(NUB_LOOP_QUEUE_TIMER != work->work_type);
+
+  work->work_type = NUB_LOOP_QUEUE_TIMER;
+  work->repeat = repeat;
+  nub__wheel_insert(&thread->wheel_, work, timeout);
+  thread->wheel_.count_++;
+}
+
+
+int nub_thread_cancel_after(nub_thread_t* thread, nub_work_t* work) {
+  nub__wheel_t* wheel;
+  nub_work_t* volatile* link;
+
+  if (NUB_LOOP_QUEUE_TIMER != work->work_type)
+    return UV_ENOENT;
+
+  wheel = &thread->wheel_;
+
+  /* Either still on the wheel or due to run in the current nub__wheel_run(). */
+  link = &wheel->slots_[work->due & NUB__WHEEL_MASK];
+  while (NULL != *link && work != *link)
+    link = &(*link)->next;
+  if (NULL == *link) {
+    link = &wheel->due_;
+    while (work != *link)
+      link = &(*link)->next;
+  }
+
+  *link = work->next;
+  work->next = NULL;
+  work->work_type = NUB_LOOP_QUEUE_NONE;
+  wheel->count_--;
+
+  return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef LIBNUB_WHEEL_H_
+#define LIBNUB_WHEEL_H_
+
+#include "nub.h"
+
+/* Work a spawned thread has scheduled for itself, hashed into slots by the
+ * tick it's due at. Work due more than a full turn out sits in its slot until
+ * the wheel comes around again. Only used by the owning thread. */
+
+/* Nanoseconds per tick. */
+#define NUB__WHEEL_TICK 1000000
+
+void nub__wheel_init(nub__wheel_t* wheel);
+
+/* Run everything that's due. Returns the number of items run. */
+unsigned int nub__wheel_run(nub_thread_t* thread);
+
+/* Nanoseconds until the next item is due, or 0 if something already is. Must
+ * only be run while count_ isn't 0. */
+uint64_t nub__wheel_timeout(nub__wheel_t* wheel);
+
+#endif  /* LIBNUB_WHEEL_H_ */
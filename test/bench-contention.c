@@ -0,0 +1,107 @@
+#include "nub.h"
+#include "run-benchmarks.h"
+#include "helper.h"
+#include "uv.h"
+
+#include <stdlib.h>  /* calloc, free */
+
+#define ITER 1e6L
+#define MAX_PRODUCERS 32
+/* Number of items each producer keeps in flight on the event loop. */
+#define IN_FLIGHT 64
+
+typedef struct {
+  nub_thread_t thread;
+  nub_work_t start;
+  nub_work_t items[IN_FLIGHT];
+  int to_send;
+  int to_complete;
+} producer;
+
+static uint64_t loop_cntr;
+
+
+/* Runs from the main thread. */
+static void loop_noop(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  loop_cntr++;
+}
+
+
+/* Runs from the spawned thread. */
+static void producer_complete_cb(nub_work_t* work, int status) {
+  producer* p = (producer*) work->data;
+
+  if (0 < p->to_send) {
+    p->to_send--;
+    nub_loop_enqueue(&p->thread, work, producer_complete_cb);
+  }
+
+  if (0 == --p->to_complete)
+    nub_thread_dispose(&p->thread, NULL);
+}
+
+
+/* Runs from the spawned thread. */
+static void producer_start(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  producer* p = (producer*) arg;
+  int i;
+
+  for (i = 0; i < IN_FLIGHT && 0 < p->to_send; i++) {
+    p->to_send--;
+    nub_loop_enqueue(thread, &p->items[i], producer_complete_cb);
+  }
+}
+
+
+static void run_producers(int nproducers) {
+  nub_loop_t loop;
+  producer* producers;
+  char name[64];
+  uint64_t time;
+  int per_producer;
+  int i;
+  int n;
+
+  producers = (producer*) calloc(nproducers, sizeof(*producers));
+  ASSERT(NULL != producers);
+  per_producer = ITER / nproducers;
+  loop_cntr = 0;
+
+  nub_loop_init(&loop);
+
+  for (i = 0; i < nproducers; i++) {
+    producers[i].to_send = per_producer;
+    producers[i].to_complete = per_producer;
+    nub_work_init(&producers[i].start, producer_start, &producers[i]);
+    for (n = 0; n < IN_FLIGHT; n++) {
+      nub_work_init(&producers[i].items[n], loop_noop, NULL);
+      producers[i].items[n].data = &producers[i];
+    }
+    ASSERT(nub_thread_create(&loop, &producers[i].thread) == 0);
+  }
+
+  time = uv_hrtime();
+
+  for (i = 0; i < nproducers; i++)
+    nub_thread_enqueue(&producers[i].thread, &producers[i].start);
+
+  ASSERT(nub_loop_run(&loop, UV_RUN_DEFAULT) == 0);
+
+  time = uv_hrtime() - time;
+  ASSERT((uint64_t) per_producer * nproducers == loop_cntr);
+  sprintf(name, "loop_enqueue_contention/%d", nproducers);
+  bench_report(name, "ops/sec", loop_cntr / (time / 1e9));
+
+  nub_loop_dispose(&loop);
+  free(producers);
+}
+
+
+BENCHMARK_IMPL(loop_enqueue_contention) {
+  int n;
+
+  for (n = 1; n <= MAX_PRODUCERS; n *= 2)
+    run_producers(n);
+
+  return 0;
+}
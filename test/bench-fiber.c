@@ -0,0 +1,115 @@
+#include "nub.h"
+#include "run-benchmarks.h"
+#include "helper.h"
+#include "uv.h"
+
+#include <stdlib.h>  /* calloc, free */
+
+#define THREADS 4
+#define FIBERS 2500
+#define ITER 10
+#define STACK_SIZE (16 * 1024)
+
+struct host_s {
+  nub_thread_t thread;
+  nub_work_t start;
+  nub_fiber_t* fibers;
+  int done;
+};
+
+static struct host_s hosts[THREADS];
+static int use_lock;
+static unsigned int loop_ran;
+
+
+/* Runs from the event loop thread. */
+static void loop_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  loop_ran++;
+}
+
+
+/* Runs from a fiber. Waiting parks the fiber, not its thread. */
+static void fiber_cb(nub_fiber_t* fiber) {
+  int i;
+
+  for (i = 0; i < ITER; i++) {
+    if (use_lock) {
+      ASSERT(0 == nub_fiber_lock(fiber));
+      loop_ran++;
+      nub_fiber_unlock(fiber);
+    } else {
+      ASSERT(0 == nub_fiber_loop_run(fiber, loop_cb, NULL));
+    }
+  }
+}
+
+
+/* Runs from the spawned thread. */
+static void done_cb(nub_fiber_t* fiber) {
+  struct host_s* host;
+
+  host = (struct host_s*) fiber->data;
+  if (FIBERS == ++host->done)
+    nub_thread_dispose(fiber->thread, NULL);
+}
+
+
+/* Runs from the spawned thread. */
+static void start_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  struct host_s* host;
+  int i;
+
+  host = (struct host_s*) arg;
+  for (i = 0; i < FIBERS; i++) {
+    host->fibers[i].data = host;
+    ASSERT(0 == nub_fiber_create(thread,
+                                 &host->fibers[i],
+                                 STACK_SIZE,
+                                 fiber_cb,
+                                 done_cb));
+  }
+}
+
+
+static void run_fibers(const char* name, int lock) {
+  nub_loop_t loop;
+  uint64_t time;
+  int i;
+
+  use_lock = lock;
+  loop_ran = 0;
+  nub_loop_init(&loop);
+
+  time = uv_hrtime();
+
+  for (i = 0; i < THREADS; i++) {
+    hosts[i].fibers = (nub_fiber_t*) calloc(FIBERS, sizeof(nub_fiber_t));
+    ASSERT(NULL != hosts[i].fibers);
+    hosts[i].done = 0;
+    ASSERT(0 == nub_thread_create(&loop, &hosts[i].thread));
+    nub_work_init(&hosts[i].start, start_cb, &hosts[i]);
+    nub_thread_enqueue(&hosts[i].thread, &hosts[i].start);
+  }
+
+  ASSERT(0 == nub_loop_run(&loop, UV_RUN_DEFAULT));
+  ASSERT(THREADS * FIBERS * ITER == loop_ran);
+
+  time = uv_hrtime() - time;
+  bench_report(name, "ops/sec", THREADS * FIBERS * ITER / (time / 1e9));
+
+  for (i = 0; i < THREADS; i++)
+    free(hosts[i].fibers);
+  nub_loop_dispose(&loop);
+}
+
+
+BENCHMARK_IMPL(fiber_lock) {
+  run_fibers("fiber_lock", 1);
+  return 0;
+}
+
+
+BENCHMARK_IMPL(fiber_loop_run) {
+  run_fibers("fiber_loop_run", 0);
+  return 0;
+}
@@ -0,0 +1,123 @@
+#include "nub.h"
+#include "run-benchmarks.h"
+#include "helper.h"
+#include "uv.h"
+
+#include <stdint.h>  /* intptr_t */
+
+#define THREADS 4
+#define ITER 20000
+#define TIMEOUT 1000
+
+/* uv_timer_t must come first. */
+typedef struct {
+  uv_timer_t uvtimer;
+  nub_thread_t thread;
+  nub_work_t work;
+} timer_work;
+
+static timer_work timers[THREADS];
+
+
+/* Runs from the main thread. */
+static void timer_cb(uv_timer_t* handle) {
+  ASSERT(0 && "timer should have been stopped");
+}
+
+
+/* Runs from the main thread. Restarting an active timer is the kind of short
+ * libuv call a worker makes all the time. */
+static void* timer_start_cb(nub_thread_t* thread, void* arg) {
+  timer_work* t_work = (timer_work*) arg;
+
+  return (void*) (intptr_t) uv_timer_start(&t_work->uvtimer,
+                                           timer_cb,
+                                           TIMEOUT,
+                                           0);
+}
+
+
+/* Runs from the main thread. */
+static void* timer_init_cb(nub_thread_t* thread, void* arg) {
+  timer_work* t_work = (timer_work*) arg;
+
+  return (void*) (intptr_t) uv_timer_init(&thread->nubloop->uvloop,
+                                          &t_work->uvtimer);
+}
+
+
+/* Runs from the main thread. */
+static void* timer_close_cb(nub_thread_t* thread, void* arg) {
+  timer_work* t_work = (timer_work*) arg;
+
+  uv_close((uv_handle_t*) &t_work->uvtimer, NULL);
+  return NULL;
+}
+
+
+/* Runs from the spawned thread. The pattern from test-timers.c. */
+static void lock_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  timer_work* t_work = (timer_work*) arg;
+  int i;
+
+  ASSERT(0 == nub_loop_call(thread, timer_init_cb, t_work, NULL));
+  for (i = 0; i < ITER; i++) {
+    nub_loop_lock(thread);
+    ASSERT(0 == uv_timer_start(&t_work->uvtimer, timer_cb, TIMEOUT, 0));
+    nub_loop_unlock(thread);
+  }
+  ASSERT(0 == nub_loop_call(thread, timer_close_cb, t_work, NULL));
+  nub_thread_dispose(thread, NULL);
+}
+
+
+/* Runs from the spawned thread. */
+static void call_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  timer_work* t_work = (timer_work*) arg;
+  void* result;
+  int i;
+
+  ASSERT(0 == nub_loop_call(thread, timer_init_cb, t_work, NULL));
+  for (i = 0; i < ITER; i++) {
+    ASSERT(0 == nub_loop_call(thread, timer_start_cb, t_work, &result));
+    ASSERT(0 == (intptr_t) result);
+  }
+  ASSERT(0 == nub_loop_call(thread, timer_close_cb, t_work, NULL));
+  nub_thread_dispose(thread, NULL);
+}
+
+
+static void run_timers(const char* name, nub_work_cb cb) {
+  nub_loop_t loop;
+  uint64_t time;
+  int i;
+
+  nub_loop_init(&loop);
+
+  time = uv_hrtime();
+
+  for (i = 0; i < THREADS; i++) {
+    ASSERT(0 == nub_thread_create(&loop, &timers[i].thread));
+    nub_work_init(&timers[i].work, cb, &timers[i]);
+    nub_thread_enqueue(&timers[i].thread, &timers[i].work);
+  }
+
+  ASSERT(0 == nub_loop_run(&loop, UV_RUN_DEFAULT));
+
+  time = uv_hrtime() - time;
+  bench_report(name, "ops/sec", THREADS * ITER / (time / 1e9));
+
+  nub_loop_dispose(&loop);
+}
+
+
+BENCHMARK_IMPL(timer_lock) {
+  run_timers("timer_lock", lock_cb);
+  return 0;
+}
+
+
+BENCHMARK_IMPL(timer_call) {
+  run_timers("timer_call", call_cb);
+  return 0;
+}
@@ -0,0 +1,251 @@
+#include "nub.h"
+#include "run-benchmarks.h"
+#include "helper.h"
+#include "uv.h"
+
+#include <stdlib.h>  /* malloc, free */
+#include <string.h>  /* memcmp */
+
+#define MAX_LOOPS 8
+#define CLIENTS 32
+#define REQUESTS 1000
+#define BUF_SIZE 4096
+
+typedef struct {
+  uv_tcp_t handle;
+  char buf[BUF_SIZE];
+  int matched;  /* Characters of the request terminator seen so far */
+} conn_t;
+
+typedef struct {
+  uv_tcp_t handle;
+  uv_connect_t connect_req;
+  char buf[BUF_SIZE];
+  size_t received;
+  unsigned int left;
+} client_t;
+
+static const char request[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: 127.0.0.1\r\n"
+    "\r\n";
+static const char response[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Length: 2\r\n"
+    "\r\n"
+    "ok";
+static const char terminator[] = "\r\n\r\n";
+
+static nub_loop_group_t group;
+static uv_tcp_t servers[MAX_LOOPS];
+static client_t clients[CLIENTS];
+static struct sockaddr_storage server_addr;
+static unsigned int clients_left;
+
+
+/* Runs from each loop's own thread. */
+static void stop_cb(nub_loop_group_t* g, nub_loop_t* loop) {
+  uv_close((uv_handle_t*) &servers[loop - g->loops], NULL);
+}
+
+
+static void free_cb(uv_handle_t* handle) {
+  free(handle);
+}
+
+
+static void conn_alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* buf) {
+  buf->base = ((conn_t*) handle)->buf;
+  buf->len = BUF_SIZE;
+}
+
+
+static void conn_write_cb(uv_write_t* req, int status) {
+  free(req);
+}
+
+
+/* Runs from a server loop. A response goes out for every complete request
+ * header. */
+static void conn_read_cb(uv_stream_t* stream,
+                         ssize_t nread,
+                         const uv_buf_t* buf) {
+  conn_t* conn = (conn_t*) stream;
+  uv_buf_t out;
+  uv_write_t* req;
+  ssize_t i;
+  int er;
+
+  if (0 > nread) {
+    uv_close((uv_handle_t*) stream, free_cb);
+    return;
+  }
+
+  out = uv_buf_init((char*) response, sizeof(response) - 1);
+  for (i = 0; i < nread; i++) {
+    if (buf->base[i] != terminator[conn->matched]) {
+      conn->matched = buf->base[i] == terminator[0];
+      continue;
+    }
+    if (sizeof(terminator) - 1 != ++conn->matched)
+      continue;
+    conn->matched = 0;
+    er = uv_try_write(stream, &out, 1);
+    if ((int) out.len == er)
+      continue;
+    /* Clients wait for each response, so there's never much queued. */
+    ASSERT(UV_EAGAIN == er);
+    req = (uv_write_t*) malloc(sizeof(*req));
+    ASSERT(NULL != req);
+    ASSERT(0 == uv_write(req, stream, &out, 1, conn_write_cb));
+  }
+}
+
+
+/* Runs from whichever loop the kernel handed the connection to. */
+static void connection_cb(uv_stream_t* server, int status) {
+  conn_t* conn;
+
+  ASSERT(0 == status);
+  conn = (conn_t*) malloc(sizeof(*conn));
+  ASSERT(NULL != conn);
+  conn->matched = 0;
+  ASSERT(0 == uv_tcp_init(server->loop, &conn->handle));
+  ASSERT(0 == uv_accept(server, (uv_stream_t*) &conn->handle));
+  ASSERT(0 == uv_tcp_nodelay(&conn->handle, 1));
+  ASSERT(0 == uv_read_start((uv_stream_t*) &conn->handle,
+                            conn_alloc_cb,
+                            conn_read_cb));
+}
+
+
+static void client_send(client_t* client) {
+  uv_buf_t buf;
+
+  buf = uv_buf_init((char*) request, sizeof(request) - 1);
+  client->received = 0;
+  /* The socket is idle between requests, so it always takes all of it. */
+  ASSERT((int) buf.len == uv_try_write((uv_stream_t*) &client->handle,
+                                       &buf,
+                                       1));
+}
+
+
+static void client_alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* buf) {
+  client_t* client = (client_t*) handle;
+
+  buf->base = client->buf + client->received;
+  buf->len = BUF_SIZE - client->received;
+}
+
+
+/* Runs from the client thread. */
+static void client_read_cb(uv_stream_t* stream,
+                           ssize_t nread,
+                           const uv_buf_t* buf) {
+  client_t* client = (client_t*) stream;
+
+  ASSERT(0 <= nread);
+  client->received += nread;
+  if (sizeof(response) - 1 > client->received)
+    return;
+  ASSERT(sizeof(response) - 1 == client->received);
+  ASSERT(0 == memcmp(client->buf, response, client->received));
+
+  if (0 < --client->left) {
+    client_send(client);
+    return;
+  }
+
+  uv_close((uv_handle_t*) stream, NULL);
+  if (0 == --clients_left)
+    nub_loop_group_stop(&group, stop_cb);
+}
+
+
+static void client_connect_cb(uv_connect_t* req, int status) {
+  client_t* client = (client_t*) req->handle;
+
+  ASSERT(0 == status);
+  ASSERT(0 == uv_tcp_nodelay(&client->handle, 1));
+  ASSERT(0 == uv_read_start((uv_stream_t*) &client->handle,
+                            client_alloc_cb,
+                            client_read_cb));
+  client_send(client);
+}
+
+
+/* All clients run on a plain libuv loop of their own. */
+static void client_thread_cb(void* arg) {
+  uv_loop_t loop;
+  int i;
+
+  ASSERT(0 == uv_loop_init(&loop));
+  for (i = 0; i < CLIENTS; i++) {
+    clients[i].left = REQUESTS;
+    ASSERT(0 == uv_tcp_init(&loop, &clients[i].handle));
+    ASSERT(0 == uv_tcp_connect(&clients[i].connect_req,
+                               &clients[i].handle,
+                               (const struct sockaddr*) &server_addr,
+                               client_connect_cb));
+  }
+  ASSERT(0 == uv_run(&loop, UV_RUN_DEFAULT));
+  ASSERT(0 == uv_loop_close(&loop));
+}
+
+
+static void run_http(const char* name, unsigned int nloops) {
+  struct sockaddr_in addr;
+  uv_thread_t client_thread;
+  uint64_t time;
+  int len;
+  int er;
+
+  ASSERT(nloops <= MAX_LOOPS);
+  clients_left = CLIENTS;
+  ASSERT(0 == nub_loop_group_init(&group, nloops));
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", 0, &addr));
+
+  er = nub_loop_group_listen(&group,
+                             servers,
+                             (const struct sockaddr*) &addr,
+                             CLIENTS,
+                             connection_cb);
+  if (UV_ENOTSUP == er) {
+    nub_loop_group_dispose(&group);
+    return;
+  }
+  ASSERT(0 == er);
+  len = sizeof(server_addr);
+  ASSERT(0 == uv_tcp_getsockname(&servers[0],
+                                 (struct sockaddr*) &server_addr,
+                                 &len));
+
+  time = uv_hrtime();
+  ASSERT(0 == uv_thread_create(&client_thread, client_thread_cb, NULL));
+  ASSERT(0 == nub_loop_group_run(&group));
+  ASSERT(0 == uv_thread_join(&client_thread));
+  time = uv_hrtime() - time;
+
+  bench_report(name, "req/sec", CLIENTS * REQUESTS / (time / 1e9));
+
+  nub_loop_group_dispose(&group);
+}
+
+
+BENCHMARK_IMPL(http_group_1) {
+  run_http("http_group_1", 1);
+  return 0;
+}
+
+
+BENCHMARK_IMPL(http_group_2) {
+  run_http("http_group_2", 2);
+  return 0;
+}
+
+
+BENCHMARK_IMPL(http_group_4) {
+  run_http("http_group_4", 4);
+  return 0;
+}
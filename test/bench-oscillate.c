@@ -1,5 +1,5 @@
 #include "nub.h"
-#include "run-tests.h"
+#include "run-benchmarks.h"
 #include "helper.h"
 #include "uv.h"
 
@@ -19,7 +19,7 @@ static void thread_call(nub_thread_t* thread, nub_work_t* work, void* arg) {
 }
 
 
-BENCHMARK_IMPL(oscillate) {
+static void run_oscillate(const char* name, unsigned int lock_spin_us) {
   nub_loop_t loop;
   nub_thread_t thread;
   nub_work_t work;
@@ -29,6 +29,7 @@ BENCHMARK_IMPL(oscillate) {
   nub_work_init(&work, thread_call, &work);
 
   nub_loop_init(&loop);
+  ASSERT(nub_loop_configure(&loop, NUB_LOOP_LOCK_SPIN, lock_spin_us) == 0);
   ASSERT(nub_thread_create(&loop, &thread) == 0);
 
   time = uv_hrtime();
@@ -38,15 +39,25 @@ BENCHMARK_IMPL(oscillate) {
   ASSERT(nub_loop_run(&loop, UV_RUN_DEFAULT) == 0);
 
   time = uv_hrtime() - time;
-  fprintf(stderr, "oscillate: %Lf/sec\n", ITER / (time / 1e9));
+  bench_report(name, "ops/sec", ITER / (time / 1e9));
 
   nub_loop_dispose(&loop);
+}
+
 
+BENCHMARK_IMPL(oscillate) {
+  run_oscillate("oscillate", 0);
   return 0;
 }
 
 
-BENCHMARK_IMPL(oscillate_multi) {
+BENCHMARK_IMPL(oscillate_lock_spin) {
+  run_oscillate("oscillate_lock_spin", 50);
+  return 0;
+}
+
+
+static void run_oscillate_multi(const char* name, int handoff) {
   nub_loop_t loop;
   nub_thread_t thread0;
   nub_thread_t thread1;
@@ -63,6 +74,7 @@ BENCHMARK_IMPL(oscillate_multi) {
   nub_work_init(&work, thread_call, &work);
 
   nub_loop_init(&loop);
+  ASSERT(nub_loop_configure(&loop, NUB_LOOP_LOCK_HANDOFF, handoff) == 0);
   ASSERT(nub_thread_create(&loop, &thread0) == 0);
   ASSERT(nub_thread_create(&loop, &thread1) == 0);
   ASSERT(nub_thread_create(&loop, &thread2) == 0);
@@ -86,11 +98,21 @@ BENCHMARK_IMPL(oscillate_multi) {
   ASSERT(nub_loop_run(&loop, UV_RUN_DEFAULT) == 0);
 
   time = uv_hrtime() - time;
-  fprintf(stderr, "oscillate_multi: %Lf/sec\n", ITER / (time / 1e9));
+  bench_report(name, "ops/sec", ITER / (time / 1e9));
 
   nub_loop_dispose(&loop);
   iter = ITER;
+}
+
+
+BENCHMARK_IMPL(oscillate_multi) {
+  run_oscillate_multi("oscillate_multi", 0);
+  return 0;
+}
 
+
+BENCHMARK_IMPL(oscillate_multi_handoff) {
+  run_oscillate_multi("oscillate_multi_handoff", 1);
   return 0;
 }
 
@@ -107,26 +129,41 @@ void enqueue_dispose(nub_thread_t* thread, nub_work_t* work, void* arg) {
 }
 
 
-BENCHMARK_IMPL(enqueue_work) {
+#define BATCH 100
+
+static void run_enqueue_work(const char* name,
+                             unsigned int spin_us,
+                             int defer,
+                             int batch) {
   nub_loop_t loop;
   nub_thread_t thread;
   nub_work_t work_noop;
   nub_work_t work_dispose;
+  nub_work_t* works[BATCH];
   uint64_t time;
 
   iter = ITER;
 
   nub_work_init(&work_noop, enqueue_noop, &work_noop);
   nub_work_init(&work_dispose, enqueue_dispose, &work_dispose);
+  for (size_t i = 0; i < BATCH; i++)
+    works[i] = &work_noop;
   nub_loop_init(&loop);
+  ASSERT(nub_loop_configure(&loop, NUB_LOOP_THREAD_SPIN, spin_us) == 0);
+  ASSERT(nub_loop_configure(&loop, NUB_LOOP_DEFER_WAKE, defer) == 0);
   ASSERT(nub_thread_create(&loop, &thread) == 0);
 
   thread.data = 0x0;
 
   time = uv_hrtime();
 
-  for (size_t i = 0; i < ITER; i++) {
-    nub_thread_enqueue(&thread, &work_noop);
+  if (batch) {
+    for (size_t i = 0; i < ITER; i += BATCH)
+      nub_thread_enqueue_batch(&thread, works, BATCH);
+  } else {
+    for (size_t i = 0; i < ITER; i++) {
+      nub_thread_enqueue(&thread, &work_noop);
+    }
   }
   nub_thread_enqueue(&thread, &work_dispose);
 
@@ -134,10 +171,32 @@ BENCHMARK_IMPL(enqueue_work) {
   ASSERT(ITER == (intptr_t) thread.data);
 
   time = uv_hrtime() - time;
-  fprintf(stderr, "enqueue_work:  %Lf/sec\n", ITER / (time / 1e9));
+  bench_report(name, "ops/sec", ITER / (time / 1e9));
 
   nub_loop_dispose(&loop);
   iter = ITER;
+}
+
+
+BENCHMARK_IMPL(enqueue_work) {
+  run_enqueue_work("enqueue_work", 0, 0, 0);
+  return 0;
+}
+
+
+BENCHMARK_IMPL(enqueue_work_spin) {
+  run_enqueue_work("enqueue_work_spin", 50, 0, 0);
+  return 0;
+}
+
+
+BENCHMARK_IMPL(enqueue_work_batch) {
+  run_enqueue_work("enqueue_work_batch", 0, 0, 1);
+  return 0;
+}
+
 
+BENCHMARK_IMPL(enqueue_work_defer) {
+  run_enqueue_work("enqueue_work_defer", 0, 1, 0);
   return 0;
 }
@@ -0,0 +1,144 @@
+#include "nub.h"
+#include "run-benchmarks.h"
+#include "helper.h"
+#include "uv.h"
+
+#include <stdio.h>  /* snprintf */
+
+/* Each round enqueues BURST items that take ITEM_NS each to run, about four
+ * times what the thread gets through before the next round. */
+#define ROUNDS 100
+#define ROUND_MS 1
+#define BURST 2000
+#define ITEM_NS 2000
+#define CAPACITY 1000
+#define DEADLINE_NS (2 * 1000 * 1000)
+
+/* Kept in the bytes that come with each work item. */
+typedef struct {
+  uint64_t enqueued;
+} item_extra;
+
+static nub_thread_t thread;
+static nub_work_t dispose_work;
+static uv_timer_t round_timer;
+static unsigned int rounds;
+static uint64_t deadline;
+static uint64_t latency_total;
+static uint64_t latency_max;
+static uint64_t ran;
+static uint64_t dropped;
+
+
+/* Runs from the spawned thread. */
+static void item_cb(nub_thread_t* t, nub_work_t* work, void* arg) {
+  item_extra* extra;
+  uint64_t start;
+  uint64_t latency;
+
+  extra = (item_extra*) NUB_WORK_EXTRA(work);
+  start = uv_hrtime();
+  latency = start - extra->enqueued;
+  latency_total += latency;
+  if (latency > latency_max)
+    latency_max = latency;
+  ran++;
+
+  while (uv_hrtime() - start < ITEM_NS);
+
+  nub_thread_work_free(t, work);
+}
+
+
+/* Runs from the spawned thread. */
+static void expired_cb(nub_work_t* work, int status) {
+  dropped++;
+  nub_thread_work_free(&thread, work);
+}
+
+
+/* Runs from the spawned thread. */
+static void dispose_cb(nub_thread_t* t, nub_work_t* work, void* arg) {
+  nub_thread_dispose(t, NULL);
+}
+
+
+/* Runs from the main thread. */
+static void round_cb(uv_timer_t* handle) {
+  nub_work_t* work;
+  uint64_t now;
+  int i;
+
+  now = uv_hrtime();
+  for (i = 0; i < BURST; i++) {
+    work = nub_loop_work_alloc(thread.nubloop);
+    ASSERT(NULL != work);
+    nub_work_init(work, item_cb, NULL);
+    ((item_extra*) NUB_WORK_EXTRA(work))->enqueued = now;
+    if (0 != deadline)
+      nub_work_set_deadline(work, now + deadline, expired_cb);
+    if (0 != nub_thread_enqueue(&thread, work)) {
+      dropped++;
+      nub_loop_work_free(thread.nubloop, work);
+    }
+  }
+
+  if (++rounds < ROUNDS)
+    return;
+
+  uv_close((uv_handle_t*) handle, NULL);
+  nub_thread_limit(&thread, 0, 0, 0, NULL);
+  nub_work_init(&dispose_work, dispose_cb, NULL);
+  ASSERT(0 == nub_thread_enqueue(&thread, &dispose_work));
+}
+
+
+static void run_overload(const char* name,
+                         unsigned int max_queued,
+                         uint64_t max_age) {
+  nub_loop_t loop;
+  char label[64];
+
+  rounds = 0;
+  deadline = max_age;
+  latency_total = 0;
+  latency_max = 0;
+  ran = 0;
+  dropped = 0;
+
+  nub_loop_init(&loop);
+  ASSERT(0 == nub_thread_create(&loop, &thread));
+  nub_thread_limit(&thread, max_queued, 0, 0, NULL);
+  ASSERT(0 == uv_timer_init(&loop.uvloop, &round_timer));
+  ASSERT(0 == uv_timer_start(&round_timer, round_cb, ROUND_MS, ROUND_MS));
+
+  ASSERT(0 == nub_loop_run(&loop, UV_RUN_DEFAULT));
+  ASSERT((uint64_t) ROUNDS * BURST == ran + dropped);
+
+  snprintf(label, sizeof(label), "%s_latency_avg", name);
+  bench_report(label, "us", ran ? latency_total / 1e3 / ran : 0);
+  snprintf(label, sizeof(label), "%s_latency_max", name);
+  bench_report(label, "us", latency_max / 1e3);
+  snprintf(label, sizeof(label), "%s_dropped", name);
+  bench_report(label, "items", (double) dropped);
+
+  nub_loop_dispose(&loop);
+}
+
+
+BENCHMARK_IMPL(overload_unbounded) {
+  run_overload("overload_unbounded", 0, 0);
+  return 0;
+}
+
+
+BENCHMARK_IMPL(overload_bounded) {
+  run_overload("overload_bounded", CAPACITY, 0);
+  return 0;
+}
+
+
+BENCHMARK_IMPL(overload_deadline) {
+  run_overload("overload_deadline", 0, DEADLINE_NS);
+  return 0;
+}
@@ -0,0 +1,151 @@
+#include "nub.h"
+#include "run-benchmarks.h"
+#include "helper.h"
+#include "uv.h"
+
+#include <stdlib.h>  /* qsort */
+
+#define THREADS 8
+#define ITEMS 20000
+/* Every HEAVY_EVERY items is one that takes HEAVY_NS to run. */
+#define HEAVY_EVERY 16
+#define HEAVY_NS 200000
+#define LIGHT_NS 2000
+
+typedef struct {
+  nub_work_t work;
+  uint64_t cost;
+  uint64_t queued;
+  uint64_t latency;
+} timed_work;
+
+static timed_work items[ITEMS];
+static volatile int remaining;
+static uv_async_t done_signal;
+static nub_thread_t threads[THREADS];
+static nub_pool_t pool;
+
+
+static void spin_for(uint64_t ns) {
+  uint64_t start = uv_hrtime();
+  while (uv_hrtime() - start < ns);
+}
+
+
+/* Runs from the spawned thread. */
+static void timed_work_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  timed_work* item = (timed_work*) arg;
+
+  spin_for(item->cost);
+  item->latency = uv_hrtime() - item->queued;
+
+  if (0 == __sync_sub_and_fetch(&remaining, 1))
+    uv_async_send(&done_signal);
+}
+
+
+static int cmp_latency(const void* a, const void* b) {
+  uint64_t la = ((const timed_work*) a)->latency;
+  uint64_t lb = ((const timed_work*) b)->latency;
+  return la < lb ? -1 : la > lb;
+}
+
+
+static void report(const char* name, uint64_t time) {
+  char buf[64];
+
+  qsort(items, ITEMS, sizeof(items[0]), cmp_latency);
+  bench_report(name, "ops/sec", ITEMS / (time / 1e9));
+  sprintf(buf, "%s/latency_p50", name);
+  bench_report(buf, "us", items[ITEMS / 2].latency / 1e3);
+  sprintf(buf, "%s/latency_p99", name);
+  bench_report(buf, "us", items[ITEMS * 99 / 100].latency / 1e3);
+  sprintf(buf, "%s/latency_max", name);
+  bench_report(buf, "us", items[ITEMS - 1].latency / 1e3);
+}
+
+
+static void init_items(void) {
+  int i;
+
+  remaining = ITEMS;
+  for (i = 0; i < ITEMS; i++) {
+    nub_work_init(&items[i].work, timed_work_cb, &items[i]);
+    items[i].cost = 0 == i % HEAVY_EVERY ? HEAVY_NS : LIGHT_NS;
+  }
+}
+
+
+/* Runs from the main thread. */
+static void threads_done_cb(uv_async_t* handle) {
+  int i;
+
+  for (i = 0; i < THREADS; i++)
+    nub_thread_join(&threads[i]);
+  uv_close((uv_handle_t*) handle, NULL);
+}
+
+
+/* Runs from the main thread. */
+static void pool_done_cb(uv_async_t* handle) {
+  nub_pool_dispose(&pool);
+  uv_close((uv_handle_t*) handle, NULL);
+}
+
+
+/* Baseline: work pinned round-robin to individual threads. */
+BENCHMARK_IMPL(pool_imbalanced_threads) {
+  nub_loop_t loop;
+  uint64_t time;
+  int i;
+
+  init_items();
+  nub_loop_init(&loop);
+  ASSERT(0 == uv_async_init(&loop.uvloop, &done_signal, threads_done_cb));
+  for (i = 0; i < THREADS; i++)
+    ASSERT(nub_thread_create(&loop, &threads[i]) == 0);
+
+  time = uv_hrtime();
+
+  for (i = 0; i < ITEMS; i++) {
+    items[i].queued = uv_hrtime();
+    nub_thread_enqueue(&threads[i % THREADS], &items[i].work);
+  }
+
+  ASSERT(nub_loop_run(&loop, UV_RUN_DEFAULT) == 0);
+
+  time = uv_hrtime() - time;
+  report("pool_imbalanced_threads", time);
+
+  nub_loop_dispose(&loop);
+
+  return 0;
+}
+
+
+BENCHMARK_IMPL(pool_imbalanced) {
+  nub_loop_t loop;
+  uint64_t time;
+  int i;
+
+  init_items();
+  nub_loop_init(&loop);
+  ASSERT(0 == uv_async_init(&loop.uvloop, &done_signal, pool_done_cb));
+  ASSERT(nub_pool_init(&loop, &pool, THREADS, THREADS) == 0);
+
+  time = uv_hrtime();
+
+  for (i = 0; i < ITEMS; i++) {
+    items[i].queued = uv_hrtime();
+    nub_pool_enqueue(&pool, &items[i].work);
+  }
+
+  ASSERT(nub_loop_run(&loop, UV_RUN_DEFAULT) == 0);
+
+  time = uv_hrtime() - time;
+  report("pool_imbalanced", time);
+
+  nub_loop_dispose(&loop);
+
+  return 0;
+}
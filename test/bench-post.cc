@@ -0,0 +1,143 @@
+extern "C" {
+#include "run-benchmarks.h"
+}
+#include "nub.hpp"
+#include "helper.h"
+#include "uv.h"
+
+#include <stdint.h>  /* uint64_t */
+#include <string.h>  /* memcpy */
+
+#define ITER 1000000
+
+/* What a typical request carries along: 40 bytes with the counter. */
+struct payload_s {
+  uint64_t id;
+  uint64_t a;
+  uint64_t b;
+  uint64_t c;
+};
+
+static nub_thread_t* target;
+static unsigned int ran;
+static uint64_t sum;
+
+
+static void account(const payload_s& p) {
+  sum += p.id + p.a + p.b + p.c;
+  if (ITER == ++ran)
+    nub_thread_dispose(target, NULL);
+}
+
+
+/* Runs from the spawned thread. The same work written by hand against the C
+ * API, with the payload in the item's extra bytes. */
+static void c_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  account(*static_cast<payload_s*>(NUB_WORK_EXTRA(work)));
+  nub_thread_work_free(thread, work);
+}
+
+
+static void report(const char* name, uint64_t time) {
+  bench_report(name, "ops/sec", ITER / (time / 1e9));
+}
+
+
+BENCHMARK_IMPL(post_c) {
+  nub_loop_t loop;
+  nub_thread_t thread;
+  payload_s p;
+  nub_work_t* work;
+  uint64_t time;
+  unsigned int i;
+
+  nub_loop_init(&loop);
+  ASSERT(0 == nub_thread_create(&loop, &thread));
+  target = &thread;
+  ran = 0;
+  sum = 0;
+
+  time = uv_hrtime();
+  for (i = 0; i < ITER; i++) {
+    p.id = p.a = p.b = p.c = i;
+    work = nub_loop_work_alloc(&loop);
+    ASSERT(NULL != work);
+    memcpy(NUB_WORK_EXTRA(work), &p, sizeof(p));
+    nub_work_init(work, c_cb, NULL);
+    nub_thread_enqueue(&thread, work);
+  }
+  ASSERT(0 == nub_loop_run(&loop, UV_RUN_DEFAULT));
+  time = uv_hrtime() - time;
+
+  ASSERT(ITER == ran);
+  ASSERT(4 * ((uint64_t) ITER * (ITER - 1) / 2) == sum);
+  report("post_c", time);
+
+  nub_loop_dispose(&loop);
+
+  return 0;
+}
+
+
+BENCHMARK_IMPL(post_lambda) {
+  nub::loop loop;
+  nub::thread thread(loop);
+  payload_s p;
+  uint64_t time;
+  unsigned int i;
+
+  ASSERT(0 == thread.error());
+  target = thread.get();
+  ran = 0;
+  sum = 0;
+
+  time = uv_hrtime();
+  for (i = 0; i < ITER; i++) {
+    p.id = p.a = p.b = p.c = i;
+    ASSERT(0 == thread.post([p] { account(p); }));
+  }
+  ASSERT(0 == loop.run());
+  time = uv_hrtime() - time;
+
+  ASSERT(ITER == ran);
+  ASSERT(4 * ((uint64_t) ITER * (ITER - 1) / 2) == sum);
+  report("post_lambda", time);
+
+  return 0;
+}
+
+
+/* Captures more than fits inline, so each post allocates the way every lambda
+ * did before. */
+BENCHMARK_IMPL(post_lambda_heap) {
+  nub::loop loop;
+  nub::thread thread(loop);
+  payload_s p;
+  payload_s pad;
+  uint64_t time;
+  unsigned int i;
+
+  ASSERT(0 == thread.error());
+  target = thread.get();
+  ran = 0;
+  sum = 0;
+  pad.id = pad.a = pad.b = pad.c = 0;
+
+  time = uv_hrtime();
+  for (i = 0; i < ITER; i++) {
+    p.id = p.a = p.b = p.c = i;
+    ASSERT(0 == thread.post([p, pad] {
+      payload_s q = p;
+      q.id += pad.id;
+      account(q);
+    }));
+  }
+  ASSERT(0 == loop.run());
+  time = uv_hrtime() - time;
+
+  ASSERT(ITER == ran);
+  ASSERT(4 * ((uint64_t) ITER * (ITER - 1) / 2) == sum);
+  report("post_lambda_heap", time);
+
+  return 0;
+}
@@ -0,0 +1,329 @@
+#include "nub.h"
+#include "run-benchmarks.h"
+#include "helper.h"
+#include "uv.h"
+
+#include <stdlib.h>  /* malloc, free, qsort */
+#include <string.h>  /* memcpy, memset */
+
+#define CLIENTS 4
+#define ECHOES 50000
+#define MSG_SIZE 64
+#define LOCK_THREADS 4
+#define LOCK_PAUSE_MS 1
+#define FLOOD_BUDGET_US 200
+#define MAX_LOCK_SAMPLES 100000
+
+typedef struct {
+  uv_tcp_t handle;
+  char buf[MSG_SIZE];
+  size_t received;
+  uint64_t sent_at;
+} client_t;
+
+typedef struct {
+  uv_write_t req;
+  char data[1];
+} echo_req_t;
+
+typedef struct {
+  nub_thread_t thread;
+  nub_work_t work;
+  uv_timer_t timer;
+  unsigned int nsamples;
+  uint64_t samples[MAX_LOCK_SAMPLES];
+} locker_t;
+
+static uv_tcp_t server;
+static client_t clients[CLIENTS];
+static locker_t lockers[LOCK_THREADS];
+static uint64_t rtts[ECHOES];
+static unsigned int nrtts;
+static unsigned int echoes_left;
+static unsigned int clients_left;
+static volatile int stop;
+static unsigned int lock_pause_ms;
+static char server_buf[MSG_SIZE * 16];
+static char message[MSG_SIZE];
+
+
+static int cmp_u64(const void* a, const void* b) {
+  uint64_t ua = *(const uint64_t*) a;
+  uint64_t ub = *(const uint64_t*) b;
+  return ua < ub ? -1 : ua > ub;
+}
+
+
+/* Report the spread of samples in microseconds. */
+static void report_histogram(const char* name, uint64_t* samples, size_t n) {
+  static const struct {
+    const char* suffix;
+    unsigned int per_mille;
+  } marks[] = {
+    { "p50", 500 }, { "p90", 900 }, { "p99", 990 }, { "p999", 999 }
+  };
+  char buf[128];
+  size_t i;
+
+  ASSERT(0 < n);
+  qsort(samples, n, sizeof(*samples), cmp_u64);
+
+  for (i = 0; i < sizeof(marks) / sizeof(marks[0]); i++) {
+    sprintf(buf, "%s_%s", name, marks[i].suffix);
+    bench_report(buf, "us", samples[n * marks[i].per_mille / 1000] / 1e3);
+  }
+  sprintf(buf, "%s_max", name);
+  bench_report(buf, "us", samples[n - 1] / 1e3);
+}
+
+
+static void alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* buf) {
+  if (handle->data == &server) {
+    buf->base = server_buf;
+    buf->len = sizeof(server_buf);
+  } else {
+    client_t* client = (client_t*) handle;
+    buf->base = client->buf + client->received;
+    buf->len = MSG_SIZE - client->received;
+  }
+}
+
+
+static void echo_write_cb(uv_write_t* req, int status) {
+  ASSERT(0 == status);
+  free(req);
+}
+
+
+static void free_cb(uv_handle_t* handle) {
+  free(handle);
+}
+
+
+/* Runs from the main thread. */
+static void server_read_cb(uv_stream_t* stream,
+                           ssize_t nread,
+                           const uv_buf_t* buf) {
+  echo_req_t* req;
+  uv_buf_t out;
+
+  if (0 > nread) {
+    uv_close((uv_handle_t*) stream, free_cb);
+    return;
+  }
+  if (0 == nread)
+    return;
+
+  /* The read buffer is reused, so the echo gets its own copy. */
+  req = (echo_req_t*) malloc(sizeof(*req) + nread);
+  ASSERT(NULL != req);
+  memcpy(req->data, buf->base, nread);
+  out = uv_buf_init(req->data, (unsigned int) nread);
+  ASSERT(0 == uv_write(&req->req, stream, &out, 1, echo_write_cb));
+}
+
+
+static void connection_cb(uv_stream_t* stream, int status) {
+  uv_tcp_t* conn;
+
+  ASSERT(0 == status);
+  conn = (uv_tcp_t*) malloc(sizeof(*conn));
+  ASSERT(NULL != conn);
+  ASSERT(0 == uv_tcp_init(stream->loop, conn));
+  conn->data = &server;
+  ASSERT(0 == uv_accept(stream, (uv_stream_t*) conn));
+  ASSERT(0 == uv_tcp_nodelay(conn, 1));
+  ASSERT(0 == uv_read_start((uv_stream_t*) conn, alloc_cb, server_read_cb));
+}
+
+
+static void client_send(client_t* client) {
+  uv_write_t* req;
+  uv_buf_t buf;
+
+  req = (uv_write_t*) malloc(sizeof(*req));
+  ASSERT(NULL != req);
+  buf = uv_buf_init(message, MSG_SIZE);
+  client->received = 0;
+  client->sent_at = uv_hrtime();
+  ASSERT(0 == uv_write(req, (uv_stream_t*) &client->handle, &buf, 1,
+                       echo_write_cb));
+}
+
+
+/* Runs from the main thread. */
+static void client_read_cb(uv_stream_t* stream,
+                           ssize_t nread,
+                           const uv_buf_t* buf) {
+  client_t* client = (client_t*) stream;
+
+  ASSERT(0 <= nread);
+  client->received += nread;
+  if (MSG_SIZE > client->received)
+    return;
+
+  rtts[nrtts++] = uv_hrtime() - client->sent_at;
+
+  if (0 < echoes_left) {
+    echoes_left--;
+    client_send(client);
+    return;
+  }
+
+  uv_close((uv_handle_t*) stream, NULL);
+  if (0 == --clients_left) {
+    /* Lets the lock threads finish and the loop drain. */
+    stop = 1;
+    uv_close((uv_handle_t*) &server, NULL);
+  }
+}
+
+
+static void connect_cb(uv_connect_t* req, int status) {
+  client_t* client = (client_t*) req->handle;
+
+  ASSERT(0 == status);
+  free(req);
+  ASSERT(0 == uv_tcp_nodelay(&client->handle, 1));
+  ASSERT(0 == uv_read_start((uv_stream_t*) &client->handle,
+                            alloc_cb,
+                            client_read_cb));
+  echoes_left--;
+  client_send(client);
+}
+
+
+static void timer_noop(uv_timer_t* handle) {
+}
+
+
+/* Runs from the spawned thread. Keeps asking for the loop to arm a timer
+ * until the echo clients are done. The pause stands in for work done off the
+ * loop; without it the lock requests never let the loop poll unless it has a
+ * budget. */
+static void locker_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  locker_t* locker = (locker_t*) arg;
+  uint64_t start;
+  uint64_t waited;
+
+  nub_loop_lock(thread);
+  ASSERT(0 == uv_timer_init(&thread->nubloop->uvloop, &locker->timer));
+  nub_loop_unlock(thread);
+
+  while (0 == stop) {
+    start = uv_hrtime();
+    nub_loop_lock(thread);
+    waited = uv_hrtime() - start;
+    ASSERT(0 == uv_timer_start(&locker->timer, timer_noop, 10000, 0));
+    ASSERT(0 == uv_timer_stop(&locker->timer));
+    nub_loop_unlock(thread);
+    if (MAX_LOCK_SAMPLES > locker->nsamples)
+      locker->samples[locker->nsamples++] = waited;
+    if (0 != lock_pause_ms)
+      uv_sleep(lock_pause_ms);
+  }
+
+  nub_loop_lock(thread);
+  uv_close((uv_handle_t*) &locker->timer, NULL);
+  nub_loop_unlock(thread);
+
+  nub_thread_dispose(thread, NULL);
+}
+
+
+static void run_tcp_lock(const char* name,
+                         int nlockers,
+                         unsigned int pause_ms,
+                         unsigned int budget_us) {
+  nub_loop_t loop;
+  struct sockaddr_in addr;
+  struct sockaddr_storage bound;
+  uv_connect_t* req;
+  uint64_t* samples;
+  size_t nsamples;
+  char buf[128];
+  int namelen;
+  int i;
+
+  stop = 0;
+  lock_pause_ms = pause_ms;
+  nrtts = 0;
+  echoes_left = ECHOES;
+  clients_left = CLIENTS;
+  memset(message, 'x', sizeof(message));
+
+  nub_loop_init(&loop);
+  ASSERT(0 == nub_loop_configure(&loop, NUB_LOOP_BUDGET_TIME, budget_us));
+
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", 0, &addr));
+  ASSERT(0 == uv_tcp_init(&loop.uvloop, &server));
+  ASSERT(0 == uv_tcp_bind(&server, (const struct sockaddr*) &addr, 0));
+  ASSERT(0 == uv_listen((uv_stream_t*) &server, CLIENTS, connection_cb));
+  namelen = sizeof(bound);
+  ASSERT(0 == uv_tcp_getsockname(&server, (struct sockaddr*) &bound, &namelen));
+
+  for (i = 0; i < CLIENTS; i++) {
+    req = (uv_connect_t*) malloc(sizeof(*req));
+    ASSERT(NULL != req);
+    ASSERT(0 == uv_tcp_init(&loop.uvloop, &clients[i].handle));
+    clients[i].handle.data = &clients[i];
+    ASSERT(0 == uv_tcp_connect(req,
+                               &clients[i].handle,
+                               (const struct sockaddr*) &bound,
+                               connect_cb));
+  }
+
+  for (i = 0; i < nlockers; i++) {
+    lockers[i].nsamples = 0;
+    nub_work_init(&lockers[i].work, locker_cb, &lockers[i]);
+    ASSERT(0 == nub_thread_create(&loop, &lockers[i].thread));
+    nub_thread_enqueue(&lockers[i].thread, &lockers[i].work);
+  }
+
+  ASSERT(0 == nub_loop_run(&loop, UV_RUN_DEFAULT));
+  ASSERT(ECHOES == nrtts);
+
+  sprintf(buf, "%s/rtt", name);
+  report_histogram(buf, rtts, nrtts);
+
+  if (0 < nlockers) {
+    nsamples = 0;
+    for (i = 0; i < nlockers; i++)
+      nsamples += lockers[i].nsamples;
+    samples = (uint64_t*) malloc(sizeof(*samples) * nsamples);
+    ASSERT(NULL != samples);
+    nsamples = 0;
+    for (i = 0; i < nlockers; i++) {
+      memcpy(samples + nsamples,
+             lockers[i].samples,
+             sizeof(*samples) * lockers[i].nsamples);
+      nsamples += lockers[i].nsamples;
+    }
+    sprintf(buf, "%s/lock", name);
+    report_histogram(buf, samples, nsamples);
+    free(samples);
+  }
+
+  nub_loop_dispose(&loop);
+}
+
+
+/* Baseline echo round trips with nothing else touching the loop. */
+BENCHMARK_IMPL(tcp_echo) {
+  run_tcp_lock("tcp_echo", 0, 0, 0);
+  return 0;
+}
+
+
+BENCHMARK_IMPL(tcp_echo_lock) {
+  run_tcp_lock("tcp_echo_lock", LOCK_THREADS, LOCK_PAUSE_MS, 0);
+  return 0;
+}
+
+
+/* Lock threads that never pause, kept from starving the echoes by the loop's
+ * per-iteration budget. */
+BENCHMARK_IMPL(tcp_echo_flood) {
+  run_tcp_lock("tcp_echo_flood", LOCK_THREADS, 0, FLOOD_BUDGET_US);
+  return 0;
+}
@@ -0,0 +1,78 @@
+#include "nub.h"
+#include "run-benchmarks.h"
+#include "helper.h"
+#include "uv.h"
+
+#include <stdio.h>  /* sprintf */
+#include <string.h>  /* memset */
+
+#define THREADS 256
+#define SMALL_STACK (64 * 1024)
+
+static nub_thread_t threads[THREADS];
+static nub_work_t works[THREADS];
+static uv_sem_t started;
+static uv_sem_t release;
+
+
+/* Runs from the spawned thread. Holds the thread up until the measurement has
+ * been taken. */
+static void park_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  uv_sem_post(&started);
+  uv_sem_wait(&release);
+  nub_thread_dispose(thread, NULL);
+}
+
+
+static void run_thread_rss(const char* name,
+                           const nub_thread_options_t* options) {
+  nub_loop_t loop;
+  size_t before;
+  size_t after;
+  char buf[128];
+  int i;
+
+  ASSERT(0 == uv_sem_init(&started, 0));
+  ASSERT(0 == uv_sem_init(&release, 0));
+  nub_loop_init(&loop);
+
+  ASSERT(0 == uv_resident_set_memory(&before));
+
+  for (i = 0; i < THREADS; i++) {
+    ASSERT(0 == nub_thread_create_ex(&loop, &threads[i], options));
+    nub_work_init(&works[i], park_cb, NULL);
+    nub_thread_enqueue(&threads[i], &works[i]);
+  }
+  for (i = 0; i < THREADS; i++)
+    uv_sem_wait(&started);
+
+  ASSERT(0 == uv_resident_set_memory(&after));
+
+  for (i = 0; i < THREADS; i++)
+    uv_sem_post(&release);
+  ASSERT(0 == nub_loop_run(&loop, UV_RUN_DEFAULT));
+  nub_loop_dispose(&loop);
+  uv_sem_destroy(&started);
+  uv_sem_destroy(&release);
+
+  sprintf(buf, "%s/rss_per_thread", name);
+  bench_report(buf, "KiB", (double) (after - before) / THREADS / 1024);
+}
+
+
+/* Threads spawned with the default attributes. */
+BENCHMARK_IMPL(thread_rss) {
+  run_thread_rss("thread_rss", NULL);
+  return 0;
+}
+
+
+BENCHMARK_IMPL(thread_rss_small_stack) {
+  nub_thread_options_t options;
+
+  memset(&options, 0, sizeof(options));
+  options.flags = NUB_THREAD_HAS_STACK_SIZE;
+  options.stack_size = SMALL_STACK;
+  run_thread_rss("thread_rss_small_stack", &options);
+  return 0;
+}
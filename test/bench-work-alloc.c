@@ -0,0 +1,69 @@
+#include "nub.h"
+#include "run-benchmarks.h"
+#include "helper.h"
+#include "uv.h"
+
+#include <stdlib.h>  /* malloc, free */
+
+#define ITER 1000000
+
+static int use_slab;
+static unsigned int ran;
+
+
+/* Runs from the spawned thread. Frees an item allocated on the main thread. */
+static void request_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  if (use_slab)
+    nub_thread_work_free(thread, work);
+  else
+    free(work);
+  if (ITER == ++ran)
+    nub_thread_dispose(thread, NULL);
+}
+
+
+static void run_work_alloc(const char* name, int slab) {
+  nub_loop_t loop;
+  nub_thread_t thread;
+  nub_work_t* work;
+  uint64_t time;
+  unsigned int i;
+
+  use_slab = slab;
+  ran = 0;
+  nub_loop_init(&loop);
+  ASSERT(0 == nub_thread_create(&loop, &thread));
+
+  time = uv_hrtime();
+
+  /* One item per request, as a server handing out requests would. */
+  for (i = 0; i < ITER; i++) {
+    if (use_slab)
+      work = nub_loop_work_alloc(&loop);
+    else
+      work = (nub_work_t*) malloc(sizeof(*work));
+    ASSERT(NULL != work);
+    nub_work_init(work, request_cb, NULL);
+    nub_thread_enqueue(&thread, work);
+  }
+
+  ASSERT(0 == nub_loop_run(&loop, UV_RUN_DEFAULT));
+  ASSERT(ITER == ran);
+
+  time = uv_hrtime() - time;
+  bench_report(name, "ops/sec", ITER / (time / 1e9));
+
+  nub_loop_dispose(&loop);
+}
+
+
+BENCHMARK_IMPL(work_malloc) {
+  run_work_alloc("work_malloc", 0);
+  return 0;
+}
+
+
+BENCHMARK_IMPL(work_slab) {
+  run_work_alloc("work_slab", 1);
+  return 0;
+}
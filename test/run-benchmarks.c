@@ -1,12 +1,375 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE  /* CPU_SET, sched_setaffinity */
+#endif
+
 #include "run-benchmarks.h"
 #include "uv.h"
 
+#include <stdio.h>  /* fprintf, fopen, fclose */
+#include <stdlib.h>  /* atoi, malloc, realloc, free, qsort, strtol */
+#include <string.h>  /* strcmp, strlen, memcpy */
+
+#if defined(__linux__)
+# include <sched.h>  /* sched_setaffinity */
+#endif
+
+#define BENCHMARK_ENTRY(name) { #name, run_bench_##name },
+
+typedef struct {
+  const char* name;
+  int (*run)(void);
+} bench_entry;
+
+typedef struct {
+  char* name;
+  const char* unit;
+  double* samples;
+  unsigned int count;
+  unsigned int size;
+} bench_result;
+
+static bench_entry benchmarks[] = {
+  BENCHMARK_ENTRY(oscillate)
+  BENCHMARK_ENTRY(oscillate_lock_spin)
+  BENCHMARK_ENTRY(oscillate_multi)
+  BENCHMARK_ENTRY(oscillate_multi_handoff)
+  BENCHMARK_ENTRY(enqueue_work)
+  BENCHMARK_ENTRY(enqueue_work_spin)
+  BENCHMARK_ENTRY(enqueue_work_batch)
+  BENCHMARK_ENTRY(enqueue_work_defer)
+  BENCHMARK_ENTRY(pool_imbalanced_threads)
+  BENCHMARK_ENTRY(pool_imbalanced)
+  BENCHMARK_ENTRY(loop_enqueue_contention)
+  BENCHMARK_ENTRY(tcp_echo)
+  BENCHMARK_ENTRY(tcp_echo_lock)
+  BENCHMARK_ENTRY(tcp_echo_flood)
+  BENCHMARK_ENTRY(thread_rss)
+  BENCHMARK_ENTRY(thread_rss_small_stack)
+  BENCHMARK_ENTRY(work_malloc)
+  BENCHMARK_ENTRY(work_slab)
+  BENCHMARK_ENTRY(fiber_lock)
+  BENCHMARK_ENTRY(fiber_loop_run)
+  BENCHMARK_ENTRY(post_c)
+  BENCHMARK_ENTRY(post_lambda)
+  BENCHMARK_ENTRY(post_lambda_heap)
+  BENCHMARK_ENTRY(timer_lock)
+  BENCHMARK_ENTRY(timer_call)
+  BENCHMARK_ENTRY(http_group_1)
+  BENCHMARK_ENTRY(http_group_2)
+  BENCHMARK_ENTRY(http_group_4)
+  BENCHMARK_ENTRY(overload_unbounded)
+  BENCHMARK_ENTRY(overload_bounded)
+  BENCHMARK_ENTRY(overload_deadline)
+};
+
+#define BENCHMARK_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static bench_result* results;
+static unsigned int results_count;
+static unsigned int results_size;
+/* Set while running warmup rounds, whose results are thrown away. */
+static int warming_up;
+
+
+static bench_result* find_result(const char* name, const char* unit) {
+  bench_result* result;
+  unsigned int i;
+
+  for (i = 0; i < results_count; i++) {
+    if (0 == strcmp(results[i].name, name))
+      return &results[i];
+  }
+
+  if (results_count == results_size) {
+    results_size = 0 == results_size ? 16 : results_size * 2;
+    results = (bench_result*) realloc(results, sizeof(*results) * results_size);
+    if (NULL == results)
+      abort();
+  }
+
+  result = &results[results_count++];
+  result->name = (char*) malloc(strlen(name) + 1);
+  if (NULL == result->name)
+    abort();
+  memcpy(result->name, name, strlen(name) + 1);
+  result->unit = unit;
+  result->samples = NULL;
+  result->count = 0;
+  result->size = 0;
+
+  return result;
+}
+
+
+void bench_report(const char* name, const char* unit, double value) {
+  bench_result* result;
+
+  if (warming_up)
+    return;
+
+  result = find_result(name, unit);
+  if (result->count == result->size) {
+    result->size = 0 == result->size ? 8 : result->size * 2;
+    result->samples = (double*) realloc(result->samples,
+                                        sizeof(double) * result->size);
+    if (NULL == result->samples)
+      abort();
+  }
+  result->samples[result->count++] = value;
+}
+
+
+static int cmp_double(const void* a, const void* b) {
+  double da = *(const double*) a;
+  double db = *(const double*) b;
+  return da < db ? -1 : da > db;
+}
+
+
+static void summarize(bench_result* result,
+                      double* min,
+                      double* median,
+                      double* p99,
+                      double* max) {
+  double* s;
+  unsigned int n;
+  unsigned int rank;
+
+  s = result->samples;
+  n = result->count;
+  qsort(s, n, sizeof(*s), cmp_double);
+
+  *min = s[0];
+  *max = s[n - 1];
+  *median = 1 == n % 2 ? s[n / 2] : (s[n / 2 - 1] + s[n / 2]) / 2;
+  /* Nearest rank. */
+  rank = (n * 99 + 99) / 100;
+  *p99 = s[rank - 1];
+}
+
+
+static void print_results(void) {
+  double min, median, p99, max;
+  unsigned int i;
+
+  for (i = 0; i < results_count; i++) {
+    summarize(&results[i], &min, &median, &p99, &max);
+    if (1 == results[i].count) {
+      fprintf(stderr, "%s: %f %s\n", results[i].name, median, results[i].unit);
+      continue;
+    }
+    fprintf(stderr,
+            "%s: median %f %s (min %f, p99 %f, max %f, %u runs)\n",
+            results[i].name,
+            median,
+            results[i].unit,
+            min,
+            p99,
+            max,
+            results[i].count);
+  }
+}
+
+
+static int write_json(const char* path,
+                      int warmup,
+                      int reps,
+                      const char* cpus) {
+  double min, median, p99, max;
+  unsigned int i;
+  unsigned int n;
+  FILE* fp;
+
+  fp = 0 == strcmp(path, "-") ? stdout : fopen(path, "w");
+  if (NULL == fp) {
+    fprintf(stderr, "Can't open %s\n", path);
+    return 1;
+  }
+
+  fprintf(fp,
+          "{\n  \"warmup\": %d,\n  \"reps\": %d,\n  \"cpus\": \"%s\",\n"
+          "  \"results\": [",
+          warmup,
+          reps,
+          NULL == cpus ? "" : cpus);
+
+  for (i = 0; i < results_count; i++) {
+    summarize(&results[i], &min, &median, &p99, &max);
+    fprintf(fp,
+            "%s\n    {\"name\": \"%s\", \"unit\": \"%s\", \"min\": %f, "
+            "\"median\": %f, \"p99\": %f, \"max\": %f, \"samples\": [",
+            0 == i ? "" : ",",
+            results[i].name,
+            results[i].unit,
+            min,
+            median,
+            p99,
+            max);
+    for (n = 0; n < results[i].count; n++)
+      fprintf(fp, "%s%f", 0 == n ? "" : ", ", results[i].samples[n]);
+    fputs("]}", fp);
+  }
+
+  fputs("\n  ]\n}\n", fp);
+
+  if (stdout != fp)
+    fclose(fp);
+
+  return 0;
+}
+
+
+/* Takes a list like "0,2-3". */
+static int pin_cpus(const char* list) {
+#if defined(__linux__)
+  cpu_set_t set;
+  const char* p;
+  char* end;
+  long first;
+  long last;
+
+  CPU_ZERO(&set);
+
+  for (p = list; '\0' != *p; p = end) {
+    first = strtol(p, &end, 10);
+    if (end == p || first < 0)
+      return 1;
+    last = first;
+    if ('-' == *end) {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first)
+        return 1;
+    }
+    for (; first <= last; first++)
+      CPU_SET(first, &set);
+    if (',' == *end)
+      end++;
+    else if ('\0' != *end)
+      return 1;
+  }
+
+  /* Threads created afterwards inherit the mask. */
+  return 0 != sched_setaffinity(0, sizeof(set), &set);
+#else
+  fprintf(stderr, "CPU pinning isn't supported on this platform\n");
+  return 1;
+#endif
+}
+
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+          "Usage: %s [options] [benchmark...]\n"
+          "\n"
+          "  -l, --list         List benchmarks and exit\n"
+          "  -w, --warmup N     Runs of each benchmark to throw away first\n"
+          "  -r, --reps N       Runs of each benchmark to report on\n"
+          "  -c, --cpus LIST    Pin all threads to CPUs, e.g. 0,2-3\n"
+          "  -j, --json FILE    Write results as JSON, - for stdout\n",
+          prog);
+}
+
+
+static int is_opt(const char* arg, const char* s, const char* l) {
+  return 0 == strcmp(arg, s) || 0 == strcmp(arg, l);
+}
+
+
 int main(int argc, char **argv) {
+  const char* json;
+  const char* cpus;
+  char** selected;
+  int nselected;
+  int warmup;
+  int reps;
+  int i;
+  int n;
+  unsigned int b;
+
   argv = uv_setup_args(argc, argv);
 
-  run_bench_oscillate();
-  run_bench_oscillate_multi();
-  run_bench_enqueue_work();
+  json = NULL;
+  cpus = NULL;
+  warmup = 0;
+  reps = 1;
+  selected = (char**) malloc(sizeof(*selected) * argc);
+  nselected = 0;
+  if (NULL == selected)
+    abort();
+
+  for (i = 1; i < argc; i++) {
+    if (is_opt(argv[i], "-l", "--list")) {
+      for (b = 0; b < BENCHMARK_COUNT; b++)
+        printf("%s\n", benchmarks[b].name);
+      return 0;
+    } else if (is_opt(argv[i], "-h", "--help")) {
+      usage(argv[0]);
+      return 0;
+    } else if (i + 1 < argc && is_opt(argv[i], "-w", "--warmup")) {
+      warmup = atoi(argv[++i]);
+    } else if (i + 1 < argc && is_opt(argv[i], "-r", "--reps")) {
+      reps = atoi(argv[++i]);
+    } else if (i + 1 < argc && is_opt(argv[i], "-c", "--cpus")) {
+      cpus = argv[++i];
+    } else if (i + 1 < argc && is_opt(argv[i], "-j", "--json")) {
+      json = argv[++i];
+    } else if ('-' == argv[i][0]) {
+      usage(argv[0]);
+      return 1;
+    } else {
+      selected[nselected++] = argv[i];
+    }
+  }
+
+  if (warmup < 0 || reps < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  for (i = 0; i < nselected; i++) {
+    for (b = 0; b < BENCHMARK_COUNT; b++) {
+      if (0 == strcmp(selected[i], benchmarks[b].name))
+        break;
+    }
+    if (BENCHMARK_COUNT == b) {
+      fprintf(stderr, "Unknown benchmark: %s\n", selected[i]);
+      return 1;
+    }
+  }
+
+  if (NULL != cpus && 0 != pin_cpus(cpus)) {
+    fprintf(stderr, "Can't pin to CPUs: %s\n", cpus);
+    return 1;
+  }
+
+  for (b = 0; b < BENCHMARK_COUNT; b++) {
+    for (i = 0; i < nselected; i++) {
+      if (0 == strcmp(selected[i], benchmarks[b].name))
+        break;
+    }
+    if (0 < nselected && nselected == i)
+      continue;
+
+    warming_up = 1;
+    for (n = 0; n < warmup; n++)
+      benchmarks[b].run();
+    warming_up = 0;
+    for (n = 0; n < reps; n++)
+      benchmarks[b].run();
+  }
+
+  print_results();
+
+  if (NULL != json && 0 != write_json(json, warmup, reps, cpus))
+    return 1;
+
+  for (b = 0; b < results_count; b++) {
+    free(results[b].name);
+    free(results[b].samples);
+  }
+  free(results);
+  free(selected);
 
   return 0;
 }
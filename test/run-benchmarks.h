@@ -1,3 +1,35 @@
 int run_bench_oscillate(void);
+int run_bench_oscillate_lock_spin(void);
 int run_bench_oscillate_multi(void);
+int run_bench_oscillate_multi_handoff(void);
 int run_bench_enqueue_work(void);
+int run_bench_enqueue_work_spin(void);
+int run_bench_enqueue_work_batch(void);
+int run_bench_enqueue_work_defer(void);
+int run_bench_pool_imbalanced_threads(void);
+int run_bench_pool_imbalanced(void);
+int run_bench_loop_enqueue_contention(void);
+int run_bench_tcp_echo(void);
+int run_bench_tcp_echo_lock(void);
+int run_bench_tcp_echo_flood(void);
+int run_bench_thread_rss(void);
+int run_bench_thread_rss_small_stack(void);
+int run_bench_work_malloc(void);
+int run_bench_work_slab(void);
+int run_bench_fiber_lock(void);
+int run_bench_fiber_loop_run(void);
+int run_bench_post_c(void);
+int run_bench_post_lambda(void);
+int run_bench_post_lambda_heap(void);
+int run_bench_timer_lock(void);
+int run_bench_timer_call(void);
+int run_bench_http_group_1(void);
+int run_bench_http_group_2(void);
+int run_bench_http_group_4(void);
+int run_bench_overload_unbounded(void);
+int run_bench_overload_bounded(void);
+int run_bench_overload_deadline(void);
+
+/* Record one measurement from the running benchmark. Measurements with the
+ * same name from repeated runs are summarized together. */
+void bench_report(const char* name, const char* unit, double value);
@@ -8,6 +8,36 @@ int main(int argc, char **argv) {
   run_test_multi_timer_single_thread();
   run_test_single_timer_multi_thread();
   run_test_multi_timer_multi_thread();
+  run_test_loop_enqueue_complete();
+  run_test_loop_enqueue_prio();
+  run_test_loop_enqueue_prio_aging();
+  run_test_loop_call();
+  run_test_loop_budget_items();
+  run_test_loop_budget_time_handoff();
+  run_test_loop_budget_fair();
+  run_test_loop_group_migrate();
+  run_test_loop_group_listen();
+  run_test_thread_enqueue_deferred();
+  run_test_thread_enqueue_prio();
+  run_test_thread_enqueue_prio_aging();
+  run_test_thread_enqueue_after();
+  run_test_thread_send();
+  run_test_thread_create_ex();
+  run_test_thread_own_loop();
+  run_test_thread_own_loop_join();
+  run_test_thread_limit();
+  run_test_work_deadline();
+  run_test_work_alloc();
+  run_test_pool_enqueue();
+  run_test_pool_shrink();
+  run_test_loop_lock_exclusive();
+  run_test_loop_lock_handoff();
+  run_test_loop_lock_shared();
+  run_test_loop_lock_timeout();
+  run_test_fiber_lock();
+  run_test_fiber_lock_ahead();
+  run_test_stats();
+  run_test_trace_dump();
 
   return 0;
 }
@@ -2,3 +2,33 @@ int run_test_single_timer_single_thread(void);
 int run_test_multi_timer_single_thread(void);
 int run_test_single_timer_multi_thread(void);
 int run_test_multi_timer_multi_thread(void);
+int run_test_loop_enqueue_complete(void);
+int run_test_loop_call(void);
+int run_test_loop_budget_items(void);
+int run_test_loop_budget_time_handoff(void);
+int run_test_loop_budget_fair(void);
+int run_test_loop_group_migrate(void);
+int run_test_loop_group_listen(void);
+int run_test_pool_enqueue(void);
+int run_test_pool_shrink(void);
+int run_test_loop_lock_exclusive(void);
+int run_test_loop_lock_handoff(void);
+int run_test_loop_lock_shared(void);
+int run_test_thread_enqueue_deferred(void);
+int run_test_thread_send(void);
+int run_test_thread_enqueue_after(void);
+int run_test_thread_enqueue_prio(void);
+int run_test_thread_enqueue_prio_aging(void);
+int run_test_loop_enqueue_prio(void);
+int run_test_loop_enqueue_prio_aging(void);
+int run_test_thread_create_ex(void);
+int run_test_thread_own_loop(void);
+int run_test_thread_own_loop_join(void);
+int run_test_thread_limit(void);
+int run_test_work_deadline(void);
+int run_test_work_alloc(void);
+int run_test_loop_lock_timeout(void);
+int run_test_fiber_lock(void);
+int run_test_fiber_lock_ahead(void);
+int run_test_stats(void);
+int run_test_trace_dump(void);
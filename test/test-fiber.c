@@ -0,0 +1,218 @@
+#include "nub.h"
+#include "run-tests.h"
+#include "helper.h"
+#include "uv.h"
+
+#define THREADS 2
+#define FIBERS 32
+#define ROUNDS 20
+
+struct host_s {
+  nub_thread_t thread;
+  nub_work_t start;
+  nub_fiber_t fibers[FIBERS];
+  int started;
+  int done;
+};
+
+static struct host_s hosts[THREADS];
+static int holders;
+static int locked;
+static int loop_ran;
+
+
+/* Runs from the event loop thread. */
+static void loop_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  loop_ran++;
+}
+
+
+/* Runs from a fiber. */
+static void fiber_cb(nub_fiber_t* fiber) {
+  struct host_s* host;
+  int i;
+
+  host = (struct host_s*) fiber->data;
+  host->started++;
+
+  for (i = 0; i < ROUNDS; i++) {
+    ASSERT(0 == nub_fiber_lock(fiber));
+    /* Every fiber got as far as its first lock before any was let in. */
+    ASSERT(FIBERS == host->started);
+    ASSERT(0 == holders++);
+    locked++;
+    holders--;
+    nub_fiber_unlock(fiber);
+
+    nub_fiber_yield(fiber);
+
+    ASSERT(0 == nub_fiber_loop_run(fiber, loop_cb, NULL));
+  }
+}
+
+
+/* Runs from the spawned thread. */
+static void done_cb(nub_fiber_t* fiber) {
+  struct host_s* host;
+
+  host = (struct host_s*) fiber->data;
+  if (FIBERS == ++host->done)
+    nub_thread_dispose(fiber->thread, NULL);
+}
+
+
+/* Runs from the spawned thread. */
+static void start_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  struct host_s* host;
+  int i;
+
+  host = (struct host_s*) arg;
+  for (i = 0; i < FIBERS; i++) {
+    host->fibers[i].data = host;
+    /* 0 picks the default stack size. */
+    ASSERT(0 == nub_fiber_create(thread,
+                                 &host->fibers[i],
+                                 0 == i % 2 ? 0 : 32 * 1024,
+                                 fiber_cb,
+                                 done_cb));
+  }
+}
+
+
+TEST_IMPL(fiber_lock) {
+  nub_loop_t loop;
+  int i;
+
+  holders = 0;
+  locked = 0;
+  loop_ran = 0;
+  nub_loop_init(&loop);
+
+  for (i = 0; i < THREADS; i++) {
+    hosts[i].started = 0;
+    hosts[i].done = 0;
+    ASSERT(0 == nub_thread_create(&loop, &hosts[i].thread));
+    nub_work_init(&hosts[i].start, start_cb, &hosts[i]);
+    nub_thread_enqueue(&hosts[i].thread, &hosts[i].start);
+  }
+
+  ASSERT(0 == nub_loop_run(&loop, UV_RUN_DEFAULT));
+
+  for (i = 0; i < THREADS; i++) {
+    ASSERT(FIBERS == hosts[i].started);
+    ASSERT(FIBERS == hosts[i].done);
+  }
+  ASSERT(THREADS * FIBERS * ROUNDS == locked);
+  ASSERT(THREADS * FIBERS * ROUNDS == loop_ran);
+
+  nub_loop_dispose(&loop);
+
+  return 0;
+}
+
+
+/*** Test a granted fiber going ahead of queued work ***/
+
+#define QUEUED 100
+
+static nub_thread_t host_thread;
+static nub_thread_t holder_thread;
+static nub_work_t host_start;
+static nub_work_t holder_start;
+static nub_work_t queued[QUEUED];
+static nub_fiber_t ahead_fiber;
+static uv_sem_t holding;
+static uv_sem_t requested;
+static int queued_ran;
+static int ran_at_lock;
+static int ahead_left;
+
+
+/* Runs from the host thread. */
+static void ahead_done(nub_thread_t* thread) {
+  if (0 == --ahead_left)
+    nub_thread_dispose(thread, NULL);
+}
+
+
+/* Runs from the host thread. */
+static void queued_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  uv_sleep(1);
+  if (QUEUED == ++queued_ran)
+    ahead_done(thread);
+}
+
+
+/* Runs from a fiber on the host thread. */
+static void ahead_fiber_cb(nub_fiber_t* fiber) {
+  uv_sem_post(&requested);
+  ASSERT(0 == nub_fiber_lock(fiber));
+  ran_at_lock = queued_ran;
+  nub_fiber_unlock(fiber);
+}
+
+
+/* Runs from the host thread. */
+static void ahead_fiber_done_cb(nub_fiber_t* fiber) {
+  ahead_done(fiber->thread);
+}
+
+
+/* Runs from the host thread. */
+static void host_start_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  uv_sem_wait(&holding);
+  ASSERT(0 == nub_fiber_create(thread,
+                               &ahead_fiber,
+                               0,
+                               ahead_fiber_cb,
+                               ahead_fiber_done_cb));
+}
+
+
+/* Runs from the holder thread. Queues work on the host once its fiber is
+ * waiting for the loop, and only then lets the loop go. */
+static void holder_start_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  int i;
+
+  ASSERT(0 == nub_loop_lock(thread));
+  uv_sem_post(&holding);
+  uv_sem_wait(&requested);
+  for (i = 0; i < QUEUED; i++) {
+    nub_work_init(&queued[i], queued_cb, NULL);
+    ASSERT(0 == nub_thread_enqueue(&host_thread, &queued[i]));
+  }
+  nub_loop_unlock(thread);
+  nub_thread_dispose(thread, NULL);
+}
+
+
+TEST_IMPL(fiber_lock_ahead) {
+  nub_loop_t loop;
+
+  queued_ran = 0;
+  ran_at_lock = -1;
+  ahead_left = 2;
+  ASSERT(0 == uv_sem_init(&holding, 0));
+  ASSERT(0 == uv_sem_init(&requested, 0));
+  nub_loop_init(&loop);
+  ASSERT(0 == nub_thread_create(&loop, &host_thread));
+  ASSERT(0 == nub_thread_create(&loop, &holder_thread));
+
+  nub_work_init(&host_start, host_start_cb, NULL);
+  ASSERT(0 == nub_thread_enqueue(&host_thread, &host_start));
+  nub_work_init(&holder_start, holder_start_cb, NULL);
+  ASSERT(0 == nub_thread_enqueue(&holder_thread, &holder_start));
+
+  ASSERT(0 == nub_loop_run(&loop, UV_RUN_DEFAULT));
+
+  ASSERT(QUEUED == queued_ran);
+  ASSERT(0 <= ran_at_lock);
+  /* Not left waiting for everything queued before the loop was let go. */
+  ASSERT(QUEUED > ran_at_lock);
+
+  nub_loop_dispose(&loop);
+  uv_sem_destroy(&holding);
+  uv_sem_destroy(&requested);
+
+  return 0;
+}
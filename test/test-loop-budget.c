@@ -0,0 +1,325 @@
+#include "nub.h"
+#include "run-tests.h"
+#include "helper.h"
+#include "uv.h"
+
+#define THREADS 4
+#define ROUNDS 100
+
+static nub_thread_t threads[THREADS];
+static nub_work_t works[THREADS];
+static uv_tcp_t server;
+static uv_tcp_t conn;
+static uv_tcp_t client;
+static uv_connect_t connect_req;
+static char buf[64];
+static struct sockaddr_storage bound;
+static volatile int stop;
+static int flooding;
+static int rounds;
+
+
+static void connect_cb(uv_connect_t* req, int status);
+
+
+/* Runs from the spawned thread. Asks for the loop back the moment it's given
+ * up, so there's always a thread waiting. */
+static void flood_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  ASSERT(0 == nub_loop_lock(thread));
+  /* Only start talking once every thread is in on the flood. */
+  if (THREADS == ++flooding) {
+    ASSERT(0 == uv_tcp_init(&thread->nubloop->uvloop, &client));
+    ASSERT(0 == uv_tcp_connect(&connect_req,
+                               &client,
+                               (const struct sockaddr*) &bound,
+                               connect_cb));
+  }
+  nub_loop_unlock(thread);
+
+  while (0 == stop) {
+    ASSERT(0 == nub_loop_lock(thread));
+    nub_loop_unlock(thread);
+  }
+  nub_thread_dispose(thread, NULL);
+}
+
+
+static void alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* b) {
+  b->base = buf;
+  b->len = sizeof(buf);
+}
+
+
+static void send_byte(uv_tcp_t* handle) {
+  uv_buf_t b;
+
+  b = uv_buf_init("x", 1);
+  ASSERT(1 == uv_try_write((uv_stream_t*) handle, &b, 1));
+}
+
+
+/* Runs from the main thread. */
+static void echo_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* b) {
+  if (UV_EOF == nread) {
+    uv_close((uv_handle_t*) stream, NULL);
+    return;
+  }
+  ASSERT(1 == nread);
+  send_byte((uv_tcp_t*) stream);
+}
+
+
+/* Runs from the main thread. Only gets here if the loop still polls. */
+static void client_read_cb(uv_stream_t* stream,
+                           ssize_t nread,
+                           const uv_buf_t* b) {
+  ASSERT(1 == nread);
+  if (++rounds < ROUNDS) {
+    send_byte((uv_tcp_t*) stream);
+    return;
+  }
+  stop = 1;
+  uv_close((uv_handle_t*) stream, NULL);
+}
+
+
+/* Runs from the main thread. */
+static void connection_cb(uv_stream_t* s, int status) {
+  ASSERT(0 == status);
+  ASSERT(0 == uv_tcp_init(s->loop, &conn));
+  ASSERT(0 == uv_accept(s, (uv_stream_t*) &conn));
+  ASSERT(0 == uv_read_start((uv_stream_t*) &conn, alloc_cb, echo_cb));
+  uv_close((uv_handle_t*) s, NULL);
+}
+
+
+/* Runs from the main thread. */
+static void connect_cb(uv_connect_t* req, int status) {
+  ASSERT(0 == status);
+  ASSERT(0 == uv_read_start(req->handle, alloc_cb, client_read_cb));
+  send_byte((uv_tcp_t*) req->handle);
+}
+
+
+static void run_flood(nub_loop_option option, unsigned int value, int handoff) {
+  nub_loop_t loop;
+  nub_loop_stats_t stats;
+  struct sockaddr_in addr;
+  int len;
+  int i;
+
+  stop = 0;
+  flooding = 0;
+  rounds = 0;
+  nub_loop_init(&loop);
+  ASSERT(0 == nub_loop_configure(&loop, option, value));
+  ASSERT(0 == nub_loop_configure(&loop, NUB_LOOP_LOCK_HANDOFF, handoff));
+
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", 0, &addr));
+  ASSERT(0 == uv_tcp_init(&loop.uvloop, &server));
+  ASSERT(0 == uv_tcp_bind(&server, (const struct sockaddr*) &addr, 0));
+  ASSERT(0 == uv_listen((uv_stream_t*) &server, 1, connection_cb));
+  len = sizeof(bound);
+  ASSERT(0 == uv_tcp_getsockname(&server, (struct sockaddr*) &bound, &len));
+
+  for (i = 0; i < THREADS; i++) {
+    ASSERT(0 == nub_thread_create(&loop, &threads[i]));
+    nub_work_init(&works[i], flood_cb, NULL);
+    ASSERT(0 == nub_thread_enqueue(&threads[i], &works[i]));
+  }
+
+  ASSERT(0 == nub_loop_run(&loop, UV_RUN_DEFAULT));
+  ASSERT(ROUNDS == rounds);
+
+  nub_loop_stats(&loop, &stats);
+  ASSERT(0 < stats.budget_spent);
+  ASSERT(0 < stats.lock_grants);
+
+  nub_loop_dispose(&loop);
+}
+
+
+TEST_IMPL(loop_budget_items) {
+  run_flood(NUB_LOOP_BUDGET_ITEMS, 16, 0);
+  return 0;
+}
+
+
+TEST_IMPL(loop_budget_time_handoff) {
+  run_flood(NUB_LOOP_BUDGET_TIME, 200, 1);
+  return 0;
+}
+
+
+/*** Test that nothing is left behind by a steady stream of loop work ***/
+
+#define FLOWING 4096
+#define FAIR_ROUNDS 20
+#define FAIR_BUDGET 8
+#define FLOOD_LIMIT 200000
+#define FLOWING_NS 5000
+
+static nub_thread_t flooder;
+static nub_thread_t waiter;
+static nub_thread_t second;
+static nub_work_t flooder_start;
+static nub_work_t waiter_start;
+static nub_work_t second_start;
+static nub_work_t flowing[FLOWING];
+static nub_work_t low_work;
+static nub_work_t second_work;
+static volatile int flood_stop;
+static int flood_ran;
+static int flood_back;
+static int locked_at;
+static int low_at;
+static int second_rounds;
+static int second_done_at;
+
+
+static void fair_check(void) {
+  if (0 <= locked_at && 0 <= low_at && 0 <= second_done_at)
+    flood_stop = 1;
+  if (FLOOD_LIMIT <= flood_ran)
+    flood_stop = 1;
+}
+
+
+/* Runs from the main thread. */
+static void flowing_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  uint64_t start;
+
+  /* Slow enough that the flooder keeps up on a single core. */
+  start = uv_hrtime();
+  while (uv_hrtime() - start < FLOWING_NS);
+  flood_ran++;
+  fair_check();
+}
+
+
+/* Runs from the flooder thread. Goes straight back to the loop, so there's
+ * always more than a budget's worth queued. */
+static void flowing_complete_cb(nub_work_t* work, int status) {
+  ASSERT(0 == status);
+  if (0 == flood_stop) {
+    nub_loop_enqueue_prio(&flooder, work, flowing_complete_cb, NUB_PRIO_HIGH);
+    return;
+  }
+  if (FLOWING == ++flood_back)
+    nub_thread_dispose(&flooder, NULL);
+}
+
+
+/* Runs from the flooder thread. */
+static void flooder_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  int i;
+
+  for (i = 0; i < FLOWING; i++) {
+    nub_work_init(&flowing[i], flowing_cb, NULL);
+    nub_loop_enqueue_prio(thread,
+                          &flowing[i],
+                          flowing_complete_cb,
+                          NUB_PRIO_HIGH);
+  }
+}
+
+
+/* Runs from the main thread. */
+static void low_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  low_at = flood_ran;
+  fair_check();
+}
+
+
+/* Runs from the waiter thread. */
+static void low_complete_cb(nub_work_t* work, int status) {
+  ASSERT(0 == status);
+  nub_thread_dispose(&waiter, NULL);
+}
+
+
+/* Runs from the waiter thread. Waits for the loop behind the flood, then
+ * queues a single low item. */
+static void waiter_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  while (0 == flood_ran)
+    uv_sleep(1);
+  ASSERT(0 == nub_loop_lock(thread));
+  locked_at = flood_ran;
+  fair_check();
+  nub_loop_unlock(thread);
+
+  nub_work_init(&low_work, low_cb, NULL);
+  nub_loop_enqueue_prio(thread, &low_work, low_complete_cb, NUB_PRIO_LOW);
+}
+
+
+/* Runs from the main thread. */
+static void second_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  if (FAIR_ROUNDS == ++second_rounds) {
+    second_done_at = flood_ran;
+    fair_check();
+  }
+}
+
+
+/* Runs from the second thread. Same class as the flood, one item at a
+ * time. */
+static void second_complete_cb(nub_work_t* work, int status) {
+  ASSERT(0 == status);
+  if (FAIR_ROUNDS == second_rounds) {
+    nub_thread_dispose(&second, NULL);
+    return;
+  }
+  nub_loop_enqueue_prio(&second, work, second_complete_cb, NUB_PRIO_HIGH);
+}
+
+
+/* Runs from the second thread. */
+static void second_start_cb(nub_thread_t* thread,
+                            nub_work_t* work,
+                            void* arg) {
+  while (0 == flood_ran)
+    uv_sleep(1);
+  nub_work_init(&second_work, second_cb, NULL);
+  nub_loop_enqueue_prio(thread,
+                        &second_work,
+                        second_complete_cb,
+                        NUB_PRIO_HIGH);
+}
+
+
+TEST_IMPL(loop_budget_fair) {
+  nub_loop_t loop;
+
+  flood_stop = 0;
+  flood_ran = 0;
+  flood_back = 0;
+  locked_at = -1;
+  low_at = -1;
+  second_rounds = 0;
+  second_done_at = -1;
+  nub_loop_init(&loop);
+  ASSERT(0 == nub_loop_configure(&loop, NUB_LOOP_BUDGET_ITEMS, FAIR_BUDGET));
+
+  ASSERT(0 == nub_thread_create(&loop, &flooder));
+  ASSERT(0 == nub_thread_create(&loop, &waiter));
+  ASSERT(0 == nub_thread_create(&loop, &second));
+  nub_work_init(&flooder_start, flooder_cb, NULL);
+  ASSERT(0 == nub_thread_enqueue(&flooder, &flooder_start));
+  nub_work_init(&waiter_start, waiter_cb, NULL);
+  ASSERT(0 == nub_thread_enqueue(&waiter, &waiter_start));
+  nub_work_init(&second_start, second_start_cb, NULL);
+  ASSERT(0 == nub_thread_enqueue(&second, &second_start));
+
+  ASSERT(0 == nub_loop_run(&loop, UV_RUN_DEFAULT));
+
+  /* All three got through while the flood was still going. */
+  ASSERT(FLOOD_LIMIT > locked_at);
+  ASSERT(FLOOD_LIMIT > low_at);
+  ASSERT(FLOOD_LIMIT > second_done_at);
+  ASSERT(FLOOD_LIMIT > flood_ran);
+
+  nub_loop_dispose(&loop);
+
+  return 0;
+}
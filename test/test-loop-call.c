@@ -0,0 +1,86 @@
+#include "nub.h"
+#include "run-tests.h"
+#include "helper.h"
+#include "uv.h"
+
+#include <stdint.h>  /* uintptr_t */
+
+#define CALLS 1000
+
+static uv_thread_t loop_thread;
+static uv_timer_t timer;
+static int timer_ran;
+static int calls;
+
+
+/* Runs from the main thread. */
+static void timer_cb(uv_timer_t* handle) {
+  timer_ran++;
+  uv_close((uv_handle_t*) handle, NULL);
+}
+
+
+/* Runs from the main thread. */
+static void* add_cb(nub_thread_t* thread, void* arg) {
+  uv_thread_t self;
+
+  self = uv_thread_self();
+  ASSERT(0 != uv_thread_equal(&loop_thread, &self));
+  calls++;
+  return (void*) ((uintptr_t) arg + 1);
+}
+
+
+/* Runs from the main thread. */
+static void* timer_start_cb(nub_thread_t* thread, void* arg) {
+  ASSERT(0 == uv_timer_init(&thread->nubloop->uvloop, &timer));
+  return (void*) (intptr_t) uv_timer_start(&timer, timer_cb, 1, 0);
+}
+
+
+/* Runs from the spawned thread. */
+static void work_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  nub_thread_stats_t stats;
+  void* result;
+  uintptr_t i;
+
+  for (i = 0; i < CALLS; i++) {
+    ASSERT(0 == nub_loop_call(thread, add_cb, (void*) i, &result));
+    ASSERT(i + 1 == (uintptr_t) result);
+  }
+  /* Doesn't need to hold on to the result. */
+  ASSERT(0 == nub_loop_call(thread, add_cb, NULL, NULL));
+
+  ASSERT(0 == nub_loop_call(thread, timer_start_cb, NULL, &result));
+  ASSERT(0 == (intptr_t) result);
+
+  nub_thread_stats(thread, &stats);
+  ASSERT(CALLS + 2 == stats.calls);
+  ASSERT(stats.call_wait_max_ns <= stats.call_wait_ns);
+
+  nub_thread_dispose(thread, NULL);
+}
+
+
+TEST_IMPL(loop_call) {
+  nub_loop_t loop;
+  nub_thread_t thread;
+  nub_work_t work;
+
+  calls = 0;
+  timer_ran = 0;
+  loop_thread = uv_thread_self();
+  nub_loop_init(&loop);
+  ASSERT(0 == nub_thread_create(&loop, &thread));
+
+  nub_work_init(&work, work_cb, NULL);
+  nub_thread_enqueue(&thread, &work);
+
+  ASSERT(0 == nub_loop_run(&loop, UV_RUN_DEFAULT));
+  ASSERT(CALLS + 1 == calls);
+  ASSERT(1 == timer_ran);
+
+  nub_loop_dispose(&loop);
+
+  return 0;
+}
@@ -0,0 +1,152 @@
+#include "nub.h"
+#include "run-tests.h"
+#include "helper.h"
+#include "uv.h"
+
+#define WORK_ITEMS 64
+
+typedef struct {
+  nub_work_t start;
+  nub_work_t items[WORK_ITEMS];
+  uv_thread_t loop_thread;
+  int run_cntr;
+  int complete_cntr;
+  int reenqueued;
+} enqueue_ctx;
+
+
+/* Runs from the main thread. */
+static void loop_work_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  enqueue_ctx* ctx = (enqueue_ctx*) arg;
+  uv_thread_t self = uv_thread_self();
+
+  ASSERT(uv_thread_equal(&self, &ctx->loop_thread));
+  ctx->run_cntr += 1;
+}
+
+
+/* Runs from the spawned thread. */
+static void complete_cb(nub_work_t* work, int status) {
+  enqueue_ctx* ctx = (enqueue_ctx*) work->data;
+  nub_thread_t* thread = (nub_thread_t*) ctx->start.data;
+  uv_thread_t self = uv_thread_self();
+
+  ASSERT(0 == status);
+  ASSERT(uv_thread_equal(&self, &thread->uvthread));
+
+  /* Returned work must be reusable from within the completion callback. */
+  if (work == &ctx->items[0] && 0 == ctx->reenqueued) {
+    ctx->reenqueued = 1;
+    nub_loop_enqueue(thread, work, complete_cb);
+    return;
+  }
+
+  if (WORK_ITEMS == ++ctx->complete_cntr)
+    nub_thread_dispose(thread, NULL);
+}
+
+
+/* Runs from the spawned thread. */
+static void start_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  enqueue_ctx* ctx = (enqueue_ctx*) arg;
+  int i;
+
+  work->data = thread;
+  for (i = 0; i < WORK_ITEMS; i++) {
+    nub_work_init(&ctx->items[i], loop_work_cb, ctx);
+    ctx->items[i].data = ctx;
+    nub_loop_enqueue(thread, &ctx->items[i], complete_cb);
+  }
+}
+
+
+TEST_IMPL(loop_enqueue_complete) {
+  nub_loop_t loop;
+  nub_thread_t thread;
+  enqueue_ctx ctx;
+
+  ctx.loop_thread = uv_thread_self();
+  ctx.run_cntr = 0;
+  ctx.complete_cntr = 0;
+  ctx.reenqueued = 0;
+  nub_work_init(&ctx.start, start_cb, &ctx);
+
+  nub_loop_init(&loop);
+  ASSERT(nub_thread_create(&loop, &thread) == 0);
+  nub_thread_enqueue(&thread, &ctx.start);
+  ASSERT(nub_loop_run(&loop, UV_RUN_DEFAULT) == 0);
+  ASSERT(WORK_ITEMS + 1 == ctx.run_cntr);
+  ASSERT(WORK_ITEMS == ctx.complete_cntr);
+  nub_loop_dispose(&loop);
+
+  return 0;
+}
+
+
+/*** Test waking threads once per loop iteration ***/
+
+static int deferred_cntr;
+
+
+/* Runs from the spawned thread. */
+static void deferred_work_cb(nub_thread_t* thread,
+                             nub_work_t* work,
+                             void* arg) {
+  if (4 == ++deferred_cntr)
+    nub_thread_dispose(thread, NULL);
+}
+
+
+/* Runs from the main thread. */
+static void deferred_timer_cb(uv_timer_t* handle) {
+  nub_thread_t* thread = (nub_thread_t*) handle->data;
+  nub_work_t** works = (nub_work_t**) thread->data;
+  nub_thread_stats_t stats;
+
+  /* Have the thread asleep so the one wake is counted. Its first park takes
+   * the post it starts out with. */
+  do {
+    uv_sleep(1);
+    nub_thread_stats(thread, &stats);
+  } while (stats.parks < 2);
+
+  /* The thread is only woken once the timer phase is finished, so the three
+   * enqueues below cost a single wake. */
+  nub_thread_enqueue_batch(thread, works, 2);
+  nub_thread_enqueue(thread, works[2]);
+  nub_thread_enqueue(thread, works[3]);
+  uv_close((uv_handle_t*) handle, NULL);
+}
+
+
+TEST_IMPL(thread_enqueue_deferred) {
+  nub_loop_t loop;
+  nub_loop_stats_t stats;
+  nub_thread_t thread;
+  nub_work_t items[4];
+  nub_work_t* works[4];
+  uv_timer_t timer;
+  int i;
+
+  deferred_cntr = 0;
+  for (i = 0; i < 4; i++) {
+    nub_work_init(&items[i], deferred_work_cb, NULL);
+    works[i] = &items[i];
+  }
+
+  nub_loop_init(&loop);
+  ASSERT(0 == nub_loop_configure(&loop, NUB_LOOP_DEFER_WAKE, 1));
+  thread.data = works;
+  ASSERT(nub_thread_create(&loop, &thread) == 0);
+  ASSERT(0 == uv_timer_init(&loop.uvloop, &timer));
+  timer.data = &thread;
+  ASSERT(0 == uv_timer_start(&timer, deferred_timer_cb, 1, 0));
+  ASSERT(nub_loop_run(&loop, UV_RUN_DEFAULT) == 0);
+  ASSERT(4 == deferred_cntr);
+  nub_loop_stats(&loop, &stats);
+  ASSERT(1 == stats.wakes);
+  ASSERT(2 == stats.wakes_coalesced);
+  nub_loop_dispose(&loop);
+
+  return 0;
+}
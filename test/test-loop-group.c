@@ -0,0 +1,184 @@
+#include "nub.h"
+#include "run-tests.h"
+#include "helper.h"
+#include "uv.h"
+
+#include <stdlib.h>  /* malloc, free */
+
+#define LOOPS 3
+#define CONNS 8
+
+static nub_loop_group_t group;
+static nub_thread_t thread;
+static nub_work_t start;
+static nub_work_t enqueued;
+static int calls;
+static int completed;
+
+
+/*** Test moving a thread between the loops of a group ***/
+
+/* Runs from the event loop thread the thread is on. */
+static void* call_cb(nub_thread_t* t, void* arg) {
+  calls++;
+  return NULL;
+}
+
+
+/* Runs from the event loop thread the thread is on. */
+static void enqueued_cb(nub_thread_t* t, nub_work_t* work, void* arg) {
+}
+
+
+/* Runs from the spawned thread. The completion came back through loops[1]. */
+static void enqueued_complete_cb(nub_work_t* work, int status) {
+  nub_thread_stats_t stats;
+
+  completed++;
+
+  ASSERT(0 == nub_thread_migrate(&thread, &group.loops[2]));
+  ASSERT(&group.loops[2] == thread.nubloop);
+  ASSERT(0 == nub_loop_call(&thread, call_cb, NULL, NULL));
+
+  nub_thread_stats(&thread, &stats);
+  ASSERT(2 == stats.migrations);
+
+  nub_loop_group_stop(&group, NULL);
+  nub_thread_dispose(&thread, NULL);
+}
+
+
+/* Runs from the spawned thread. */
+static void start_cb(nub_thread_t* t, nub_work_t* work, void* arg) {
+  /* Nothing else is on any loop, so it's already on the least loaded one. */
+  ASSERT(0 == nub_loop_group_attach(&group, t));
+  ASSERT(&group.loops[0] == t->nubloop);
+
+  ASSERT(0 == nub_thread_migrate(t, &group.loops[1]));
+  ASSERT(&group.loops[1] == t->nubloop);
+  ASSERT(0 == nub_loop_call(t, call_cb, NULL, NULL));
+
+  /* Locking goes to the new loop as well. */
+  ASSERT(0 == nub_loop_lock(t));
+  nub_loop_unlock(t);
+
+  nub_work_init(&enqueued, enqueued_cb, NULL);
+  nub_loop_enqueue(t, &enqueued, enqueued_complete_cb);
+}
+
+
+TEST_IMPL(loop_group_migrate) {
+  nub_loop_stats_t stats[LOOPS];
+  int i;
+
+  calls = 0;
+  completed = 0;
+  ASSERT(UV_EINVAL == nub_loop_group_init(&group, 0));
+  ASSERT(0 == nub_loop_group_init(&group, LOOPS));
+  ASSERT(LOOPS == group.nloops);
+
+  ASSERT(&group.loops[0] == nub_loop_group_least_loaded(&group));
+  ASSERT(0 == nub_thread_create(&group.loops[0], &thread));
+  ASSERT(&group.loops[1] == nub_loop_group_least_loaded(&group));
+
+  nub_work_init(&start, start_cb, NULL);
+  nub_thread_enqueue(&thread, &start);
+
+  ASSERT(0 == nub_loop_group_run(&group));
+  ASSERT(2 == calls);
+  ASSERT(1 == completed);
+
+  for (i = 0; i < LOOPS; i++)
+    nub_loop_stats(&group.loops[i], &stats[i]);
+  ASSERT(0 == stats[0].work_processed);
+  ASSERT(2 == stats[1].work_processed);
+  ASSERT(1 == stats[1].lock_grants);
+  ASSERT(1 == stats[2].work_processed);
+
+  nub_loop_group_dispose(&group);
+
+  return 0;
+}
+
+
+/*** Test spreading connections across the loops ***/
+
+static uv_tcp_t servers[LOOPS];
+static uv_tcp_t clients[CONNS];
+static uv_connect_t connects[CONNS];
+static volatile int accepted;
+
+
+/* Runs from each loop's own thread. */
+static void stop_cb(nub_loop_group_t* g, nub_loop_t* loop) {
+  uv_close((uv_handle_t*) &servers[loop - g->loops], NULL);
+}
+
+
+static void free_cb(uv_handle_t* handle) {
+  free(handle);
+}
+
+
+/* Runs from the thread of whichever loop the kernel picked. */
+static void connection_cb(uv_stream_t* server, int status) {
+  uv_tcp_t* conn;
+
+  ASSERT(0 == status);
+  conn = (uv_tcp_t*) malloc(sizeof(*conn));
+  ASSERT(NULL != conn);
+  ASSERT(0 == uv_tcp_init(server->loop, conn));
+  ASSERT(0 == uv_accept(server, (uv_stream_t*) conn));
+  uv_close((uv_handle_t*) conn, free_cb);
+
+  if (CONNS == __sync_add_and_fetch(&accepted, 1))
+    nub_loop_group_stop(&group, stop_cb);
+}
+
+
+/* Runs from the thread of loops[0]. */
+static void connect_cb(uv_connect_t* req, int status) {
+  ASSERT(0 == status);
+  uv_close((uv_handle_t*) req->handle, NULL);
+}
+
+
+TEST_IMPL(loop_group_listen) {
+  struct sockaddr_in addr;
+  struct sockaddr_storage bound;
+  int len;
+  int er;
+  int i;
+
+  accepted = 0;
+  ASSERT(0 == nub_loop_group_init(&group, LOOPS));
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", 0, &addr));
+
+  er = nub_loop_group_listen(&group,
+                             servers,
+                             (const struct sockaddr*) &addr,
+                             CONNS,
+                             connection_cb);
+  if (UV_ENOTSUP == er) {
+    nub_loop_group_dispose(&group);
+    return 0;
+  }
+  ASSERT(0 == er);
+
+  len = sizeof(bound);
+  ASSERT(0 == uv_tcp_getsockname(&servers[0], (struct sockaddr*) &bound, &len));
+  for (i = 0; i < CONNS; i++) {
+    ASSERT(0 == uv_tcp_init(&group.loops[0].uvloop, &clients[i]));
+    ASSERT(0 == uv_tcp_connect(&connects[i],
+                               &clients[i],
+                               (const struct sockaddr*) &bound,
+                               connect_cb));
+  }
+
+  ASSERT(0 == nub_loop_group_run(&group));
+  ASSERT(CONNS == accepted);
+
+  nub_loop_group_dispose(&group);
+
+  return 0;
+}
@@ -0,0 +1,279 @@
+#include "nub.h"
+#include "run-tests.h"
+#include "helper.h"
+#include "uv.h"
+
+#define LOCK_THREADS 4
+#define LOCK_ITER 1000
+
+typedef struct {
+  nub_thread_t thread;
+  nub_work_t work;
+} lock_thread;
+
+/* Only modified while holding the loop lock. */
+static int lock_cntr;
+static int lock_holders;
+static volatile int shared_holders;
+
+
+/* Runs from the spawned thread. */
+static void lock_loop_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  int i;
+
+  for (i = 0; i < LOCK_ITER; i++) {
+    nub_loop_lock(thread);
+    ASSERT(0 == lock_holders++);
+    lock_cntr++;
+    ASSERT(1 == lock_holders--);
+    nub_loop_unlock(thread);
+  }
+
+  nub_thread_dispose(thread, NULL);
+}
+
+
+/* Runs from the spawned thread. Odd threads only read. */
+static void lock_mixed_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  int shared = (int) (intptr_t) arg;
+  int i;
+
+  for (i = 0; i < LOCK_ITER; i++) {
+    if (shared) {
+      nub_loop_lock_shared(thread);
+      __sync_add_and_fetch(&shared_holders, 1);
+      ASSERT(0 == lock_holders);
+      __sync_sub_and_fetch(&shared_holders, 1);
+      nub_loop_unlock_shared(thread);
+    } else {
+      nub_loop_lock(thread);
+      ASSERT(0 == lock_holders++);
+      ASSERT(0 == shared_holders);
+      lock_cntr++;
+      ASSERT(1 == lock_holders--);
+      nub_loop_unlock(thread);
+    }
+  }
+
+  nub_thread_dispose(thread, NULL);
+}
+
+
+static void run_lock_threads(int handoff, nub_work_cb cb) {
+  nub_loop_t loop;
+  lock_thread threads[LOCK_THREADS];
+  int i;
+
+  lock_cntr = 0;
+  lock_holders = 0;
+
+  nub_loop_init(&loop);
+  ASSERT(0 == nub_loop_configure(&loop, NUB_LOOP_LOCK_HANDOFF, handoff));
+
+  for (i = 0; i < LOCK_THREADS; i++) {
+    nub_work_init(&threads[i].work, cb, (void*) (intptr_t) (i % 2));
+    ASSERT(nub_thread_create(&loop, &threads[i].thread) == 0);
+    nub_thread_enqueue(&threads[i].thread, &threads[i].work);
+  }
+
+  ASSERT(nub_loop_run(&loop, UV_RUN_DEFAULT) == 0);
+  if (lock_loop_cb == cb)
+    ASSERT(LOCK_THREADS * LOCK_ITER == lock_cntr);
+  else
+    ASSERT(LOCK_THREADS / 2 * LOCK_ITER == lock_cntr);
+  nub_loop_dispose(&loop);
+}
+
+
+TEST_IMPL(loop_lock_exclusive) {
+  run_lock_threads(0, lock_loop_cb);
+  return 0;
+}
+
+
+TEST_IMPL(loop_lock_handoff) {
+  run_lock_threads(1, lock_loop_cb);
+  return 0;
+}
+
+
+static uv_sem_t writer_locked;
+static uv_sem_t readers_queued;
+static volatile int readers_inside;
+static volatile int readers_overlapped;
+
+
+/* Runs from the spawned thread. Holds the loop so both readers end up next to
+ * each other in the lock queue. */
+static void overlap_writer_cb(nub_thread_t* thread,
+                              nub_work_t* work,
+                              void* arg) {
+  nub_loop_lock(thread);
+  uv_sem_post(&writer_locked);
+  uv_sem_post(&writer_locked);
+  uv_sem_wait(&readers_queued);
+  uv_sem_wait(&readers_queued);
+  /* Each posted just before asking, so give the requests time to land. */
+  uv_sleep(50);
+  nub_loop_unlock(thread);
+  nub_thread_dispose(thread, NULL);
+}
+
+
+/* Runs from the spawned thread. Stays in until the other reader is in too, or
+ * gives up after a while so a failure can't hang. */
+static void overlap_reader_cb(nub_thread_t* thread,
+                              nub_work_t* work,
+                              void* arg) {
+  uint64_t deadline;
+
+  uv_sem_wait(&writer_locked);
+  uv_sem_post(&readers_queued);
+  nub_loop_lock_shared(thread);
+  __sync_add_and_fetch(&readers_inside, 1);
+  deadline = uv_hrtime() + (uint64_t) 10 * 1000000000;
+  while (2 > readers_inside && uv_hrtime() < deadline)
+    uv_sleep(1);
+  if (2 == readers_inside)
+    __sync_add_and_fetch(&readers_overlapped, 1);
+  nub_loop_unlock_shared(thread);
+  nub_thread_dispose(thread, NULL);
+}
+
+
+static void run_shared_overlap(int handoff) {
+  nub_loop_t loop;
+  lock_thread threads[3];
+  int i;
+
+  readers_inside = 0;
+  readers_overlapped = 0;
+  ASSERT(0 == uv_sem_init(&writer_locked, 0));
+  ASSERT(0 == uv_sem_init(&readers_queued, 0));
+
+  nub_loop_init(&loop);
+  ASSERT(0 == nub_loop_configure(&loop, NUB_LOOP_LOCK_HANDOFF, handoff));
+
+  nub_work_init(&threads[0].work, overlap_writer_cb, NULL);
+  nub_work_init(&threads[1].work, overlap_reader_cb, NULL);
+  nub_work_init(&threads[2].work, overlap_reader_cb, NULL);
+  for (i = 0; i < 3; i++) {
+    ASSERT(nub_thread_create(&loop, &threads[i].thread) == 0);
+    nub_thread_enqueue(&threads[i].thread, &threads[i].work);
+  }
+
+  ASSERT(nub_loop_run(&loop, UV_RUN_DEFAULT) == 0);
+  ASSERT(2 == readers_overlapped);
+
+  nub_loop_dispose(&loop);
+  uv_sem_destroy(&writer_locked);
+  uv_sem_destroy(&readers_queued);
+}
+
+
+TEST_IMPL(loop_lock_shared) {
+  run_lock_threads(0, lock_mixed_cb);
+  run_lock_threads(1, lock_mixed_cb);
+  run_shared_overlap(0);
+  run_shared_overlap(1);
+  return 0;
+}
+
+
+static uv_sem_t holder_locked;
+static uv_sem_t waiter_done;
+
+
+/* Runs from the spawned thread. Holds the loop until the waiter gives up. */
+static void lock_holder_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  nub_loop_lock(thread);
+  uv_sem_post(&holder_locked);
+  uv_sem_wait(&waiter_done);
+  nub_loop_unlock(thread);
+  nub_thread_dispose(thread, NULL);
+}
+
+
+/* Runs from the spawned thread. */
+static void lock_waiter_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  uv_sem_wait(&holder_locked);
+  ASSERT(UV_ETIMEDOUT == nub_loop_lock_timeout(thread, 200000));
+  ASSERT(UV_EBUSY == nub_loop_trylock(thread));
+  uv_sem_post(&waiter_done);
+
+  /* Gets back in line once the holder lets go. */
+  ASSERT(0 == nub_loop_lock_timeout(thread, (uint64_t) 10 * 1000000000));
+  ASSERT(0 == lock_holders++);
+  lock_cntr++;
+  ASSERT(1 == lock_holders--);
+  nub_loop_unlock(thread);
+
+  nub_thread_dispose(thread, NULL);
+}
+
+
+/* Runs from the spawned thread. Mixes requests that give up with ones that
+ * don't, so withdrawn requests keep ending up in the middle of the queue. */
+static void lock_timeout_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  int i;
+
+  for (i = 0; i < LOCK_ITER; i++) {
+    if (0 == i % 2) {
+      if (0 != nub_loop_lock_timeout(thread, 1000))
+        continue;
+    } else {
+      nub_loop_lock(thread);
+    }
+    ASSERT(0 == lock_holders++);
+    lock_cntr++;
+    ASSERT(1 == lock_holders--);
+    nub_loop_unlock(thread);
+  }
+
+  nub_thread_dispose(thread, NULL);
+}
+
+
+static void run_lock_timeout(int handoff) {
+  nub_loop_t loop;
+  lock_thread threads[LOCK_THREADS];
+  int i;
+
+  lock_cntr = 0;
+  lock_holders = 0;
+  ASSERT(0 == uv_sem_init(&holder_locked, 0));
+  ASSERT(0 == uv_sem_init(&waiter_done, 0));
+
+  nub_loop_init(&loop);
+  ASSERT(0 == nub_loop_configure(&loop, NUB_LOOP_LOCK_HANDOFF, handoff));
+
+  nub_work_init(&threads[0].work, lock_holder_cb, NULL);
+  nub_work_init(&threads[1].work, lock_waiter_cb, NULL);
+  for (i = 0; i < 2; i++) {
+    ASSERT(nub_thread_create(&loop, &threads[i].thread) == 0);
+    nub_thread_enqueue(&threads[i].thread, &threads[i].work);
+  }
+
+  ASSERT(nub_loop_run(&loop, UV_RUN_DEFAULT) == 0);
+  ASSERT(1 == lock_cntr);
+
+  for (i = 0; i < LOCK_THREADS; i++) {
+    nub_work_init(&threads[i].work, lock_timeout_cb, NULL);
+    ASSERT(nub_thread_create(&loop, &threads[i].thread) == 0);
+    nub_thread_enqueue(&threads[i].thread, &threads[i].work);
+  }
+
+  ASSERT(nub_loop_run(&loop, UV_RUN_DEFAULT) == 0);
+  ASSERT(1 + LOCK_THREADS * LOCK_ITER / 2 <= lock_cntr);
+
+  nub_loop_dispose(&loop);
+  uv_sem_destroy(&holder_locked);
+  uv_sem_destroy(&waiter_done);
+}
+
+
+TEST_IMPL(loop_lock_timeout) {
+  run_lock_timeout(0);
+  run_lock_timeout(1);
+  return 0;
+}
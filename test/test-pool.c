@@ -0,0 +1,161 @@
+#include "nub.h"
+#include "run-tests.h"
+#include "helper.h"
+#include "uv.h"
+
+#define POOL_ITEMS 256
+
+typedef struct {
+  nub_work_t work;
+  uv_thread_t ran_on;
+  int ran;
+} pool_work;
+
+static pool_work items[POOL_ITEMS];
+static volatile int remaining;
+
+
+/* Runs from a pool thread. */
+static void pool_work_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  pool_work* item = (pool_work*) arg;
+  uint64_t start;
+
+  ASSERT(NULL != thread->nubloop);
+  /* Pool threads stay with their pool. */
+  if (item == &items[1])
+    ASSERT(UV_EINVAL == nub_thread_migrate(thread, thread->nubloop));
+  item->ran_on = uv_thread_self();
+  item->ran += 1;
+  /* Keep the first thread busy so the queue backs up. */
+  if (item == &items[0]) {
+    start = uv_hrtime();
+    while (uv_hrtime() - start < 10000000);
+  }
+
+  __sync_sub_and_fetch(&remaining, 1);
+}
+
+
+/* Runs from the main thread. */
+static void pool_check_cb(uv_timer_t* handle) {
+  nub_pool_t* pool = (nub_pool_t*) handle->data;
+
+  if (0 < remaining)
+    return;
+
+  /* Backed up work should have caused the pool to grow. */
+  ASSERT(pool->nthreads > pool->min_threads);
+  ASSERT(pool->nthreads <= pool->max_threads);
+  nub_pool_dispose(pool);
+  ASSERT(0 == pool->nthreads);
+  uv_close((uv_handle_t*) handle, NULL);
+}
+
+
+TEST_IMPL(pool_enqueue) {
+  nub_loop_t loop;
+  nub_pool_t pool;
+  uv_timer_t check;
+  int i;
+
+  remaining = POOL_ITEMS;
+
+  nub_loop_init(&loop);
+  ASSERT(nub_pool_init(&loop, &pool, 1, 4) == 0);
+  ASSERT(1 == pool.nthreads);
+
+  for (i = 0; i < POOL_ITEMS; i++) {
+    items[i].ran = 0;
+    nub_work_init(&items[i].work, pool_work_cb, &items[i]);
+    nub_pool_enqueue(&pool, &items[i].work);
+  }
+
+  ASSERT(0 == uv_timer_init(&loop.uvloop, &check));
+  check.data = &pool;
+  ASSERT(0 == uv_timer_start(&check, pool_check_cb, 1, 1));
+  ASSERT(nub_loop_run(&loop, UV_RUN_DEFAULT) == 0);
+
+  for (i = 0; i < POOL_ITEMS; i++)
+    ASSERT(1 == items[i].ran);
+
+  nub_loop_dispose(&loop);
+
+  return 0;
+}
+
+
+static int shrink_phase;
+
+
+static void pool_fill(nub_pool_t* pool) {
+  int i;
+
+  remaining = POOL_ITEMS;
+  for (i = 0; i < POOL_ITEMS; i++) {
+    nub_work_init(&items[i].work, pool_work_cb, &items[i]);
+    nub_pool_enqueue(pool, &items[i].work);
+  }
+}
+
+
+/* Runs from the main thread. */
+static void pool_shrink_cb(uv_timer_t* handle) {
+  nub_pool_t* pool = (nub_pool_t*) handle->data;
+
+  if (0 < remaining)
+    return;
+
+  if (0 == shrink_phase % 2) {
+    /* Slots still held by retired threads can keep the second round from
+     * growing the pool. */
+    if (0 == shrink_phase)
+      ASSERT(pool->nthreads > pool->min_threads);
+    shrink_phase++;
+    return;
+  }
+
+  /* Idle threads are retired without holding up the loop. */
+  if (pool->nthreads > pool->min_threads)
+    return;
+
+  /* Grow again while the retired threads may still be on their way out. */
+  if (1 == shrink_phase) {
+    shrink_phase++;
+    pool_fill(pool);
+    return;
+  }
+
+  /* Same, but have them joined by nub_pool_dispose(). */
+  nub_pool_dispose(pool);
+  ASSERT(0 == pool->nthreads);
+  uv_close((uv_handle_t*) handle, NULL);
+}
+
+
+TEST_IMPL(pool_shrink) {
+  nub_loop_t loop;
+  nub_pool_t pool;
+  uv_timer_t check;
+  int i;
+
+  shrink_phase = 0;
+  for (i = 0; i < POOL_ITEMS; i++)
+    items[i].ran = 0;
+
+  nub_loop_init(&loop);
+  ASSERT(nub_pool_init(&loop, &pool, 1, 4) == 0);
+  pool_fill(&pool);
+
+  ASSERT(0 == uv_timer_init(&loop.uvloop, &check));
+  check.data = &pool;
+  ASSERT(0 == uv_timer_start(&check, pool_shrink_cb, 1, 1));
+  ASSERT(nub_loop_run(&loop, UV_RUN_DEFAULT) == 0);
+
+  ASSERT(3 == shrink_phase);
+  for (i = 0; i < POOL_ITEMS; i++)
+    ASSERT(2 == items[i].ran);
+
+  nub_loop_dispose(&loop);
+
+  return 0;
+}
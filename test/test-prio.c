@@ -0,0 +1,256 @@
+#include "nub.h"
+#include "run-tests.h"
+#include "helper.h"
+#include "uv.h"
+
+#define PER_CLASS 8
+#define FLOOD 100
+/* Matches NUB__PRIO_AGE in src/internal.h. */
+#define PRIO_AGE 32
+/* Items the loop gets through per iteration in loop_enqueue_prio_aging. */
+#define BUDGET 4
+
+typedef struct {
+  nub_work_t work;
+  nub_prio prio;
+} item;
+
+static item items[3 * PER_CLASS];
+static item flood[FLOOD + 1];
+static nub_prio order[3 * PER_CLASS];
+static int ran;
+static int flood_ran;
+static int low_ran_at;
+static uv_sem_t gate_sem;
+
+
+/* Runs from the spawned thread. */
+static void record_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  order[ran++] = ((item*) arg)->prio;
+  if (3 * PER_CLASS == ran)
+    nub_thread_dispose(thread, NULL);
+}
+
+
+/* Runs from the spawned thread. */
+static void flood_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  if (NUB_PRIO_LOW == ((item*) arg)->prio)
+    low_ran_at = flood_ran;
+  if (FLOOD + 1 == ++flood_ran)
+    nub_thread_dispose(thread, NULL);
+}
+
+
+/* Runs from the spawned thread. Holds it up until everything is queued. */
+static void gate_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  uv_sem_wait(&gate_sem);
+}
+
+
+static void enqueue_item(nub_thread_t* thread,
+                         item* it,
+                         nub_work_cb cb,
+                         nub_prio prio) {
+  it->prio = prio;
+  nub_work_init(&it->work, cb, it);
+  nub_thread_enqueue_prio(thread, &it->work, prio);
+}
+
+
+static void start_gated(nub_loop_t* loop,
+                        nub_thread_t* thread,
+                        nub_work_t* gate) {
+  ASSERT(0 == uv_sem_init(&gate_sem, 0));
+  nub_loop_init(loop);
+  ASSERT(0 == nub_thread_create(loop, thread));
+  nub_work_init(gate, gate_cb, NULL);
+  nub_thread_enqueue(thread, gate);
+}
+
+
+static void run_gated(nub_loop_t* loop) {
+  uv_sem_post(&gate_sem);
+  ASSERT(0 == nub_loop_run(loop, UV_RUN_DEFAULT));
+  nub_loop_dispose(loop);
+  uv_sem_destroy(&gate_sem);
+}
+
+
+TEST_IMPL(thread_enqueue_prio) {
+  nub_loop_t loop;
+  nub_thread_t thread;
+  nub_work_t gate;
+  int i;
+
+  ran = 0;
+  start_gated(&loop, &thread, &gate);
+
+  /* Queued lowest class first, but run highest first. */
+  for (i = 0; i < PER_CLASS; i++)
+    enqueue_item(&thread, &items[i], record_cb, NUB_PRIO_LOW);
+  for (i = 0; i < PER_CLASS; i++)
+    enqueue_item(&thread, &items[PER_CLASS + i], record_cb, NUB_PRIO_NORMAL);
+  for (i = 0; i < PER_CLASS; i++)
+    enqueue_item(&thread, &items[2 * PER_CLASS + i], record_cb, NUB_PRIO_HIGH);
+
+  run_gated(&loop);
+
+  ASSERT(3 * PER_CLASS == ran);
+  for (i = 0; i < 3 * PER_CLASS; i++)
+    ASSERT(order[i] == (nub_prio) (i / PER_CLASS));
+
+  return 0;
+}
+
+
+/* A single low item isn't starved by a flood of high ones. */
+TEST_IMPL(thread_enqueue_prio_aging) {
+  nub_loop_t loop;
+  nub_thread_t thread;
+  nub_work_t gate;
+  int i;
+
+  flood_ran = 0;
+  low_ran_at = -1;
+  start_gated(&loop, &thread, &gate);
+
+  enqueue_item(&thread, &flood[FLOOD], flood_cb, NUB_PRIO_LOW);
+  for (i = 0; i < FLOOD; i++)
+    enqueue_item(&thread, &flood[i], flood_cb, NUB_PRIO_HIGH);
+
+  run_gated(&loop);
+
+  ASSERT(FLOOD + 1 == flood_ran);
+  ASSERT(PRIO_AGE == low_ran_at);
+
+  return 0;
+}
+
+
+/* Runs from the main thread. */
+static void loop_record_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  order[ran++] = ((item*) arg)->prio;
+}
+
+
+/* Runs from the spawned thread. */
+static void loop_complete_cb(nub_work_t* work, int status) {
+  nub_thread_t* thread = (nub_thread_t*) work->data;
+
+  ASSERT(0 == status);
+  if (3 * PER_CLASS == ++flood_ran)
+    nub_thread_dispose(thread, NULL);
+}
+
+
+/* Runs from the spawned thread. Everything is queued while the loop is held,
+ * so it all gets picked up at once. */
+static void start_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  item* it;
+  int i;
+
+  ASSERT(0 == nub_loop_lock(thread));
+  for (i = 0; i < 3 * PER_CLASS; i++) {
+    it = &items[i];
+    it->prio = (nub_prio) (NUB_PRIO_LOW - i / PER_CLASS);
+    nub_work_init(&it->work, loop_record_cb, it);
+    it->work.data = thread;
+    nub_loop_enqueue_prio(thread, &it->work, loop_complete_cb, it->prio);
+  }
+  nub_loop_unlock(thread);
+}
+
+
+TEST_IMPL(loop_enqueue_prio) {
+  nub_loop_t loop;
+  nub_thread_t thread;
+  nub_work_t start;
+  int i;
+
+  ran = 0;
+  flood_ran = 0;
+  nub_loop_init(&loop);
+  ASSERT(0 == nub_thread_create(&loop, &thread));
+
+  nub_work_init(&start, start_cb, NULL);
+  nub_thread_enqueue(&thread, &start);
+
+  ASSERT(0 == nub_loop_run(&loop, UV_RUN_DEFAULT));
+
+  ASSERT(3 * PER_CLASS == ran);
+  for (i = 0; i < 3 * PER_CLASS; i++)
+    ASSERT(order[i] == (nub_prio) (i / PER_CLASS));
+
+  nub_loop_dispose(&loop);
+
+  return 0;
+}
+
+
+/* Runs from the main thread. */
+static void loop_flood_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  if (NUB_PRIO_LOW == ((item*) arg)->prio)
+    low_ran_at = ran;
+  else
+    ran++;
+}
+
+
+/* Runs from the spawned thread. */
+static void loop_flood_complete_cb(nub_work_t* work, int status) {
+  nub_thread_t* thread = (nub_thread_t*) work->data;
+
+  ASSERT(0 == status);
+  if (FLOOD + 1 == ++flood_ran)
+    nub_thread_dispose(thread, NULL);
+}
+
+
+static void loop_flood_item(nub_thread_t* thread, item* it, nub_prio prio) {
+  it->prio = prio;
+  nub_work_init(&it->work, loop_flood_cb, it);
+  it->work.data = thread;
+  nub_loop_enqueue_prio(thread, &it->work, loop_flood_complete_cb, prio);
+}
+
+
+/* Runs from the spawned thread. */
+static void flood_start_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  int i;
+
+  ASSERT(0 == nub_loop_lock(thread));
+  loop_flood_item(thread, &flood[FLOOD], NUB_PRIO_LOW);
+  for (i = 0; i < FLOOD; i++)
+    loop_flood_item(thread, &flood[i], NUB_PRIO_HIGH);
+  nub_loop_unlock(thread);
+}
+
+
+/* With a budget the loop never gets through the high items in one go, but the
+ * low one still isn't left until they're all done. */
+TEST_IMPL(loop_enqueue_prio_aging) {
+  nub_loop_t loop;
+  nub_thread_t thread;
+  nub_work_t start;
+
+  ran = 0;
+  flood_ran = 0;
+  low_ran_at = -1;
+  nub_loop_init(&loop);
+  ASSERT(0 == nub_loop_configure(&loop, NUB_LOOP_BUDGET_ITEMS, BUDGET));
+  ASSERT(0 == nub_thread_create(&loop, &thread));
+
+  nub_work_init(&start, flood_start_cb, NULL);
+  nub_thread_enqueue(&thread, &start);
+
+  ASSERT(0 == nub_loop_run(&loop, UV_RUN_DEFAULT));
+
+  ASSERT(FLOOD == ran);
+  ASSERT(FLOOD + 1 == flood_ran);
+  ASSERT(PRIO_AGE <= low_ran_at);
+  ASSERT(PRIO_AGE + BUDGET > low_ran_at);
+
+  nub_loop_dispose(&loop);
+
+  return 0;
+}
@@ -0,0 +1,92 @@
+#include "nub.h"
+#include "run-tests.h"
+#include "helper.h"
+#include "uv.h"
+
+#define WORK_ITEMS 32
+#define LOCK_ITER 16
+
+static nub_work_t items[WORK_ITEMS];
+static int completed;
+
+
+/* Runs from the main thread. */
+static void loop_noop(nub_thread_t* thread, nub_work_t* work, void* arg) {
+}
+
+
+/* Runs from the spawned thread. */
+static void complete_cb(nub_work_t* work, int status) {
+  nub_thread_t* thread = (nub_thread_t*) work->data;
+  int i;
+
+  if (WORK_ITEMS != ++completed)
+    return;
+
+  for (i = 0; i < LOCK_ITER; i++) {
+    nub_loop_lock(thread);
+    nub_loop_unlock(thread);
+  }
+
+  nub_thread_dispose(thread, NULL);
+}
+
+
+/* Runs from the spawned thread. */
+static void start_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  int i;
+
+  for (i = 0; i < WORK_ITEMS; i++) {
+    nub_work_init(&items[i], loop_noop, NULL);
+    items[i].data = thread;
+    nub_loop_enqueue(thread, &items[i], complete_cb);
+  }
+}
+
+
+TEST_IMPL(stats) {
+  nub_loop_t loop;
+  nub_thread_t thread;
+  nub_work_t start;
+  nub_loop_stats_t loop_stats;
+  nub_thread_stats_t thread_stats;
+
+  completed = 0;
+  nub_loop_init(&loop);
+  ASSERT(nub_thread_create(&loop, &thread) == 0);
+
+  nub_loop_stats(&loop, &loop_stats);
+  ASSERT(1 == loop_stats.threads);
+  ASSERT(0 == loop_stats.work_processed);
+
+  nub_work_init(&start, start_cb, NULL);
+  nub_thread_enqueue(&thread, &start);
+  ASSERT(nub_loop_run(&loop, UV_RUN_DEFAULT) == 0);
+
+  nub_loop_stats(&loop, &loop_stats);
+  ASSERT(0 == loop_stats.threads);
+  ASSERT(0 < loop_stats.iterations);
+  ASSERT(WORK_ITEMS == loop_stats.work_processed);
+  ASSERT(0 < loop_stats.outgoing_max);
+  ASSERT(LOCK_ITER == loop_stats.lock_grants);
+  ASSERT(0 < loop_stats.lock_chain_max);
+  ASSERT(loop_stats.halted_max_ns <= loop_stats.halted_ns);
+
+  /* Still readable after the thread has been joined. */
+  nub_thread_stats(&thread, &thread_stats);
+  ASSERT(1 == thread_stats.enqueued);
+  ASSERT(0 == thread_stats.sent);
+  ASSERT(1 + WORK_ITEMS == thread_stats.processed);
+  ASSERT(0 < thread_stats.incoming_max);
+  ASSERT(WORK_ITEMS == thread_stats.loop_enqueued);
+  ASSERT(0 < thread_stats.async_sent);
+  ASSERT(LOCK_ITER == thread_stats.locks);
+  ASSERT(0 == thread_stats.lock_timeouts);
+  ASSERT(thread_stats.lock_wait_max_ns <= thread_stats.lock_wait_ns);
+  ASSERT(thread_stats.lock_hold_max_ns <= thread_stats.lock_hold_ns);
+  ASSERT(0 < thread_stats.cpu_ns);
+
+  nub_loop_dispose(&loop);
+
+  return 0;
+}
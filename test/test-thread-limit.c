@@ -0,0 +1,196 @@
+#include "nub.h"
+#include "run-tests.h"
+#include "helper.h"
+#include "uv.h"
+
+#define ITEMS 4
+#define DEADLINE_FAR ((uint64_t) 60 * 1000 * 1000 * 1000)
+
+static uv_thread_t loop_thread;
+static uv_sem_t started;
+static uv_sem_t release;
+static nub_work_t blocker;
+static nub_work_t items[ITEMS + 1];
+static nub_work_t dispose_work;
+static nub_work_t loop_work;
+static int events[4];
+static int nevents;
+static int items_run;
+static int expired_run;
+static int loop_ran;
+static int loop_completed;
+
+
+/* Runs from the spawned thread. */
+static void blocker_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  uv_sem_post(&started);
+  uv_sem_wait(&release);
+}
+
+
+/* Runs from the spawned thread. */
+static void item_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  items_run++;
+}
+
+
+/* Runs from the spawned thread. */
+static void dispose_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  nub_thread_dispose(thread, NULL);
+}
+
+
+/* Runs from the main thread. */
+static void water_cb(nub_thread_t* thread, int above) {
+  uv_thread_t self;
+
+  self = uv_thread_self();
+  ASSERT(0 != uv_thread_equal(&loop_thread, &self));
+  ASSERT(nevents < 4);
+  events[nevents++] = above;
+
+  if (0 == above) {
+    nub_work_init(&dispose_work, dispose_cb, NULL);
+    ASSERT(0 == nub_thread_enqueue(thread, &dispose_work));
+  }
+}
+
+
+TEST_IMPL(thread_limit) {
+  nub_loop_t loop;
+  nub_thread_t thread;
+  nub_thread_stats_t stats;
+  nub_work_t* batch[2];
+  int i;
+
+  nevents = 0;
+  items_run = 0;
+  loop_thread = uv_thread_self();
+  ASSERT(0 == uv_sem_init(&started, 0));
+  ASSERT(0 == uv_sem_init(&release, 0));
+  nub_loop_init(&loop);
+  ASSERT(0 == nub_thread_create(&loop, &thread));
+  nub_thread_limit(&thread, ITEMS, 3, 1, water_cb);
+
+  /* Hold the thread so nothing queued below is taken. */
+  nub_work_init(&blocker, blocker_cb, NULL);
+  ASSERT(0 == nub_thread_enqueue(&thread, &blocker));
+  uv_sem_wait(&started);
+
+  for (i = 0; i < ITEMS; i++) {
+    nub_work_init(&items[i], item_cb, NULL);
+    ASSERT(0 == nub_thread_enqueue(&thread, &items[i]));
+    ASSERT((i < 2 ? 0 : 1) == nevents);
+  }
+  ASSERT(1 == events[0]);
+
+  nub_work_init(&items[ITEMS], item_cb, NULL);
+  ASSERT(UV_EAGAIN == nub_thread_enqueue(&thread, &items[ITEMS]));
+  batch[0] = &items[ITEMS];
+  batch[1] = &items[ITEMS];
+  ASSERT(UV_EAGAIN == nub_thread_enqueue_batch(&thread, batch, 2));
+  ASSERT(0 == nub_thread_enqueue_batch(&thread, batch, 0));
+
+  uv_sem_post(&release);
+  ASSERT(0 == nub_loop_run(&loop, UV_RUN_DEFAULT));
+
+  ASSERT(2 == nevents);
+  ASSERT(0 == events[1]);
+  ASSERT(ITEMS == items_run);
+  nub_thread_stats(&thread, &stats);
+  ASSERT(ITEMS + 2 == stats.enqueued);
+  ASSERT(3 == stats.rejected);
+
+  nub_loop_dispose(&loop);
+  uv_sem_destroy(&started);
+  uv_sem_destroy(&release);
+
+  return 0;
+}
+
+
+/* Runs from the spawned thread. */
+static void expired_cb(nub_work_t* work, int status) {
+  ASSERT(UV_ETIMEDOUT == status);
+  expired_run++;
+}
+
+
+/* Runs from the main thread. */
+static void loop_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  loop_ran++;
+}
+
+
+/* Runs from the spawned thread. */
+static void loop_complete_cb(nub_work_t* work, int status) {
+  ASSERT(UV_ETIMEDOUT == status);
+  loop_completed++;
+  nub_thread_dispose(work->data, NULL);
+}
+
+
+/* Runs from the spawned thread. */
+static void loop_enqueue_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  nub_work_init(&loop_work, loop_cb, NULL);
+  loop_work.data = thread;
+  nub_work_set_deadline(&loop_work, uv_hrtime(), NULL);
+  nub_loop_enqueue(thread, &loop_work, loop_complete_cb);
+}
+
+
+TEST_IMPL(work_deadline) {
+  nub_loop_t loop;
+  nub_thread_t thread;
+  nub_thread_stats_t stats;
+  nub_loop_stats_t loop_stats;
+
+  items_run = 0;
+  expired_run = 0;
+  loop_ran = 0;
+  loop_completed = 0;
+  ASSERT(0 == uv_sem_init(&started, 0));
+  ASSERT(0 == uv_sem_init(&release, 0));
+  nub_loop_init(&loop);
+  ASSERT(0 == nub_thread_create(&loop, &thread));
+
+  nub_work_init(&blocker, blocker_cb, NULL);
+  ASSERT(0 == nub_thread_enqueue(&thread, &blocker));
+  uv_sem_wait(&started);
+
+  /* Already past its deadline by the time the thread gets to it. */
+  nub_work_init(&items[0], item_cb, NULL);
+  nub_work_set_deadline(&items[0], uv_hrtime(), expired_cb);
+  ASSERT(0 == nub_thread_enqueue(&thread, &items[0]));
+
+  nub_work_init(&items[1], item_cb, NULL);
+  nub_work_set_deadline(&items[1], uv_hrtime() + DEADLINE_FAR, expired_cb);
+  ASSERT(0 == nub_thread_enqueue(&thread, &items[1]));
+
+  /* Cleared by nub_work_set_deadline(). */
+  nub_work_init(&items[2], item_cb, NULL);
+  nub_work_set_deadline(&items[2], uv_hrtime(), expired_cb);
+  nub_work_set_deadline(&items[2], 0, NULL);
+  ASSERT(0 == nub_thread_enqueue(&thread, &items[2]));
+
+  nub_work_init(&items[3], loop_enqueue_cb, NULL);
+  ASSERT(0 == nub_thread_enqueue(&thread, &items[3]));
+
+  uv_sem_post(&release);
+  ASSERT(0 == nub_loop_run(&loop, UV_RUN_DEFAULT));
+
+  ASSERT(2 == items_run);
+  ASSERT(1 == expired_run);
+  ASSERT(0 == loop_ran);
+  ASSERT(1 == loop_completed);
+  nub_thread_stats(&thread, &stats);
+  ASSERT(1 == stats.expired);
+  nub_loop_stats(&loop, &loop_stats);
+  ASSERT(1 == loop_stats.expired);
+
+  nub_loop_dispose(&loop);
+  uv_sem_destroy(&started);
+  uv_sem_destroy(&release);
+
+  return 0;
+}
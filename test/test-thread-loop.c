@@ -0,0 +1,131 @@
+#include "nub.h"
+#include "run-tests.h"
+#include "helper.h"
+#include "uv.h"
+
+#define OWN_TIMEOUT 5
+#define AFTER_NS (3 * 1000000)
+#define LATE_TIMEOUT 30
+
+static nub_thread_t thread;
+static nub_work_t start;
+static nub_work_t after;
+static nub_work_t late;
+static uv_timer_t own_timer;
+static uv_timer_t late_timer;
+static int own_ran;
+static int after_ran;
+static int late_ran;
+
+
+static void assert_on_thread(void) {
+  uv_thread_t self;
+
+  self = uv_thread_self();
+  ASSERT(0 != uv_thread_equal(&thread.uvthread, &self));
+}
+
+
+/* Runs from the spawned thread, from its own loop. */
+static void own_timer_cb(uv_timer_t* handle) {
+  assert_on_thread();
+  ASSERT(handle->loop == thread.uvloop);
+  own_ran++;
+  uv_close((uv_handle_t*) handle, NULL);
+}
+
+
+/* Runs from the spawned thread. Has to fire while parked in the own loop. */
+static void after_cb(nub_thread_t* t, nub_work_t* work, void* arg) {
+  after_ran++;
+}
+
+
+/* Runs from the spawned thread. */
+static void start_cb(nub_thread_t* t, nub_work_t* work, void* arg) {
+  ASSERT(NULL != t->uvloop);
+  ASSERT(t == t->uvloop->data);
+  ASSERT(0 == uv_timer_init(t->uvloop, &own_timer));
+  ASSERT(0 == uv_timer_start(&own_timer, own_timer_cb, OWN_TIMEOUT, 0));
+  nub_work_init(&after, after_cb, NULL);
+  nub_thread_enqueue_after(t, &after, AFTER_NS);
+}
+
+
+/* Runs from the spawned thread, woken out of its own loop. */
+static void late_cb(nub_thread_t* t, nub_work_t* work, void* arg) {
+  ASSERT(1 == own_ran);
+  ASSERT(1 == after_ran);
+  late_ran++;
+  nub_thread_dispose(t, NULL);
+}
+
+
+/* Runs from the main thread. */
+static void late_timer_cb(uv_timer_t* handle) {
+  nub_work_init(&late, late_cb, NULL);
+  nub_thread_enqueue(&thread, &late);
+  uv_close((uv_handle_t*) handle, NULL);
+}
+
+
+TEST_IMPL(thread_own_loop) {
+  nub_loop_t loop;
+  nub_thread_options_t options;
+
+  own_ran = 0;
+  after_ran = 0;
+  late_ran = 0;
+  nub_loop_init(&loop);
+
+  options.flags = NUB_THREAD_OWN_LOOP;
+  ASSERT(0 == nub_thread_create_ex(&loop, &thread, &options));
+  ASSERT(NULL != thread.uvloop);
+  ASSERT(thread.uvloop != &loop.uvloop);
+
+  nub_work_init(&start, start_cb, NULL);
+  nub_thread_enqueue(&thread, &start);
+
+  ASSERT(0 == uv_timer_init(&loop.uvloop, &late_timer));
+  ASSERT(0 == uv_timer_start(&late_timer, late_timer_cb, LATE_TIMEOUT, 0));
+
+  ASSERT(0 == nub_loop_run(&loop, UV_RUN_DEFAULT));
+  ASSERT(1 == own_ran);
+  ASSERT(1 == after_ran);
+  ASSERT(1 == late_ran);
+  ASSERT(NULL == thread.uvloop);
+
+  nub_loop_dispose(&loop);
+
+  return 0;
+}
+
+
+/* Runs from the main thread. Joins a thread parked in its own loop. */
+static void join_timer_cb(uv_timer_t* handle) {
+  nub_thread_join((nub_thread_t*) handle->data);
+  uv_close((uv_handle_t*) handle, NULL);
+}
+
+
+TEST_IMPL(thread_own_loop_join) {
+  nub_loop_t loop;
+  nub_thread_options_t options;
+  uv_timer_t timer;
+
+  nub_loop_init(&loop);
+
+  options.flags = NUB_THREAD_OWN_LOOP;
+  ASSERT(0 == nub_thread_create_ex(&loop, &thread, &options));
+
+  ASSERT(0 == uv_timer_init(&loop.uvloop, &timer));
+  timer.data = &thread;
+  ASSERT(0 == uv_timer_start(&timer, join_timer_cb, 5, 0));
+
+  ASSERT(0 == nub_loop_run(&loop, UV_RUN_DEFAULT));
+  ASSERT(NULL == thread.uvloop);
+
+  nub_loop_dispose(&loop);
+
+  return 0;
+}
@@ -0,0 +1,172 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE  /* CPU_ISSET, sched_getaffinity */
+#endif
+
+#include "nub.h"
+#include "run-tests.h"
+#include "helper.h"
+#include "uv.h"
+
+#include <errno.h>  /* errno */
+#include <string.h>  /* memset, strcmp */
+
+#if defined(__linux__)
+# include <sched.h>  /* sched_getaffinity, sched_getcpu */
+# include <sys/prctl.h>  /* prctl */
+# include <sys/resource.h>  /* getpriority */
+# include <sys/syscall.h>  /* SYS_gettid */
+# include <unistd.h>  /* syscall */
+#endif
+
+#define STACK_SIZE (256 * 1024)
+#define MAX_CPUS 1024
+
+static char cpumask[MAX_CPUS];
+static int ran;
+#if defined(__linux__)
+static int base_nice;
+#endif
+
+
+/* Runs from the spawned thread. */
+static void check_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+#if defined(__linux__)
+  int cpu = *(int*) arg;
+  cpu_set_t set;
+  char name[16];
+
+  ASSERT(0 == sched_getaffinity(0, sizeof(set), &set));
+  ASSERT(1 == CPU_COUNT(&set));
+  ASSERT(CPU_ISSET(cpu, &set));
+  ASSERT(cpu == sched_getcpu());
+
+  ASSERT(0 == prctl(PR_GET_NAME, (unsigned long) name, 0, 0, 0));
+  /* Cut down to what fits. */
+  ASSERT(0 == strcmp("nub-test-thread", name));
+#endif
+
+  ran = 1;
+  nub_thread_dispose(thread, NULL);
+}
+
+
+/* Runs from the spawned thread. */
+static void priority_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+#if defined(__linux__)
+  int priority = *(int*) arg;
+  int nice;
+
+  /* Same mapping as nub_thread_create_ex(), starting from the nice value
+   * inherited from the loop thread. */
+  nice = base_nice - 5 * priority;
+  if (nice < -20)
+    nice = -20;
+  if (nice > 19)
+    nice = 19;
+  errno = 0;
+  ASSERT(nice == getpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid)));
+  ASSERT(0 == errno);
+#endif
+
+  ran = 1;
+  nub_thread_dispose(thread, NULL);
+}
+
+
+/* Returns the result of creating the thread, which has already run and been
+ * joined if it was 0. */
+static int run_priority(nub_loop_t* loop, nub_thread_priority priority) {
+  nub_thread_t thread;
+  nub_thread_options_t options;
+  nub_work_t work;
+  int arg;
+  int er;
+
+  ran = 0;
+  arg = priority;
+#if defined(__linux__)
+  errno = 0;
+  base_nice = getpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid));
+  ASSERT(0 == errno);
+#endif
+  memset(&options, 0, sizeof(options));
+  options.flags = NUB_THREAD_HAS_PRIORITY;
+  options.priority = priority;
+  er = nub_thread_create_ex(loop, &thread, &options);
+  if (0 != er)
+    return er;
+
+  nub_work_init(&work, priority_cb, &arg);
+  nub_thread_enqueue(&thread, &work);
+  ASSERT(0 == nub_loop_run(loop, UV_RUN_DEFAULT));
+  ASSERT(1 == ran);
+  return 0;
+}
+
+
+TEST_IMPL(thread_create_ex) {
+  nub_loop_t loop;
+  nub_thread_t thread;
+  nub_thread_options_t options;
+  nub_loop_stats_t stats;
+  nub_work_t work;
+  int cpu;
+  int er;
+#if defined(__linux__)
+  cpu_set_t set;
+#endif
+
+  ran = 0;
+  memset(cpumask, 0, sizeof(cpumask));
+  nub_loop_init(&loop);
+
+  /* A mask without any CPU fails from the new thread, which is brought back
+   * down before the call returns. */
+  memset(&options, 0, sizeof(options));
+  options.flags = NUB_THREAD_HAS_AFFINITY;
+  options.cpumask = cpumask;
+  options.cpumask_size = sizeof(cpumask);
+#if defined(__linux__) || defined(_WIN32)
+  ASSERT(UV_EINVAL == nub_thread_create_ex(&loop, &thread, &options));
+#else
+  ASSERT(UV_ENOTSUP == nub_thread_create_ex(&loop, &thread, &options));
+#endif
+  nub_loop_stats(&loop, &stats);
+  ASSERT(0 == stats.threads);
+
+  options.flags = NUB_THREAD_HAS_STACK_SIZE |
+                  NUB_THREAD_HAS_NAME |
+                  NUB_THREAD_HAS_PRIORITY;
+  options.stack_size = STACK_SIZE;
+  options.name = "nub-test-thread-options";
+  options.priority = NUB_THREAD_PRIORITY_NORMAL;
+
+#if defined(__linux__)
+  /* Pin to the last CPU the process is allowed on. */
+  ASSERT(0 == sched_getaffinity(0, sizeof(set), &set));
+  for (cpu = CPU_SETSIZE - 1; cpu >= 0 && !CPU_ISSET(cpu, &set); cpu--);
+  ASSERT(0 <= cpu && cpu < MAX_CPUS);
+  cpumask[cpu] = 1;
+  options.flags |= NUB_THREAD_HAS_AFFINITY;
+#else
+  cpu = -1;
+#endif
+
+  ASSERT(0 == nub_thread_create_ex(&loop, &thread, &options));
+  nub_work_init(&work, check_cb, &cpu);
+  nub_thread_enqueue(&thread, &work);
+
+  ASSERT(0 == nub_loop_run(&loop, UV_RUN_DEFAULT));
+  ASSERT(1 == ran);
+
+  /* Lowering the priority never needs privileges, raising it might. */
+  ASSERT(0 == run_priority(&loop, NUB_THREAD_PRIORITY_LOWEST));
+  er = run_priority(&loop, NUB_THREAD_PRIORITY_HIGHEST);
+  ASSERT(0 == er || UV_EPERM == er);
+  nub_loop_stats(&loop, &stats);
+  ASSERT(0 == stats.threads);
+
+  nub_loop_dispose(&loop);
+
+  return 0;
+}
@@ -0,0 +1,88 @@
+#include "nub.h"
+#include "run-tests.h"
+#include "helper.h"
+#include "uv.h"
+
+#define SENDERS 4
+#define ITEMS 1000
+
+typedef struct {
+  nub_work_t work;
+  int sender;
+  int seq;
+} message;
+
+typedef struct {
+  nub_thread_t thread;
+  nub_work_t start;
+  message messages[ITEMS];
+} sender;
+
+static nub_thread_t receiver;
+static sender senders[SENDERS];
+static int next_seq[SENDERS];
+static int received;
+
+
+/* Runs from the receiving thread. */
+static void message_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  message* msg = (message*) arg;
+  uv_thread_t self = uv_thread_self();
+
+  ASSERT(thread == &receiver);
+  ASSERT(uv_thread_equal(&self, &receiver.uvthread));
+  /* Messages from the same sender arrive in the order they were sent. */
+  ASSERT(next_seq[msg->sender] == msg->seq);
+  next_seq[msg->sender]++;
+
+  if (SENDERS * ITEMS == ++received)
+    nub_thread_dispose(thread, NULL);
+}
+
+
+/* Runs from the sending thread. */
+static void start_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  sender* s = (sender*) arg;
+  int i;
+
+  for (i = 0; i < ITEMS; i++)
+    nub_thread_send(thread, &receiver, &s->messages[i].work);
+
+  nub_thread_dispose(thread, NULL);
+}
+
+
+TEST_IMPL(thread_send) {
+  nub_loop_t loop;
+  sender* s;
+  int i;
+  int n;
+
+  received = 0;
+  nub_loop_init(&loop);
+  ASSERT(nub_thread_create(&loop, &receiver) == 0);
+
+  for (i = 0; i < SENDERS; i++) {
+    s = &senders[i];
+    next_seq[i] = 0;
+    nub_work_init(&s->start, start_cb, s);
+    for (n = 0; n < ITEMS; n++) {
+      nub_work_init(&s->messages[n].work, message_cb, &s->messages[n]);
+      s->messages[n].sender = i;
+      s->messages[n].seq = n;
+    }
+    ASSERT(nub_thread_create(&loop, &s->thread) == 0);
+  }
+
+  for (i = 0; i < SENDERS; i++)
+    nub_thread_enqueue(&senders[i].thread, &senders[i].start);
+
+  ASSERT(nub_loop_run(&loop, UV_RUN_DEFAULT) == 0);
+  ASSERT(SENDERS * ITEMS == received);
+  for (i = 0; i < SENDERS; i++)
+    ASSERT(ITEMS == next_seq[i]);
+
+  nub_loop_dispose(&loop);
+
+  return 0;
+}
@@ -0,0 +1,91 @@
+#include "nub.h"
+#include "run-tests.h"
+#include "helper.h"
+#include "uv.h"
+
+#define ONCE_NS (5 * 1000000)
+#define REPEAT_NS (2 * 1000000)
+#define REPEATS 5
+
+static nub_work_t once;
+static nub_work_t repeat;
+static nub_work_t cancelled;
+static uint64_t started;
+static uint64_t once_at;
+static uint64_t repeat_at[REPEATS];
+static int repeat_ran;
+static int done;
+
+
+static void maybe_dispose(nub_thread_t* thread) {
+  if (2 == ++done) {
+    ASSERT(UV_ENOENT == nub_thread_cancel_after(thread, &once));
+    nub_thread_dispose(thread, NULL);
+  }
+}
+
+
+/* Runs from the spawned thread. */
+static void once_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  once_at = uv_hrtime();
+  maybe_dispose(thread);
+}
+
+
+/* Runs from the spawned thread. */
+static void repeat_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  repeat_at[repeat_ran++] = uv_hrtime();
+  if (REPEATS != repeat_ran)
+    return;
+  ASSERT(0 == nub_thread_cancel_after(thread, work));
+  maybe_dispose(thread);
+}
+
+
+/* Runs from the spawned thread. */
+static void cancelled_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  ASSERT(0 && "cancelled work ran");
+}
+
+
+/* Runs from the spawned thread. */
+static void start_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  nub_work_init(&once, once_cb, NULL);
+  nub_work_init(&repeat, repeat_cb, NULL);
+  nub_work_init(&cancelled, cancelled_cb, NULL);
+
+  started = uv_hrtime();
+  nub_thread_enqueue_after(thread, &once, ONCE_NS);
+  nub_thread_enqueue_repeat(thread, &repeat, 0, REPEAT_NS);
+  nub_thread_enqueue_after(thread, &cancelled, ONCE_NS / 2);
+  ASSERT(0 == nub_thread_cancel_after(thread, &cancelled));
+  ASSERT(UV_ENOENT == nub_thread_cancel_after(thread, &cancelled));
+}
+
+
+TEST_IMPL(thread_enqueue_after) {
+  nub_loop_t loop;
+  nub_thread_t thread;
+  nub_work_t start;
+  int i;
+
+  done = 0;
+  repeat_ran = 0;
+  nub_loop_init(&loop);
+  ASSERT(0 == nub_thread_create(&loop, &thread));
+
+  nub_work_init(&start, start_cb, NULL);
+  nub_thread_enqueue(&thread, &start);
+
+  ASSERT(0 == nub_loop_run(&loop, UV_RUN_DEFAULT));
+
+  ASSERT(2 == done);
+  ASSERT(once_at - started >= ONCE_NS);
+  ASSERT(REPEATS == repeat_ran);
+  for (i = 1; i < REPEATS; i++)
+    ASSERT(repeat_at[i] - repeat_at[i - 1] >= REPEAT_NS - 1000000);
+
+  nub_loop_dispose(&loop);
+
+  return 0;
+}
@@ -0,0 +1,65 @@
+#include "nub.h"
+#include "run-tests.h"
+#include "helper.h"
+#include "uv.h"
+
+#include <stdio.h>  /* fopen, fread, remove */
+#include <string.h>  /* strstr */
+
+#define TRACE_FILE "nub-test-trace.json"
+#define TRACE_EVENTS 16
+#define LOCK_ITER 64
+
+static char contents[64 * 1024];
+
+
+/* Runs from the spawned thread. */
+static void lock_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  int i;
+
+  for (i = 0; i < LOCK_ITER; i++) {
+    nub_loop_lock(thread);
+    nub_loop_unlock(thread);
+  }
+
+  nub_thread_dispose(thread, NULL);
+}
+
+
+TEST_IMPL(trace_dump) {
+  nub_loop_t loop;
+  nub_thread_t thread;
+  nub_work_t work;
+  FILE* fp;
+  size_t n;
+
+  nub_loop_init(&loop);
+  ASSERT(0 == nub_loop_configure(&loop, NUB_LOOP_TRACE, TRACE_EVENTS));
+  ASSERT(nub_thread_create(&loop, &thread) == 0);
+
+  nub_work_init(&work, lock_cb, NULL);
+  nub_thread_enqueue(&thread, &work);
+  ASSERT(nub_loop_run(&loop, UV_RUN_DEFAULT) == 0);
+
+  ASSERT(0 == nub_loop_trace_dump(&loop, TRACE_FILE));
+  ASSERT(UV_EIO == nub_loop_trace_dump(&loop, "/nonexistent/trace.json"));
+  nub_loop_dispose(&loop);
+
+  fp = fopen(TRACE_FILE, "r");
+  ASSERT(NULL != fp);
+  n = fread(contents, 1, sizeof(contents) - 1, fp);
+  fclose(fp);
+  ASSERT(0 == remove(TRACE_FILE));
+  contents[n] = '\0';
+
+  ASSERT(NULL != strstr(contents, "{\"traceEvents\":["));
+  ASSERT(NULL != strstr(contents, "\"name\":\"loop 0\""));
+  ASSERT(NULL != strstr(contents, "\"name\":\"thread 1\""));
+  ASSERT(NULL != strstr(contents, "\"name\":\"locked\",\"ph\":\"B\""));
+  ASSERT(NULL != strstr(contents, "\"name\":\"locked\",\"ph\":\"E\""));
+  ASSERT(NULL != strstr(contents, "\"name\":\"halted\""));
+  /* Older events were overwritten once the rings were full. */
+  ASSERT(NULL == strstr(contents, "\"name\":\"dequeue\""));
+
+  return 0;
+}
@@ -0,0 +1,96 @@
+#include "nub.h"
+#include "run-tests.h"
+#include "helper.h"
+#include "uv.h"
+
+#define ITEMS 200
+/* Items from the last block that were never handed out may come first. */
+#define SLACK 64
+
+static nub_work_t* items[ITEMS];
+static nub_work_t* loop_items[ITEMS + SLACK];
+static int freed;
+static int completed;
+
+
+/* Runs from the main thread. */
+static void loop_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+}
+
+
+/* Runs from the spawned thread. */
+static void complete_cb(nub_work_t* work, int status) {
+  nub_thread_t* thread = (nub_thread_t*) work->data;
+
+  nub_thread_work_free(thread, work);
+  if (ITEMS == ++completed)
+    nub_thread_dispose(thread, NULL);
+}
+
+
+/* Runs from the spawned thread. Returns the items the main thread allocated,
+ * then sends some of its own through the loop. */
+static void free_cb(nub_thread_t* thread, nub_work_t* work, void* arg) {
+  nub_work_t* item;
+  int i;
+
+  nub_thread_work_free(thread, work);
+  if (ITEMS != ++freed)
+    return;
+
+  for (i = 0; i < ITEMS; i++) {
+    item = nub_thread_work_alloc(thread);
+    ASSERT(NULL != item);
+    nub_work_init(item, loop_cb, NULL);
+    item->data = thread;
+    nub_loop_enqueue(thread, item, complete_cb);
+  }
+}
+
+
+static int was_reallocated(nub_work_t* work) {
+  int i;
+
+  for (i = 0; i < ITEMS + SLACK; i++) {
+    if (work == loop_items[i])
+      return 1;
+  }
+  return 0;
+}
+
+
+TEST_IMPL(work_alloc) {
+  nub_loop_t loop;
+  nub_thread_t thread;
+  int i;
+  int j;
+
+  freed = 0;
+  completed = 0;
+  nub_loop_init(&loop);
+  ASSERT(0 == nub_thread_create(&loop, &thread));
+
+  for (i = 0; i < ITEMS; i++) {
+    items[i] = nub_loop_work_alloc(&loop);
+    ASSERT(NULL != items[i]);
+    for (j = 0; j < i; j++)
+      ASSERT(items[i] != items[j]);
+    nub_work_init(items[i], free_cb, NULL);
+    nub_thread_enqueue(&thread, items[i]);
+  }
+
+  ASSERT(0 == nub_loop_run(&loop, UV_RUN_DEFAULT));
+  ASSERT(ITEMS == completed);
+
+  /* Everything freed from the spawned thread made it back to this one. */
+  for (i = 0; i < ITEMS + SLACK; i++)
+    loop_items[i] = nub_loop_work_alloc(&loop);
+  for (i = 0; i < ITEMS; i++)
+    ASSERT(was_reallocated(items[i]));
+  for (i = 0; i < ITEMS + SLACK; i++)
+    nub_loop_work_free(&loop, loop_items[i]);
+
+  nub_loop_dispose(&loop);
+
+  return 0;
+}